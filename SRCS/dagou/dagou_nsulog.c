@@ -58,7 +58,8 @@ void *nsulog_init(int argc, char **argv)
 int nsulog_vf(unsigned char type, unsigned int mask, char *prog, char *modu,
 		char *file, char *func, int ln, const char *fmt, va_list ap)
 {
-	return dalog_vf(type, mask, prog, modu, file, func, ln, fmt, ap);
+	/* Any fmt, formatted as text */
+	return dalog_vf(type, mask & ~DALOG_LIT, prog, modu, file, func, ln, fmt, ap);
 }
 
 int nsulog_f(unsigned char type, unsigned int mask, char *prog, char *modu,
@@ -68,7 +69,7 @@ int nsulog_f(unsigned char type, unsigned int mask, char *prog, char *modu,
 	int ret;
 
 	va_start(ap, fmt);
-	ret = dalog_vf(type, mask, prog, modu, file, func, ln, fmt, ap);
+	ret = dalog_vf(type, mask & ~DALOG_LIT, prog, modu, file, func, ln, fmt, ap);
 	va_end(ap);
 
 	return ret;
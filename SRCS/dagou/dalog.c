@@ -1,20 +1,24 @@
 /* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include <libgen.h>
 #include <unistd.h>
 #include <time.h>
 #include <pthread.h>
-#include <sys/inotify.h>
-#include <sys/time.h>
-#include <sys/sysinfo.h>
+#include <dlfcn.h>
 
 #include <helper.h>
 #include <dalog.h>
+#include <dalog_inner.h>
+#include <dalog_setup.h>
 #include <nbuf.h>
 #include <narg.h>
 
@@ -27,18 +31,42 @@ static char *get_execpath(int *size);
 static char *get_basename(char *name);
 static char *get_progname();
 
+typedef struct _rulecomp_s rulecomp_s;
+static void rulecomp_free(rulecomp_s *rc);
+
 static unsigned int __dft_mask = DALOG_ALL;
 
 /*-----------------------------------------------------------------------
  * Local definition:
  */
 
-/* STRing ARRay to save programe name, module name, file name etc */
+/*
+ * STRing ARRay to save programe name, module name, file name etc.
+ *
+ * It's a open addressing hash table, lookup is lock free, insert must
+ * hold cc->mutex. The interned string never moved or freed until
+ * cleanup, so pointer compare is enough for names.
+ *
+ * When grow, the new table is published atomically, the old one is
+ * kept in the retired list because readers may still walk it.
+ */
+typedef struct _strslot_s strslot_s;
+struct _strslot_s {
+	unsigned int hash;
+	char *str;              /* Published last, NULL is empty */
+};
+
+typedef struct _strtab_s strtab_s;
+struct _strtab_s {
+	strtab_s *retired;
+	unsigned int size;      /* power of 2 */
+	unsigned int cnt;
+	strslot_s slot[0];
+};
+
 typedef struct _strarr_s strarr_s;
 struct _strarr_s {
-	int size;
-	int cnt;
-	char **arr;
+	strtab_s *tab;
 };
 
 typedef struct _rule_s rule_s;
@@ -60,6 +88,9 @@ struct _rule_s {
 
 	/* Which flag to be set or clear */
 	unsigned int set, clr;
+
+	/* Messages per hour, 0 is no limit, -1 is not given */
+	int rate;
 };
 
 typedef struct _rulearr_s rulearr_s;
@@ -69,14 +100,83 @@ struct _rulearr_s {
 	rule_s *arr;
 };
 
-/* How many logger slot */
-#define MAX_NLOGGER 8
-#define MAX_RLOGGER 8
+/*
+ * Compiled rules: rules are grouped by shape, i.e. which of prog, modu,
+ * file, func and line are given. In each shape, rules with same key are
+ * folded into one bucket, which remember the value and the order of the
+ * last rule touched each bit.
+ *
+ * A site looks up one bucket per shape, the bit from the latest rule
+ * wins, same as walking the rules one by one.
+ */
+#define RF_PROG 0x01
+#define RF_MODU 0x02
+#define RF_FILE 0x04
+#define RF_FUNC 0x08
+#define RF_LINE 0x10
+#define RF_CNT  32
+
+typedef struct _rulekey_s rulekey_s;
+struct _rulekey_s {
+	char *prog;
+	char *modu;
+	char *file;
+	char *func;
+	int line;
+};
+
+typedef struct _rulebkt_s rulebkt_s;
+struct _rulebkt_s {
+	rulekey_s key;
+
+	/* Bits touched by the rules and the result */
+	unsigned int touched, val;
+
+	/* Index of the last rule touched the bit */
+	int seq[32];
+
+	/* The last rule gave rate=, -1 if none */
+	int rate, rate_seq;
+};
+
+typedef struct _ruleshape_s ruleshape_s;
+struct _ruleshape_s {
+	unsigned int fields;    /* RF_XXX */
+	unsigned int size;      /* power of 2 */
+	unsigned int cnt;
+	rulebkt_s **slot;
+};
+
+struct _rulecomp_s {
+	rulecomp_s *retired;
+	unsigned int gen;
+
+	int shape_cnt;
+	ruleshape_s shape[RF_CNT];
+};
+
+typedef struct _dalsink_s dalsink_s;
+struct _dalsink_s {
+	DAL_NLOGGER nlogger;
+	DAL_RLOGGER rlogger;
+	unsigned int mask;      /* DALOG_TYPE_ALL bits it takes */
+};
+
+/* Copy on write, see sinks_publish */
+typedef struct _dalsinks_s dalsinks_s;
+struct _dalsinks_s {
+	dalsinks_s *retired;
+	unsigned int epoch;     /* Retired at */
+	unsigned int masked;    /* Bits some sink does not take */
+
+	int ncnt, rcnt;
+	dalsink_s *nsink, *rsink;
+};
 
 /* Control Center for dalog */
 typedef struct _dalogcc_s dalogcc_s;
 struct _dalogcc_s {
-	/** version is a ref count user change dalog arg */
+	/** version is a ref count user change dalog arg, all scopes */
 	int touches;
 
 	pid_t pid;
@@ -90,9 +190,15 @@ struct _dalogcc_s {
 
 	rulearr_s arr_rule;
 
-	unsigned char nlogger_cnt, rlogger_cnt;
-	DAL_NLOGGER nloggers[MAX_NLOGGER];
-	DAL_RLOGGER rloggers[MAX_RLOGGER];
+	/* Built by the writer of arr_rule, see rule_publish */
+	unsigned int rule_gen;
+	rulecomp_s *rule_comp;
+	int rule_readers;
+
+	/* The readers never lock, see dalog-logger */
+	dalsinks_s *sinks;
+	dalsinks_s *sinks_retired;
+	unsigned int sink_epoch;
 };
 
 static dalogcc_s *__g_dalogcc = NULL;
@@ -110,100 +216,320 @@ static inline void *dalog_cc(void)
 	return (void*)__g_dalogcc;
 }
 
+int dalog_noisy(void)
+{
+	return __noisy_mode;
+}
+
+int dalog_pid(void)
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+
+	return (int)cc->pid;
+}
+
+/* Registered before any sink, so they see the new pid in their handler */
+static void dalog_atfork_child(void)
+{
+	if (__g_dalogcc)
+		__g_dalogcc->pid = getpid();
+}
+
+int dalog_has_nlogger(void)
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	dalsinks_s *ss = natm_load(&cc->sinks);
+
+	return ss ? ss->ncnt : 0;
+}
+
+/*-----------------------------------------------------------------------
+ * Thread state
+ */
+static dalthr_s *__g_thr_list = NULL;
+
+static __thread dalthr_s *__t_thr = NULL;
+
+static pthread_key_t __thr_key;
+static pthread_once_t __thr_once = PTHREAD_ONCE_INIT;
+
+static void thr_release(void *user_data)
+{
+	dalthr_s *thr = (dalthr_s*)user_data;
+
+	nmem_free_sz(thr->arena);
+	thr->arena_size = 0;
+
+	if (!thr->ring || dalring_empty(thr->ring))
+		natm_store(&thr->state, DALTHR_FREE);
+	else
+		natm_store(&thr->state, DALTHR_DEAD);
+}
+
+static void thr_key_create(void)
+{
+	pthread_key_create(&__thr_key, thr_release);
+}
+
+dalthr_s *dalog_thr_list(void)
+{
+	return natm_load(&__g_thr_list);
+}
+
+dalthr_s *dalog_thr(void)
+{
+	dalthr_s *thr = __t_thr, *head;
+	int st;
+
+	if (dalog_likely(thr))
+		return thr;
+
+	pthread_once(&__thr_once, thr_key_create);
+
+	/* Reuse the slot of an exited thread */
+	for (thr = dalog_thr_list(); thr; thr = thr->next) {
+		st = DALTHR_FREE;
+		if (natm_cas(&thr->state, &st, DALTHR_LIVE))
+			break;
+	}
+
+	if (!thr) {
+		/* The counters in it are on a line of their own */
+		if (posix_memalign((void**)&thr, DALOG_CACHELINE, sizeof(dalthr_s)))
+			return NULL;
+		memset(thr, 0, sizeof(dalthr_s));
+		thr->state = DALTHR_LIVE;
+
+		head = dalog_thr_list();
+		do
+			thr->next = head;
+		while (!natm_cas(&__g_thr_list, &head, thr));
+	}
+
+	__t_thr = thr;
+	pthread_setspecific(__thr_key, thr);
+	return thr;
+}
+
 /*-----------------------------------------------------------------------
  * dalog-logger
+ *
+ * The sinks are copied on write under cc->mutex and published by one
+ * store. Each thread writes the epoch it entered at in dalthr_s, the
+ * replaced table is freed when no thread is still in an older epoch.
  */
-int dalog_add_logger(DAL_NLOGGER logger)
+
+/* One level bit of the type letter, the others are taken by all */
+static unsigned int sink_type_bit(unsigned char type)
 {
-	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
-	int i;
+	switch (type) {
+	case 'F': return DALOG_FATAL;
+	case 'A': return DALOG_ALERT;
+	case 'C': return DALOG_CRIT;
+	case 'E': return DALOG_ERR;
+	case 'W': return DALOG_WARNING;
+	case 'N': return DALOG_NOTICE;
+	case 'I': return DALOG_INFO;
+	case 'D': return DALOG_DEBUG;
+	default: return DALOG_TYPE_ALL;
+	}
+}
 
-	for (i = 0; i < MAX_NLOGGER; i++)
-		if (cc->nloggers[i] == logger)
-			return 0;
+static dalsinks_s *sinks_enter(dalogcc_s *cc, dalthr_s *thr)
+{
+	if (!thr->sink_depth++) {
+		natm_store(&thr->sink_epoch, natm_load(&cc->sink_epoch));
+		natm_fence();
+	}
+	return natm_load(&cc->sinks);
+}
 
-	if (cc->nlogger_cnt >= MAX_NLOGGER) {
-		if (__noisy_mode)
-			fprintf(stderr, "dalog_add_logger: Only up to %d logger supported.\n", MAX_NLOGGER);
-		return -1;
+static void sinks_leave(dalthr_s *thr)
+{
+	if (!--thr->sink_depth)
+		natm_store(&thr->sink_epoch, 0);
+}
+
+/* Under cc->mutex, with the room for one more */
+static dalsinks_s *sinks_copy(dalsinks_s *old, int more_n, int more_r)
+{
+	dalsinks_s *ss;
+	int ncnt = old ? old->ncnt : 0, rcnt = old ? old->rcnt : 0;
+
+	ss = (dalsinks_s*)nmem_alloz(sizeof(dalsinks_s) +
+			(ncnt + rcnt + more_n + more_r) * sizeof(dalsink_s), char);
+	ss->nsink = (dalsink_s*)(ss + 1);
+	ss->rsink = ss->nsink + ncnt + more_n;
+
+	if (old) {
+		ss->ncnt = ncnt;
+		ss->rcnt = rcnt;
+		memcpy(ss->nsink, old->nsink, ncnt * sizeof(dalsink_s));
+		memcpy(ss->rsink, old->rsink, rcnt * sizeof(dalsink_s));
+	}
+	return ss;
+}
+
+/* Under cc->mutex, free the retired tables no thread could still see */
+static void sinks_reclaim(dalogcc_s *cc)
+{
+	dalsinks_s **pp, *ss;
+	unsigned int e, min = ~0u;
+	dalthr_s *thr;
+
+	natm_fence();
+	for (thr = dalog_thr_list(); thr; thr = thr->next) {
+		e = natm_load(&thr->sink_epoch);
+		if (e && e < min)
+			min = e;
 	}
 
-	cc->nloggers[cc->nlogger_cnt++] = logger;
-	return 0;
+	for (pp = &cc->sinks_retired; (ss = *pp); ) {
+		if (ss->epoch <= min) {
+			*pp = ss->retired;
+			nmem_free(ss);
+		} else
+			pp = &ss->retired;
+	}
 }
 
-int dalog_del_logger(DAL_NLOGGER logger)
+static void sinks_publish(dalogcc_s *cc, dalsinks_s *ss)
 {
-	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	dalsinks_s *old = cc->sinks;
 	int i;
 
-	for (i = 0; i < cc->nlogger_cnt; i++)
-		if (cc->nloggers[i] == logger) {
-			cc->nlogger_cnt--;
-			cc->nloggers[i] = cc->nloggers[cc->nlogger_cnt];
-			cc->nloggers[cc->nlogger_cnt] = NULL;
-			return 0;
-		}
+	for (i = 0; i < ss->ncnt; i++)
+		ss->masked |= ss->nsink[i].mask ^ DALOG_TYPE_ALL;
+	for (i = 0; i < ss->rcnt; i++)
+		ss->masked |= ss->rsink[i].mask ^ DALOG_TYPE_ALL;
 
-	return -1;
+	natm_store(&cc->sinks, ss);
+
+	/* Who entered after this can only see ss */
+	if (old) {
+		old->epoch = natm_add(&cc->sink_epoch, 1);
+		old->retired = cc->sinks_retired;
+		cc->sinks_retired = old;
+	}
+	sinks_reclaim(cc);
 }
 
-int dalog_add_rlogger(DAL_RLOGGER logger)
+static dalsink_s *sinks_find(dalsink_s *arr, int cnt, void *logger)
 {
-	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
 	int i;
 
-	for (i = 0; i < MAX_RLOGGER; i++)
-		if (cc->rloggers[i] == logger)
-			return 0;
+	for (i = 0; i < cnt; i++)
+		if ((void*)arr[i].nlogger == logger || (void*)arr[i].rlogger == logger)
+			return &arr[i];
+	return NULL;
+}
 
-	if (cc->rlogger_cnt >= MAX_RLOGGER) {
-		if (__noisy_mode)
-			fprintf(stderr, "dalog_add_logger: Only up to %d logger supported.\n", MAX_RLOGGER);
+/* Update the mask if already there and update is set */
+static int sinks_add(DAL_NLOGGER nlogger, DAL_RLOGGER rlogger, unsigned int mask, int update)
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	void *logger = nlogger ? (void*)nlogger : (void*)rlogger;
+	dalsinks_s *ss;
+	dalsink_s *sk;
+
+	if (!logger)
 		return -1;
+	mask &= DALOG_TYPE_ALL;
+
+	pthread_mutex_lock(&cc->mutex);
+	ss = cc->sinks;
+	sk = ss ? sinks_find(nlogger ? ss->nsink : ss->rsink, nlogger ? ss->ncnt : ss->rcnt, logger) : NULL;
+	if (sk && (!update || sk->mask == mask)) {
+		pthread_mutex_unlock(&cc->mutex);
+		return 0;
 	}
 
-	cc->rloggers[cc->rlogger_cnt++] = logger;
+	ss = sinks_copy(cc->sinks, !sk && nlogger, !sk && rlogger);
+	if (!sk)
+		sk = nlogger ? &ss->nsink[ss->ncnt++] : &ss->rsink[ss->rcnt++];
+	else
+		sk = sinks_find(nlogger ? ss->nsink : ss->rsink, nlogger ? ss->ncnt : ss->rcnt, logger);
+	sk->nlogger = nlogger;
+	sk->rlogger = rlogger;
+	sk->mask = mask;
+
+	sinks_publish(cc, ss);
+	pthread_mutex_unlock(&cc->mutex);
 	return 0;
 }
 
-int dalog_del_rlogger(DAL_RLOGGER logger)
+static int sinks_del(void *logger, int is_n)
 {
 	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
-	int i;
+	dalsinks_s *ss;
+	dalsink_s *arr;
+	int i, *cnt;
 
-	for (i = 0; i < cc->rlogger_cnt; i++)
-		if (cc->rloggers[i] == logger) {
-			cc->rlogger_cnt--;
-			cc->rloggers[i] = cc->rloggers[cc->rlogger_cnt];
-			cc->rloggers[cc->rlogger_cnt] = NULL;
-			return 0;
+	pthread_mutex_lock(&cc->mutex);
+	ss = cc->sinks;
+	if (!ss || !sinks_find(is_n ? ss->nsink : ss->rsink, is_n ? ss->ncnt : ss->rcnt, logger)) {
+		pthread_mutex_unlock(&cc->mutex);
+		return -1;
+	}
+
+	ss = sinks_copy(cc->sinks, 0, 0);
+	arr = is_n ? ss->nsink : ss->rsink;
+	cnt = is_n ? &ss->ncnt : &ss->rcnt;
+
+	/* Keep the order they were added */
+	for (i = 0; i < *cnt; i++)
+		if ((void*)arr[i].nlogger == logger || (void*)arr[i].rlogger == logger) {
+			memmove(&arr[i], &arr[i + 1], (*cnt - i - 1) * sizeof(dalsink_s));
+			(*cnt)--;
+			break;
 		}
 
-	return -1;
+	sinks_publish(cc, ss);
+	pthread_mutex_unlock(&cc->mutex);
+	return 0;
 }
 
-/*-----------------------------------------------------------------------
- * implementation
- */
-static void dalog_parse_mask(char *mask, unsigned int *set, unsigned int *clr);
+int dalog_add_logger(DAL_NLOGGER logger)
+{
+	return sinks_add(logger, NULL, DALOG_TYPE_ALL, 0);
+}
+
+int dalog_del_logger(DAL_NLOGGER logger)
+{
+	return sinks_del((void*)logger, 1);
+}
 
-static uint64_t os_uptime()
+int dalog_add_rlogger(DAL_RLOGGER logger)
 {
-	struct sysinfo info;
-	struct timeval tv;
-	uint64_t ms;
+	return sinks_add(NULL, logger, DALOG_TYPE_ALL, 0);
+}
 
-	sysinfo(&info);
-	gettimeofday(&tv,NULL);
+int dalog_del_rlogger(DAL_RLOGGER logger)
+{
+	return sinks_del((void*)logger, 0);
+}
 
-	ms = (uint64_t)info.uptime;
-	ms *= 1000;
-	ms += tv.tv_usec / 1000;
+/**
+ * \brief Add the logger, or change its mask if already added.
+ *
+ * Only the levels in mask, DALOG_TYPE_ALL bits, go to it. The lines
+ * without a level, like dalogs and the assert, go to all.
+ */
+int dalog_add_logger_mask(DAL_NLOGGER logger, unsigned int mask)
+{
+	return sinks_add(logger, NULL, mask, 1);
+}
 
-	return ms;
+int dalog_add_rlogger_mask(DAL_RLOGGER logger, unsigned int mask)
+{
+	return sinks_add(NULL, logger, mask, 1);
 }
 
+/*-----------------------------------------------------------------------
+ * implementation
+ */
+static void dalog_parse_mask(char *mask, unsigned int *set, unsigned int *clr);
+
 /**
  * \brief Other module call this to use already inited CC
  *
@@ -262,17 +588,51 @@ static void dalog_init_default()
 	narg_free(argc, argv);
 }
 
+/* Global epoch, see DALOG_SITE_VER */
+unsigned int __dalog_epoch = 0;
+
+/* Interned name is prefixed with its epoch */
+#define NAME_EPOCH(name) ((unsigned int*)(void*)(name) - 1)
+
+static void sites_update(const char *name);
+
 void dalog_touch(void)
 {
 	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
 
-	cc->touches++;
+	natm_add(&__dalog_epoch, 1);
+	natm_add(&cc->touches, 1);
+	sites_update(NULL);
 }
 inline int dalog_touches(void)
 {
 	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
 
-	return cc->touches;
+	return natm_load(&cc->touches);
+}
+
+/*
+ * Only the sites have the same name as the most specific one of the
+ * rule could be affected. No name given, touch all.
+ *
+ * The epochs are for the sites open coded with DALOG_INNER_VAR_DEF.
+ */
+static void rule_touch(char *prog, char *modu, char *file, char *func)
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	char *name;
+
+	name = func ? func : file ? file : modu ? modu : prog;
+	if (!name) {
+		dalog_touch();
+		return;
+	}
+
+	natm_add(NAME_EPOCH(name), 1);
+
+	/* nsulog_touches users have no scope, bump it anyway */
+	natm_add(&cc->touches, 1);
+	sites_update(name);
 }
 
 static char *get_basename(char *name)
@@ -338,72 +698,6 @@ static void load_cfg_file(char *path)
 	nmem_free_s(line);
 }
 
-static void apply_rtcfg(char *path)
-{
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t bytes;
-
-	static int line_applied = 0;
-	int line_cnt = 0;
-	FILE *fp;
-
-	fp = fopen(path, "rt");
-	if (!fp)
-		return;
-
-	while ((bytes = getline(&line, &len, fp)) != -1) {
-		if (line_cnt++ < line_applied)
-			continue;
-		dalog_rule_add(line);
-		line_applied++;
-	}
-
-	fclose(fp);
-	nmem_free_s(line);
-}
-
-static void* thread_monitor_cfgfile(void *user_data)
-{
-	char *path = (char*)user_data;
-	int fd, wd, len, tmp_len;
-	char buffer[2048], *offset = NULL;
-	struct inotify_event *event;
-
-	fd = inotify_init();
-	if (fd < 0)
-		goto quit;
-
-	FILE *fp = fopen(path, "a+");
-	if (fp)
-		fclose(fp);
-
-	wd = inotify_add_watch(fd, path, IN_MODIFY);
-	if (wd < 0)
-		goto quit;
-
-	while ((len = read(fd, buffer, sizeof(buffer)))) {
-		offset = buffer;
-		event = (struct inotify_event*)(void*)buffer;
-
-		while (((char*)event - buffer) < len) {
-			if (event->wd == wd) {
-				if (IN_MODIFY & event->mask)
-					apply_rtcfg(path);
-				break;
-			}
-
-			tmp_len = sizeof(struct inotify_event) + event->len;
-			event = (struct inotify_event*)(void*)(offset + tmp_len);
-			offset += tmp_len;
-		}
-	}
-
-quit:
-	free((void*)path);
-	return NULL;
-}
-
 static void process_cfg(int argc, char *argv[])
 {
 	char *cfg;
@@ -441,12 +735,35 @@ static void process_cfg(int argc, char *argv[])
 
 	if (!cfg)
 		cfg = getenv("DALOG_RTCFG");
-	if (!cfg)
-		cfg = "/tmp/dalog.rtcfg";
-	if (cfg) {
-		pthread_t thread;
-		pthread_create(&thread, NULL, thread_monitor_cfgfile, strdup(cfg));
+
+	/* Counters in DALOG_STATS_PATH, renewed by the ctl thread, gone without it */
+	if (getenv("DALOG_STATS") && atoi(getenv("DALOG_STATS")))
+		dalog_stats_start();
+
+	/* dr talk to the control socket, the file is watched only if given */
+	dalog_ctl_start(cfg);
+
+	/*
+	 * 3. Asynchronous output, DALOG_ASYNC=<ring size in KB>
+	 */
+	cfg = getenv("DALOG_ASYNC");
+	if (cfg)
+		dalog_async_start((unsigned int)atoi(cfg) * 1024);
+
+	/*
+	 * 4. Binary capture, the text is rendered by the async thread
+	 */
+	if (getenv("DALOG_BINARY")) {
+		dalog_async_start(0);
+		dalog_async_binary(1);
 	}
+
+	/*
+	 * 5. Flight recorder, DALOG_FLIGHT=<slot size of each thread in KB>
+	 */
+	cfg = getenv("DALOG_FLIGHT");
+	if (cfg)
+		dalog_flight_start((unsigned int)atoi(cfg) * 1024);
 }
 
 static void rule_add_from_mask(unsigned int mask)
@@ -504,147 +821,462 @@ void dalog_set_default_mask(unsigned int mask)
 	__dft_mask = mask;
 }
 
-static void dalog_cleanup()
+static void strarr_free(strarr_s *sa)
 {
-	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
-	int i;
+	strtab_s *tab, *retired;
+	unsigned int i;
+
+	tab = sa->tab;
+	if (!tab)
+		return;
+
+	for (i = 0; i < tab->size; i++)
+		if (tab->slot[i].str)
+			nmem_free(NAME_EPOCH(tab->slot[i].str));
 
-	for (i = 0; i < cc->arr_file_name.cnt; i++)
-		nmem_free_s((void*)cc->arr_file_name.arr[i]);
-	nmem_free_s((void*)cc->arr_file_name.arr);
+	for (; tab; tab = retired) {
+		retired = tab->retired;
+		nmem_free(tab);
+	}
+	sa->tab = NULL;
+}
 
-	for (i = 0; i < cc->arr_modu_name.cnt; i++)
-		nmem_free_s((void*)cc->arr_modu_name.arr[i]);
-	nmem_free_s((void*)cc->arr_modu_name.arr);
+/*-----------------------------------------------------------------------
+ * Call sites: the section "dalog_sites" of each module, see dalsite_s
+ */
+typedef struct _sitetab_s sitetab_s;
+struct _sitetab_s {
+	dalsite_s *start, *stop;
+};
 
-	for (i = 0; i < cc->arr_prog_name.cnt; i++)
-		nmem_free_s((void*)cc->arr_prog_name.arr[i]);
-	nmem_free_s((void*)cc->arr_prog_name.arr);
+/* One per module, grown as the modules come, under __site_mutex */
+static sitetab_s *__site_tabs = NULL;
+static int __site_tab_cnt = 0;
+static int __site_tab_size = 0;
 
-	for (i = 0; i < cc->arr_func_name.cnt; i++)
-		nmem_free_s((void*)cc->arr_func_name.arr[i]);
-	nmem_free_s((void*)cc->arr_func_name.arr);
+/*
+ * Not in a table: the sites of C++, see DALOG_SITE_ATTR, or run before
+ * the constructor of their module. Kept by the first run.
+ */
+static dalsite_s **__site_loose = NULL;
+static int __site_loose_cnt = 0;
+static int __site_loose_size = 0;
 
-	nmem_free_s((void*)cc->arr_rule.arr);
+static pthread_mutex_t __site_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Under __site_mutex, the rate is stored first, it goes with the mask */
+static void site_calc(dalsite_s *site)
+{
+	unsigned int mask, rate;
+
+	if (!site->prog_name)
+		natm_store(&site->prog_name, dalog_prog_name_add(NULL));
+	if (!site->modu_name)
+		natm_store(&site->modu_name, dalog_modu_name_add((char*)site->modu));
+	if (!site->file_name)
+		natm_store(&site->file_name, dalog_file_name_add((char*)site->file));
+	if (!site->func_name)
+		natm_store(&site->func_name, dalog_func_name_add((char*)site->func));
+
+	mask = dalog_calc_site(site->prog_name, site->modu_name, site->file_name,
+			site->func_name, site->line, &rate);
+	if (!(mask & site->level))
+		mask = __dalog_flight;
+
+	natm_store(&site->rate, rate);
+	natm_store(&site->mask, mask);
 }
 
-void *dalog_init(int argc, char **argv)
+static int site_has(dalsite_s *site, const char *name)
 {
-	dalogcc_s *cc;
+	return !name || name == site->func_name || name == site->file_name ||
+		name == site->modu_name || name == site->prog_name;
+}
 
-	if (__g_dalogcc)
-		return (void*)__g_dalogcc;
+static void sitetab_calc(sitetab_s *tab, const char *name)
+{
+	dalsite_s *site;
 
-	cc = (dalogcc_s*)nmem_alloz(1, dalogcc_s);
-	__g_dalogcc = cc;
+	for (site = tab->start; site < tab->stop; site++)
+		if (site_has(site, name))
+			site_calc(site);
+}
 
-	pthread_mutex_init(&cc->mutex, 0);
-	cc->pid = getpid();
+static int site_in_tabs(dalsite_s *site)
+{
+	int i;
 
-	/* Set default before configure file */
+	for (i = 0; i < __site_tab_cnt; i++)
+		if (site >= __site_tabs[i].start && site < __site_tabs[i].stop)
+			return 1;
+	return 0;
+}
+
+static void loose_add(dalsite_s *site)
+{
+	dalsite_s **loose;
+	int size;
+
+	if (__site_loose_cnt == __site_loose_size) {
+		size = __site_loose_size ? __site_loose_size * 2 : 64;
+		loose = (dalsite_s**)nmem_realloc(__site_loose, size * sizeof(dalsite_s*));
+		if (!loose)
+			return;
+		__site_loose = loose;
+		__site_loose_size = size;
+	}
+	__site_loose[__site_loose_cnt++] = site;
+}
+
+/* Those in [start, stop), or in the module of addr if stop is NULL */
+static void loose_del(dalsite_s *start, dalsite_s *stop, void *addr)
+{
+	Dl_info mod, info;
+	dalsite_s *site;
+	int i;
+
+	if (!stop && !dladdr(addr, &mod))
+		return;
+
+	for (i = 0; i < __site_loose_cnt; ) {
+		site = __site_loose[i];
+		if (stop ? (site >= start && site < stop) :
+				(dladdr(site, &info) && info.dli_fbase == mod.dli_fbase))
+			__site_loose[i] = __site_loose[--__site_loose_cnt];
+		else
+			i++;
+	}
+}
+
+/*
+ * All the sites have the name, or all if NULL. The rules are read
+ * after the lock, the last one see the last change.
+ */
+static void sites_update(const char *name)
+{
+	int i;
+
+	pthread_mutex_lock(&__site_mutex);
+	for (i = 0; i < __site_tab_cnt; i++)
+		sitetab_calc(&__site_tabs[i], name);
+	for (i = 0; i < __site_loose_cnt; i++)
+		if (site_has(__site_loose[i], name))
+			site_calc(__site_loose[i]);
+	pthread_mutex_unlock(&__site_mutex);
+}
+
+/**
+ * \brief Called by the constructor in dalog.h, once per module.
+ *
+ * Before dalog_init the table is only kept, dalog_init calculate them.
+ */
+void dalog_sites_add(dalsite_s *start, dalsite_s *stop)
+{
+	sitetab_s *tab = NULL, *tabs;
+	int i, size;
+
+	pthread_mutex_lock(&__site_mutex);
+	for (i = 0; i < __site_tab_cnt; i++)
+		if (__site_tabs[i].start == start)
+			break;
+
+	if (i == __site_tab_cnt && __site_tab_cnt == __site_tab_size) {
+		size = __site_tab_size ? __site_tab_size * 2 : 16;
+		tabs = (sitetab_s*)nmem_realloc(__site_tabs, size * sizeof(sitetab_s));
+		if (tabs) {
+			__site_tabs = tabs;
+			__site_tab_size = size;
+		} else if (__noisy_mode)
+			fprintf(stderr, "dalog_sites_add: No memory for module %d.\n", __site_tab_cnt);
+	}
+
+	if (i == __site_tab_cnt && __site_tab_cnt < __site_tab_size) {
+		tab = &__site_tabs[__site_tab_cnt++];
+		tab->start = start;
+		tab->stop = stop;
+
+		/* Run by another constructor before this one */
+		loose_del(start, stop, NULL);
+	}
+
+	if (tab && __g_dalogcc)
+		sitetab_calc(tab, NULL);
+	pthread_mutex_unlock(&__site_mutex);
+}
+
+/* A dlclose()'d module of C++, addr is in it, see the destructor in dalog.h */
+void dalog_sites_unload(void *addr)
+{
+	pthread_mutex_lock(&__site_mutex);
+	loose_del(NULL, NULL, addr);
+	pthread_mutex_unlock(&__site_mutex);
+}
+
+/* A dlclose()'d module, see the destructor in dalog.h */
+void dalog_sites_del(dalsite_s *start)
+{
+	int i;
+
+	pthread_mutex_lock(&__site_mutex);
+	for (i = 0; i < __site_tab_cnt; i++)
+		if (__site_tabs[i].start == start) {
+			__site_tabs[i] = __site_tabs[--__site_tab_cnt];
+			break;
+		}
+	pthread_mutex_unlock(&__site_mutex);
+}
+
+/**
+ * \brief A site run before dalog_init, or not in the table.
+ */
+void dalog_site_setup(dalsite_s *site)
+{
+	/* dalog_init takes __site_mutex */
+	dalog_cc();
+
+	/* Done by another thread, or by dalog_init */
+	pthread_mutex_lock(&__site_mutex);
+	if (site->mask & DALOG_NEW) {
+		if (!site_in_tabs(site))
+			loose_add(site);
+		site_calc(site);
+	}
+	pthread_mutex_unlock(&__site_mutex);
+}
+
+static dalsite_s *__rep_pending = NULL;
+static void rep_pending_flush(void);
+
+static void dalog_cleanup()
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+
+	rep_pending_flush();
+
+	/*
+	 * The async thread may be started by dalog_setup before dalog_init,
+	 * its atexit runs after this, stop it before the names are freed.
+	 */
+	dalog_async_stop();
+
+	strarr_free(&cc->arr_file_name);
+	strarr_free(&cc->arr_modu_name);
+	strarr_free(&cc->arr_prog_name);
+	strarr_free(&cc->arr_func_name);
+
+	nmem_free_s((void*)cc->arr_rule.arr);
+	rulecomp_free(cc->rule_comp);
+
+	/* The async thread is stopped, but others may still log */
+	pthread_mutex_lock(&cc->mutex);
+	sinks_reclaim(cc);
+	pthread_mutex_unlock(&cc->mutex);
+}
+
+void *dalog_init(int argc, char **argv)
+{
+	dalogcc_s *cc;
+
+	if (__g_dalogcc)
+		return (void*)__g_dalogcc;
+
+	cc = (dalogcc_s*)nmem_alloz(1, dalogcc_s);
+	__g_dalogcc = cc;
+
+	pthread_mutex_init(&cc->mutex, 0);
+	cc->pid = getpid();
+	cc->sink_epoch = 1;
+	pthread_atfork(NULL, NULL, dalog_atfork_child);
+
+	dalog_time_init();
+
+	/* Before process_cfg, the async thread should quit before cleanup */
+	atexit(dalog_cleanup);
+
+	/* Set default before configure file */
 	if (__dft_mask)
 		rule_add_from_mask(__dft_mask);
 
 	process_cfg(argc, argv);
 
+	/* All the sites known by now are calculated here */
 	dalog_touch();
 
-	atexit(dalog_cleanup);
-
 	return (void*)__g_dalogcc;
 }
 
+/* Power of 2, kept by the thread, the too long ones are left to the caller */
+static char *arena_grow(dalthr_s *thr, int size)
+{
+	int n;
+
+	if (size > DALTHR_ARENA_MAX)
+		return NULL;
+	for (n = DALTHR_ARENA_MIN; n < size; n <<= 1)
+		;
+
+	/* The content is not needed, no realloc */
+	nmem_free_s(thr->arena);
+	thr->arena = nmem_alloc(n, char);
+	thr->arena_size = thr->arena ? n : 0;
+	thr->stat.heap++;
+	return thr->arena;
+}
+
 int dalog_vf(unsigned char type, unsigned int mask, char *prog, char *modu,
 		char *file, char *func, int ln, const char *fmt, va_list ap)
 {
 	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
 	va_list ap_copy0, ap_copy1;
 
-	char buffer[4096], *bufptr = buffer;
-	int i, ret, ofs, bufsize = sizeof(buffer);
+	char buffer[4096], *bufptr = buffer, *heap = NULL;
+	int i, ret, ofs, busy, bufsize = sizeof(buffer);
+	unsigned int bit, lit;
+	dalsinks_s *ss;
+	dalthr_s *thr;
 
-	char tmbuf[128];
-	time_t t;
-	struct tm *tmp;
+	unsigned long long atm = 0, t0;
+	dalhead_s hd;
 
-	unsigned long uptime = 0;
+	/* Only the mask of a site, never DALOG_NEW, may carry DALOG_LIT */
+	lit = (mask & (DALOG_LIT | DALOG_NEW)) == DALOG_LIT;
+	mask &= ~DALOG_LIT;
 
-	for (i = 0; i < cc->rlogger_cnt; i++)
-		if (cc->rloggers[i]) {
-			va_copy(ap_copy1, ap);
-			cc->rloggers[i](type, mask, prog, modu, file, func, ln, fmt, ap_copy1);
-			va_end(ap_copy1);
-		}
+	/* A forked child, the control channel is made by its first log */
+	if (dalog_unlikely(__dalog_ctl_stale))
+		dalog_ctl_restart();
+
+	/* Repeats collapsed by a site of rate= are told before the others */
+	if (dalog_unlikely(natm_load(&__rep_pending)))
+		rep_pending_flush();
 
-	if (dalog_unlikely(!cc->nlogger_cnt))
+	/* The flight recorder takes all, the masked off sites are only for it */
+	if (dalog_unlikely(__dalog_flight)) {
+		va_copy(ap_copy1, ap);
+		dalog_flight_put(type, prog, modu, file, func, ln, fmt, lit, ap_copy1);
+		va_end(ap_copy1);
+	}
+	if (dalog_unlikely(mask == DALOG_FLT))
 		return 0;
 
-	if (mask & (DALOG_RTM | DALOG_ATM))
-		uptime = os_uptime();
+	/* No memory for the slot of this thread, no safe way to the sinks */
+	thr = dalog_thr();
+	if (dalog_unlikely(!thr))
+		return 0;
+	thr->stat.msgs[dalog_stats_level(type)]++;
+
+	ss = sinks_enter(cc, thr);
+	if (dalog_likely(ss)) {
+		bit = sink_type_bit(type);
+		for (i = 0; i < ss->rcnt; i++)
+			if (ss->rsink[i].mask & bit) {
+				t0 = dalog_time_ns();
+				va_copy(ap_copy1, ap);
+				ss->rsink[i].rlogger(type, mask, prog, modu, file, func, ln, fmt, ap_copy1);
+				va_end(ap_copy1);
+				dalog_stats_sink(thr, t0);
+			}
+	}
+	i = ss ? ss->ncnt : 0;
+	sinks_leave(thr);
 
-	ofs = 0;
+	if (dalog_unlikely(!i && !__dalog_blogger_cnt))
+		return 0;
 
-	/* Type */
-	if (dalog_likely(type))
-		ofs += sprintf(bufptr, "|%c|", type);
+	/* Binary mode, leave the formatting to the async thread */
+	if (__dalog_async_on && __dalog_async_bin && lit &&
+			!dalog_async_push_bin(type, mask, prog, modu, file, func, ln, fmt, ap))
+		return 0;
 
-	/* Time */
+	hd.rtm = 0;
+	hd.ntm = 0;
+	hd.atm = NULL;
 	if (mask & DALOG_RTM)
-		ofs += sprintf(bufptr + ofs, "s:%lu|", uptime);
+		hd.rtm = (unsigned long)(dalog_time_rel() / 1000000);
+	if (mask & DALOG_NTM)
+		hd.ntm = dalog_time_ns();
 	if (mask & DALOG_ATM) {
-		t = time(NULL);
-		tmp = localtime(&t);
-		strftime(tmbuf, sizeof(tmbuf), "%Y/%m/%d %H:%M:%S", tmp);
-		ofs += sprintf(bufptr + ofs, "S:%s.%03d|", tmbuf, (unsigned int)(uptime % 1000));
+		atm = dalog_time_abs();
+		hd.atm = dalog_time_date((time_t)(atm / 1000000000));
 	}
 
-	/* ID */
-	if (mask & DALOG_PID)
-		ofs += sprintf(bufptr + ofs, "j:%d|", (int)cc->pid);
-	if (mask & DALOG_TID)
-		ofs += sprintf(bufptr + ofs, "x:%x|", (int)pthread_self());
+	hd.type = type;
+	hd.mask = mask;
+	hd.pid = (int)cc->pid;
+	hd.tid = (unsigned int)pthread_self();
+	hd.atm_ms = (unsigned int)(atm / 1000000 % 1000);
+	hd.prog = prog;
+	hd.modu = modu;
+	hd.file = file;
+	hd.func = func;
+	hd.line = ln;
 
-	/* Name and LINE */
-	if ((mask & DALOG_PROG) && prog)
-		ofs += sprintf(bufptr + ofs, "P:%s|", prog);
-
-	if ((mask & DALOG_MODU) && modu)
-		ofs += sprintf(bufptr + ofs, "M:%s|", modu);
-
-	if ((mask & DALOG_FILE) && file)
-		ofs += sprintf(bufptr + ofs, "F:%s|", file);
-
-	if ((mask & DALOG_FUNC) && func)
-		ofs += sprintf(bufptr + ofs, "H:%s|", func);
-
-	if (mask & DALOG_LINE)
-		ofs += sprintf(bufptr + ofs, "L:%d|", ln);
+	/*
+	 * Once a long message grown the arena, the ones as long are formatted
+	 * once, with no malloc. A nested call keeps off the arena in use.
+	 */
+	busy = thr->arena_busy;
+	thr->arena_busy = 1;
+	if (!busy && thr->arena_size > bufsize) {
+		bufptr = thr->arena;
+		bufsize = thr->arena_size;
+	}
 
-	if (dalog_likely(ofs))
-		ofs += sprintf(bufptr + ofs, " ");
+	ofs = dalfmt_head(bufptr, &hd);
 
 	va_copy(ap_copy0, ap);
 	ret = vsnprintf(bufptr + ofs, bufsize - ofs, fmt, ap_copy0);
 	va_end(ap_copy0);
 	if (ret > bufsize - ofs - 1) {
 		bufsize = ret + ofs + 1;
-		bufptr = nmem_alloc(bufsize, char);
+		bufptr = busy ? NULL : arena_grow(thr, bufsize);
+		if (!bufptr) {
+			bufptr = heap = nmem_alloc(bufsize, char);
+			thr->stat.heap++;
+		}
 
-		memcpy(bufptr, buffer, ofs);
+		ofs = dalfmt_head(bufptr, &hd);
 		ret = vsnprintf(bufptr + ofs, bufsize - ofs, fmt, ap);
 	}
 
 	ret += ofs;
+	thr->stat.bytes += ret;
 
-	for (i = 0; i < cc->nlogger_cnt; i++)
-		if (cc->nloggers[i])
-			cc->nloggers[i](bufptr, ret);
+	if (!__dalog_async_on || dalog_async_push(DALREC_TEXT, bufptr, ret + 1) > 0)
+		dalog_emit(bufptr, ret);
 
-	if (bufptr != buffer)
-		nmem_free(bufptr);
+	nmem_free_s(heap);
+	thr->arena_busy = busy;
 	return ret;
 }
 
+/* The level is told by the "|X|" made by dalfmt_head */
+void dalog_emit(char *content, int len)
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	dalthr_s *thr = dalog_thr();
+	unsigned int bit = DALOG_TYPE_ALL;
+	unsigned long long t0;
+	dalsinks_s *ss;
+	int i;
+
+	if (dalog_unlikely(!thr))
+		return;
+
+	ss = sinks_enter(cc, thr);
+	if (dalog_likely(ss)) {
+		if (ss->masked && content[0] == '|' && len > 2 && content[2] == '|')
+			bit = sink_type_bit((unsigned char)content[1]);
+		for (i = 0; i < ss->ncnt; i++)
+			if (ss->nsink[i].mask & bit) {
+				t0 = dalog_time_ns();
+				ss->nsink[i].nlogger(content, len);
+				dalog_stats_sink(thr, t0);
+			}
+	}
+	sinks_leave(thr);
+}
+
 int dalog_f(unsigned char type, unsigned int mask, char *prog, char *modu,
 		char *file, char *func, int ln, const char *fmt, ...)
 {
@@ -658,96 +1290,155 @@ int dalog_f(unsigned char type, unsigned int mask, char *prog, char *modu,
 	return ret;
 }
 
-static int strarr_find(strarr_s *sa, char *str)
+static unsigned int strarr_hash(const char *str, int len)
 {
+	unsigned int h = 2166136261u;
 	int i;
 
-	if (dalog_unlikely(!str))
-		return -1;
-
-	for (i = 0; i < sa->cnt; i++)
-		if (sa->arr[i] && !strcmp(sa->arr[i], str))
-			return i;
-	return -1;
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)str[i]) * 16777619u;
+	return h;
 }
 
-static char *strarr_add(strarr_s *sa, char *str)
+/* Lock free, the str is not '\0' ended, len given */
+static char *strarr_find(strtab_s *tab, const char *str, int len, unsigned int hash)
 {
-	int pos = strarr_find(sa, str);
+	unsigned int i, mask;
+	char *s;
 
-	if (pos != -1)
-		return sa->arr[pos];
+	if (dalog_unlikely(!tab))
+		return NULL;
 
-	if (sa->cnt >= sa->size)
-		ARR_INC(256, sa->arr, sa->size, char*);
+	mask = tab->size - 1;
+	for (i = hash & mask; (s = natm_load(&tab->slot[i].str)); i = (i + 1) & mask)
+		if (tab->slot[i].hash == hash && !strncmp(s, str, len) && !s[len])
+			return s;
+	return NULL;
+}
 
-	sa->arr[sa->cnt] = strdup(str);
-	sa->cnt++;
+static void strtab_put(strtab_s *tab, char *str, unsigned int hash)
+{
+	unsigned int i, mask = tab->size - 1;
 
-	/* Return the position been inserted */
-	return sa->arr[sa->cnt - 1];
+	for (i = hash & mask; tab->slot[i].str; i = (i + 1) & mask)
+		;
+	tab->slot[i].hash = hash;
+	natm_store(&tab->slot[i].str, str);
+	tab->cnt++;
 }
 
-char *dalog_file_name_add(char *name)
+static char *strarr_add(strarr_s *sa, const char *str, int len)
 {
 	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
-	char *newstr, *newname = get_basename(name);
+	unsigned int i, hash = strarr_hash(str, len);
+	strtab_s *tab, *newtab;
+	char *s;
+
+	s = strarr_find(natm_load(&sa->tab), str, len, hash);
+	if (dalog_likely(s))
+		return s;
 
 	pthread_mutex_lock(&cc->mutex);
-	newstr = strarr_add(&cc->arr_file_name, newname);
+
+	/* Added by others before we got the lock */
+	tab = sa->tab;
+	s = strarr_find(tab, str, len, hash);
+	if (s)
+		goto done;
+
+	/* Keep it half empty */
+	if (!tab || (tab->cnt + 1) * 2 > tab->size) {
+		i = tab ? tab->size * 2 : 256;
+		newtab = (strtab_s*)calloc(1, sizeof(strtab_s) + i * sizeof(strslot_s));
+		newtab->size = i;
+
+		if (tab)
+			for (i = 0; i < tab->size; i++)
+				if (tab->slot[i].str)
+					strtab_put(newtab, tab->slot[i].str, tab->slot[i].hash);
+
+		newtab->retired = tab;
+		natm_store(&sa->tab, newtab);
+		tab = newtab;
+	}
+
+	s = (char*)calloc(1, sizeof(unsigned int) + len + 1) + sizeof(unsigned int);
+	memcpy(s, str, len);
+	s[len] = '\0';
+	strtab_put(tab, s, hash);
+
+done:
 	pthread_mutex_unlock(&cc->mutex);
+	return s;
+}
 
-	free(newname);
+/* Same as basename(3), but don't touch the name or allocate */
+static const char *name_base(const char *name, int *len)
+{
+	const char *end, *p;
+
+	if (!name || !name[0]) {
+		*len = name ? 1 : 0;
+		return name ? "." : "";
+	}
+
+	end = name + strlen(name);
+	while (end > name + 1 && end[-1] == '/')
+		end--;
 
-	return newstr;
+	for (p = end; p > name && p[-1] != '/'; p--)
+		;
+	if (p == end)
+		p--;
+
+	*len = end - p;
+	return p;
+}
+
+char *dalog_file_name_add(char *name)
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	const char *base;
+	int len;
+
+	base = name_base(name, &len);
+	return strarr_add(&cc->arr_file_name, base, len);
 }
 char *dalog_modu_name_add(char *name)
 {
 	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
-	char *newstr;
 
-	pthread_mutex_lock(&cc->mutex);
-	newstr = strarr_add(&cc->arr_modu_name, name);
-	pthread_mutex_unlock(&cc->mutex);
-	return newstr;
+	if (dalog_unlikely(!name))
+		return NULL;
+	return strarr_add(&cc->arr_modu_name, name, strlen(name));
 }
 char *dalog_prog_name_add(char *name)
 {
 	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
-	char *newstr, *newname, *progname;
+	const char *base;
+	int len;
 
-	if (name)
-		newname = get_basename(name);
-	else {
-		progname = get_progname();
-		newname = get_basename(progname);
-	}
-
-	pthread_mutex_lock(&cc->mutex);
-	newstr = strarr_add(&cc->arr_prog_name, newname);
-	pthread_mutex_unlock(&cc->mutex);
-
-	free(newname);
-
-	return newstr;
+	base = name_base(name ? name : get_progname(), &len);
+	return strarr_add(&cc->arr_prog_name, base, len);
 }
 char *dalog_func_name_add(char *name)
 {
 	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
-	char *newstr;
 
-	pthread_mutex_lock(&cc->mutex);
-	newstr = strarr_add(&cc->arr_func_name, name);
-	pthread_mutex_unlock(&cc->mutex);
-	return newstr;
+	if (dalog_unlikely(!name))
+		return NULL;
+	return strarr_add(&cc->arr_func_name, name, strlen(name));
 }
 
 static int rulearr_add(rulearr_s *ra, char *prog, char *modu,
 		char *file, char *func, int line, int pid,
-		unsigned int fset, unsigned int fclr)
+		unsigned int fset, unsigned int fclr, int rate)
 {
+	/* Doubled, ARR_INC takes the step more than once */
+	unsigned int step = ra->size ? ra->size : 16;
+
 	if (dalog_unlikely(ra->cnt >= ra->size))
-		ARR_INC(16, ra->arr, ra->size, rule_s);
+		ARR_INC(step, ra->arr, ra->size, rule_s);
 
 	rule_s *rule = &ra->arr[ra->cnt];
 
@@ -761,6 +1452,7 @@ static int rulearr_add(rulearr_s *ra, char *prog, char *modu,
 
 	rule->set = fset;
 	rule->clr = fclr;
+	rule->rate = rate;
 
 	ra->cnt++;
 
@@ -768,30 +1460,159 @@ static int rulearr_add(rulearr_s *ra, char *prog, char *modu,
 	return ra->cnt - 1;
 }
 
+static rulecomp_s *rulecomp_build(dalogcc_s *cc);
+
+/*
+ * Under cc->mutex, after arr_rule changed. The compiled rules are built
+ * here and published at once, the readers only load the pointer. The
+ * old one is freed if no one is reading, or by the next publish.
+ */
+static void rule_publish(dalogcc_s *cc)
+{
+	rulecomp_s *rc;
+
+	natm_add(&cc->rule_gen, 1);
+	rc = rulecomp_build(cc);
+	rc->retired = cc->rule_comp;
+	natm_store(&cc->rule_comp, rc);
+
+	natm_fence();
+	if (!natm_load(&cc->rule_readers)) {
+		rulecomp_free(rc->retired);
+		rc->retired = NULL;
+	}
+}
+
+/* Same sites, the earlier one is hidden by rule if it touch nothing else */
+static int rule_hides(const rule_s *rule, const rule_s *r)
+{
+	return r->prog == rule->prog && r->modu == rule->modu &&
+		r->file == rule->file && r->func == rule->func &&
+		r->line == rule->line && r->pid == rule->pid &&
+		!((r->set | r->clr) & ~(rule->set | rule->clr)) &&
+		(r->rate == -1 || rule->rate != -1);
+}
+
+static void rulearr_shadow(rulearr_s *ra, const rule_s *rule)
+{
+	unsigned int i, n = 0;
+	rule_s *r;
+
+	for (i = 0; i < ra->cnt; i++) {
+		r = &ra->arr[i];
+		if (rule_hides(rule, r))
+			continue;
+		if (n != i)
+			ra->arr[n] = *r;
+		n++;
+	}
+	ra->cnt = n;
+}
+
+static unsigned int rule_hash(const rule_s *r)
+{
+	unsigned long long h;
+
+	h = (uintptr_t)r->prog;
+	h = h * 0x9e3779b97f4a7c15ULL + (uintptr_t)r->modu;
+	h = h * 0x9e3779b97f4a7c15ULL + (uintptr_t)r->file;
+	h = h * 0x9e3779b97f4a7c15ULL + (uintptr_t)r->func;
+	h = h * 0x9e3779b97f4a7c15ULL + (unsigned int)r->line;
+	h = h * 0x9e3779b97f4a7c15ULL + (unsigned int)r->pid;
+	return (unsigned int)(h ^ (h >> 29));
+}
+
+/*
+ * As rulearr_shadow for each rule in order, only the rules of the same
+ * sites are compared, chained by a hash. Nothing hidden if no memory.
+ */
+static void rulearr_shadow_all(rulearr_s *ra)
+{
+	unsigned int i, j, h, n = 0, size, *head, *next;
+	unsigned char *hide;
+
+	for (size = 16; size < ra->cnt * 2; size <<= 1)
+		;
+	head = nmem_alloc(size, unsigned int);
+	next = nmem_alloc(ra->cnt + 1, unsigned int);
+	hide = nmem_alloz(ra->cnt + 1, unsigned char);
+	if (!head || !next || !hide)
+		goto done;
+	memset(head, 0xff, size * sizeof(unsigned int));
+
+	/* From the last, a hidden one still hides the earlier ones */
+	for (i = ra->cnt; i-- > 0; ) {
+		h = rule_hash(&ra->arr[i]) & (size - 1);
+		for (j = head[h]; j != ~0U && !hide[i]; j = next[j])
+			hide[i] = rule_hides(&ra->arr[j], &ra->arr[i]);
+		next[i] = head[h];
+		head[h] = i;
+	}
+
+	for (i = 0; i < ra->cnt; i++) {
+		if (hide[i])
+			continue;
+		if (n != i)
+			ra->arr[n] = ra->arr[i];
+		n++;
+	}
+	ra->cnt = n;
+
+done:
+	nmem_free_s(head);
+	nmem_free_s(next);
+	nmem_free_s(hide);
+}
+
+/* rate=100/s, 100/m or 100/h, per second if no unit, to per hour */
+/* In messages per hour, 0 for no limit, -1 for a bad one */
+static int rate_parse(const char *s)
+{
+	int len, per = 1;
+	char *unit;
+	long n;
+
+	n = strtol(s, &unit, 10);
+	if (unit == s)
+		return -1;
+
+	/* The rest of the rule follows, long is 32 bits, clamp before the unit */
+	len = strcspn(unit, ",\r\n");
+	if (!len || (len == 2 && !strncmp(unit, "/s", 2)))
+		per = 3600;
+	else if (len == 2 && !strncmp(unit, "/m", 2))
+		per = 60;
+	else if (len != 2 || strncmp(unit, "/h", 2))
+		return -1;
+
+	if (n <= 0)
+		return 0;
+	return n > 0x7fffffff / per ? 0x7fffffff : (int)n * per;
+}
+
 /*
  * rule =
- * prog=xxx,modu=xxx,file=xxx,func=xxx,line=xxx,pid=xxx,mask=left
+ * prog=xxx,modu=xxx,file=xxx,func=xxx,line=xxx,pid=xxx,mask=left,rate=xxx
+ *
+ * Return -1 if it set or clear nothing, and give no rate.
  */
-void dalog_rule_add(char *rule)
+static int rule_parse(char *rule, rule_s *out)
 {
-	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
-	int i_line, i_pid;
-	char *s_prog, *s_modu, *s_file, *s_func, *s_line, *s_pid, *s_mask;
+	char *s_prog, *s_modu, *s_file, *s_func, *s_line, *s_pid, *s_mask, *s_rate;
 	char buf[1024];
 	int i, blen;
 
-	unsigned int set = 0, clr = 0;
-
 	if (!rule || rule[0] == '#')
-		return;
+		return -1;
 
 	buf[0] = ',';
 	strncpy(buf + 1, rule, sizeof(buf) - 2);
+	buf[sizeof(buf) - 1] = '\0';
 
 	s_mask = strstr(buf, ",mask=");
-	if (!s_mask || !s_mask[6])
-		return;
-	s_mask += 6;
+	s_rate = strstr(buf, ",rate=");
+	if ((!s_mask || !s_mask[6]) && (!s_rate || !s_rate[6]))
+		return -1;
 
 	s_prog = strstr(buf, ",prog=");
 	s_modu = strstr(buf, ",modu=");
@@ -805,65 +1626,272 @@ void dalog_rule_add(char *rule)
 		if (buf[i] == ',')
 			buf[i] = '\0';
 
-	if (!s_prog || !s_prog[6])
-		s_prog = NULL;
-	else
-		s_prog = dalog_prog_name_add(s_prog + 6);
+	out->rate = (!s_rate || !s_rate[6]) ? -1 : rate_parse(s_rate + 6);
+	if (s_rate && s_rate[6] && out->rate < 0) {
+		if (__noisy_mode)
+			fprintf(stderr, "dalog_rule_add: bad rate '%.*s'\n",
+					(int)strcspn(s_rate + 6, "\r\n"), s_rate + 6);
+		return -1;
+	}
 
-	if (!s_modu || !s_modu[6])
-		s_modu = NULL;
-	else
-		s_modu = dalog_modu_name_add(s_modu + 6);
+	/* The names are interned with cc->mutex, not held here */
+	out->prog = (!s_prog || !s_prog[6]) ? NULL : dalog_prog_name_add(s_prog + 6);
+	out->modu = (!s_modu || !s_modu[6]) ? NULL : dalog_modu_name_add(s_modu + 6);
+	out->file = (!s_file || !s_file[6]) ? NULL : dalog_file_name_add(s_file + 6);
+	out->func = (!s_func || !s_func[6]) ? NULL : dalog_func_name_add(s_func + 6);
+	out->line = (!s_line || !s_line[6]) ? -1 : atoi(s_line + 6);
+	out->pid = (!s_pid || !s_pid[5]) ? -1 : atoi(s_pid + 5);
 
-	if (!s_file || !s_file[6])
-		s_file = NULL;
-	else
-		s_file = dalog_file_name_add(s_file + 6);
+	dalog_parse_mask(s_mask ? s_mask + 6 : "", &out->set, &out->clr);
+	return (out->set || out->clr || out->rate != -1) ? 0 : -1;
+}
 
-	if (!s_func || !s_func[6])
-		s_func = NULL;
-	else
-		s_func = dalog_func_name_add(s_func + 6);
+void dalog_rule_add(char *rule)
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	rule_s r;
 
-	if (!s_line || !s_line[6])
-		i_line = -1;
-	else
-		i_line = atoi(s_line + 6);
+	if (rule_parse(rule, &r))
+		return;
 
-	if (!s_pid || !s_pid[5])
-		i_pid = -1;
-	else
-		i_pid = atoi(s_pid + 6);
+	pthread_mutex_lock(&cc->mutex);
+	rulearr_shadow(&cc->arr_rule, &r);
+	rulearr_add(&cc->arr_rule, r.prog, r.modu, r.file, r.func, r.line, r.pid, r.set, r.clr, r.rate);
+	rule_publish(cc);
+	pthread_mutex_unlock(&cc->mutex);
 
-	dalog_parse_mask(s_mask, &set, &clr);
+	rule_touch(r.prog, r.modu, r.file, r.func);
+}
 
-	if (set || clr) {
-		pthread_mutex_lock(&cc->mutex);
-		rulearr_add(&cc->arr_rule, s_prog, s_modu, s_file, s_func, i_line, i_pid, set, clr);
-		pthread_mutex_unlock(&cc->mutex);
+/**
+ * \brief Add the rules, one per line, each as dalog_rule_add does.
+ *
+ * Compiled and published once for all of them, dalog_rule_add for each
+ * line would rebuild the whole compiled rules every time.
+ */
+void dalog_rule_add_lines(char *rules)
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	char *line, *eol;
+	unsigned int i;
+	rulearr_s ra;
+	rule_s r, *p;
+
+	memset(&ra, 0, sizeof(ra));
+	for (line = rules; line && *line; line = eol) {
+		eol = strchr(line, '\n');
+		if (eol)
+			*eol++ = '\0';
+		if (rule_parse(line, &r))
+			continue;
+		rulearr_add(&ra, r.prog, r.modu, r.file, r.func, r.line, r.pid, r.set, r.clr, r.rate);
+	}
+	if (!ra.cnt)
+		goto done;
 
-		dalog_touch();
+	pthread_mutex_lock(&cc->mutex);
+	if (cc->arr_rule.cnt + ra.cnt > cc->arr_rule.size)
+		ARR_INC(ra.cnt, cc->arr_rule.arr, cc->arr_rule.size, rule_s);
+	for (i = 0; i < ra.cnt; i++) {
+		p = &ra.arr[i];
+		rulearr_add(&cc->arr_rule, p->prog, p->modu, p->file, p->func,
+				p->line, p->pid, p->set, p->clr, p->rate);
 	}
+	rulearr_shadow_all(&cc->arr_rule);
+	rule_publish(cc);
+	pthread_mutex_unlock(&cc->mutex);
+
+	if (ra.cnt == 1)
+		rule_touch(ra.arr[0].prog, ra.arr[0].modu, ra.arr[0].file, ra.arr[0].func);
+	else
+		dalog_touch();
+
+done:
+	nmem_free_s(ra.arr);
 }
+
 void dalog_rule_del(unsigned int idx)
 {
 	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	rule_s rule;
 
-	if (idx >= cc->arr_rule.cnt)
+	pthread_mutex_lock(&cc->mutex);
+	if (idx >= cc->arr_rule.cnt) {
+		pthread_mutex_unlock(&cc->mutex);
 		return;
+	}
 
-	memcpy(&cc->arr_rule.arr[idx], &cc->arr_rule.arr[idx + 1],
+	rule = cc->arr_rule.arr[idx];
+	memmove(&cc->arr_rule.arr[idx], &cc->arr_rule.arr[idx + 1],
 			(cc->arr_rule.cnt - idx - 1) * sizeof(rule_s));
-	dalog_touch();
+	cc->arr_rule.cnt--;
+	rule_publish(cc);
+	pthread_mutex_unlock(&cc->mutex);
+
+	rule_touch(rule.prog, rule.modu, rule.file, rule.func);
 }
 void dalog_rule_clr()
 {
 	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
 
+	pthread_mutex_lock(&cc->mutex);
 	cc->arr_rule.cnt = 0;
+	rule_publish(cc);
+	pthread_mutex_unlock(&cc->mutex);
+	dalog_touch();
+}
+
+/**
+ * \brief Replace all the rules by rules, one per line.
+ *
+ * The sites see either the old set or the new one, never a mix.
+ */
+void dalog_rule_set(char *rules)
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	rulearr_s ra, old;
+	char *line, *eol;
+	rule_s r;
+
+	memset(&ra, 0, sizeof(ra));
+	for (line = rules; line && *line; line = eol) {
+		eol = strchr(line, '\n');
+		if (eol)
+			*eol++ = '\0';
+		if (rule_parse(line, &r))
+			continue;
+		rulearr_add(&ra, r.prog, r.modu, r.file, r.func, r.line, r.pid, r.set, r.clr, r.rate);
+	}
+	rulearr_shadow_all(&ra);
+
+	pthread_mutex_lock(&cc->mutex);
+	old = cc->arr_rule;
+	cc->arr_rule = ra;
+	rule_publish(cc);
+	pthread_mutex_unlock(&cc->mutex);
+
+	/* Only the compiled ones are read without the mutex */
+	nmem_free_s(old.arr);
 	dalog_touch();
 }
 
+static unsigned int get_mask(char c);
+
+/* The letters of the bits, "-x" for a cleared one, n is the length now */
+static int mask_str(char *buf, int n, int size, unsigned int set, unsigned int clr)
+{
+	static const char codes[] = "facewnidsSujxNFMHP";
+	int i;
+
+	for (i = 0; codes[i] && n < size - 2; i++) {
+		if (set & get_mask(codes[i]))
+			buf[n++] = codes[i];
+		else if (clr & get_mask(codes[i])) {
+			buf[n++] = '-';
+			buf[n++] = codes[i];
+		}
+	}
+	return n;
+}
+
+/**
+ * \brief Text of the rule idx, as taken by dalog_rule_add.
+ *
+ * Return the length, -1 if no such rule.
+ */
+int dalog_rule_get(unsigned int idx, char *buf, int size)
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	rule_s rule;
+	int n = 0;
+
+	pthread_mutex_lock(&cc->mutex);
+	if (idx >= cc->arr_rule.cnt) {
+		pthread_mutex_unlock(&cc->mutex);
+		return -1;
+	}
+	rule = cc->arr_rule.arr[idx];
+	pthread_mutex_unlock(&cc->mutex);
+
+	buf[0] = '\0';
+	if (rule.prog)
+		n += snprintf(buf + n, size - n, "prog=%s,", rule.prog);
+	if (rule.modu && n < size)
+		n += snprintf(buf + n, size - n, "modu=%s,", rule.modu);
+	if (rule.file && n < size)
+		n += snprintf(buf + n, size - n, "file=%s,", rule.file);
+	if (rule.func && n < size)
+		n += snprintf(buf + n, size - n, "func=%s,", rule.func);
+	if (rule.line >= 0 && n < size)
+		n += snprintf(buf + n, size - n, "line=%d,", rule.line);
+	if (rule.pid >= 0 && n < size)
+		n += snprintf(buf + n, size - n, "pid=%d,", rule.pid);
+	if (rule.rate > 0 && rule.rate % 3600 == 0 && n < size)
+		n += snprintf(buf + n, size - n, "rate=%d/s,", rule.rate / 3600);
+	else if (rule.rate > 0 && rule.rate % 60 == 0 && n < size)
+		n += snprintf(buf + n, size - n, "rate=%d/m,", rule.rate / 60);
+	else if (rule.rate >= 0 && n < size)
+		n += snprintf(buf + n, size - n, "rate=%d/h,", rule.rate);
+	if ((rule.set || rule.clr) && n < size)
+		n += snprintf(buf + n, size - n, "mask=");
+
+	if (rule.set || rule.clr)
+		n = mask_str(buf, n, size, rule.set, rule.clr);
+
+	/* No mask, the ',' after rate */
+	if (!rule.set && !rule.clr && n > 0 && n <= size)
+		n--;
+	if (n >= size)
+		n = size - 1;
+	buf[n] = '\0';
+	return n;
+}
+
+/**
+ * \brief The site idx of all the known modules, in the form of a rule,
+ * with the level and the mask of it now.
+ *
+ * Return the length, -1 if no such site.
+ */
+int dalog_site_get(unsigned int idx, char *buf, int size)
+{
+	dalsite_s *site = NULL;
+	unsigned int cnt;
+	int i, n;
+
+	pthread_mutex_lock(&__site_mutex);
+	for (i = 0; i < __site_tab_cnt; i++) {
+		cnt = __site_tabs[i].stop - __site_tabs[i].start;
+		if (idx < cnt) {
+			site = &__site_tabs[i].start[idx];
+			break;
+		}
+		idx -= cnt;
+	}
+	if (!site && idx < (unsigned int)__site_loose_cnt)
+		site = __site_loose[idx];
+	if (!site) {
+		pthread_mutex_unlock(&__site_mutex);
+		return -1;
+	}
+
+	n = snprintf(buf, size, "prog=%s,modu=%s,file=%s,func=%s,line=%d,level=",
+			site->prog_name ? site->prog_name : "?", site->modu,
+			site->file_name ? site->file_name : site->file, site->func, site->line);
+	if (n < size)
+		n = mask_str(buf, n, size, site->level, 0);
+	if (n < size)
+		n += snprintf(buf + n, size - n, ",mask=");
+	if (n < size)
+		n = mask_str(buf, n, size, site->mask & ~DALOG_NEW, 0);
+	pthread_mutex_unlock(&__site_mutex);
+
+	if (n >= size)
+		n = size - 1;
+	buf[n] = '\0';
+	return n;
+}
+
 static unsigned int get_mask(char c)
 {
 	unsigned int i;
@@ -900,6 +1928,7 @@ static unsigned int get_mask(char c)
 
 		{ 's', DALOG_RTM },
 		{ 'S', DALOG_ATM },
+		{ 'u', DALOG_NTM },
 
 		{ 'j', DALOG_PID },
 		{ 'x', DALOG_TID },
@@ -935,32 +1964,405 @@ static void dalog_parse_mask(char *mask, unsigned int *set, unsigned int *clr)
 	}
 }
 
-unsigned int dalog_calc_mask(char *prog, char *modu, char *file, char *func, int line)
+/**
+ * \brief The bits set by the letters, as "mask=" of a rule.
+ */
+unsigned int dalog_mask_from_str(char *mask)
 {
-	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
-	unsigned int i, all = 0;
-	int pid = (int)cc->pid;
+	unsigned int set, clr;
+
+	dalog_parse_mask(mask, &set, &clr);
+	return set & ~clr;
+}
+
+/*-----------------------------------------------------------------------
+ * Compiled rules
+ */
+static unsigned int rulekey_hash(const rulekey_s *key)
+{
+	unsigned long long h;
+
+	h = (uintptr_t)key->prog;
+	h = h * 0x9e3779b97f4a7c15ULL + (uintptr_t)key->modu;
+	h = h * 0x9e3779b97f4a7c15ULL + (uintptr_t)key->file;
+	h = h * 0x9e3779b97f4a7c15ULL + (uintptr_t)key->func;
+	h = h * 0x9e3779b97f4a7c15ULL + (unsigned int)key->line;
+	return (unsigned int)(h ^ (h >> 29));
+}
+
+static void rulekey_mask(rulekey_s *out, const rulekey_s *key, unsigned int fields)
+{
+	out->prog = (fields & RF_PROG) ? key->prog : NULL;
+	out->modu = (fields & RF_MODU) ? key->modu : NULL;
+	out->file = (fields & RF_FILE) ? key->file : NULL;
+	out->func = (fields & RF_FUNC) ? key->func : NULL;
+	out->line = (fields & RF_LINE) ? key->line : -1;
+}
+
+static rulebkt_s **ruleshape_find(ruleshape_s *sh, const rulekey_s *key)
+{
+	unsigned int i, mask = sh->size - 1;
+	rulebkt_s *b;
+
+	for (i = rulekey_hash(key) & mask; (b = sh->slot[i]); i = (i + 1) & mask)
+		if (b->key.func == key->func && b->key.file == key->file &&
+				b->key.line == key->line && b->key.modu == key->modu &&
+				b->key.prog == key->prog)
+			break;
+	return &sh->slot[i];
+}
+
+static void rulecomp_free(rulecomp_s *rc)
+{
+	rulecomp_s *retired;
+	unsigned int i;
+	int s;
+
+	for (; rc; rc = retired) {
+		retired = rc->retired;
+
+		for (s = 0; s < rc->shape_cnt; s++) {
+			for (i = 0; i < rc->shape[s].size; i++)
+				nmem_free_s(rc->shape[s].slot[i]);
+			nmem_free(rc->shape[s].slot);
+		}
+		nmem_free(rc);
+	}
+}
+
+static rulecomp_s *rulecomp_build(dalogcc_s *cc)
+{
+	int idx[RF_CNT], seq, bit;
+	unsigned int cnt[RF_CNT], fields, i, bits;
+	rulebkt_s **pb, *b;
+	rulecomp_s *rc;
+	ruleshape_s *sh;
+	rulekey_s key;
+	rule_s *rule;
+
+	rc = nmem_alloz(1, rulecomp_s);
+	memset(cnt, 0, sizeof(cnt));
 
 	for (i = 0; i < cc->arr_rule.cnt; i++) {
-		rule_s *rule = &cc->arr_rule.arr[i];
+		rule = &cc->arr_rule.arr[i];
+		fields = (rule->prog ? RF_PROG : 0) | (rule->modu ? RF_MODU : 0) |
+			(rule->file ? RF_FILE : 0) | (rule->func ? RF_FUNC : 0) |
+			(rule->line != -1 ? RF_LINE : 0);
+		cnt[fields]++;
+	}
 
-		if (rule->prog != NULL && rule->prog != prog)
+	for (fields = 0; fields < RF_CNT; fields++) {
+		idx[fields] = -1;
+		if (!cnt[fields])
 			continue;
-		if (rule->modu != NULL && rule->modu != modu)
-			continue;
-		if (rule->file != NULL && rule->file != file)
-			continue;
-		if (rule->func != NULL && rule->func != func)
+
+		idx[fields] = rc->shape_cnt;
+		sh = &rc->shape[rc->shape_cnt++];
+		sh->fields = fields;
+		for (sh->size = 4; sh->size < cnt[fields] * 2; sh->size <<= 1)
+			;
+		sh->slot = nmem_alloz(sh->size, rulebkt_s*);
+	}
+
+	/* Fold the rules in order, the seq is the order */
+	for (seq = 0; seq < (int)cc->arr_rule.cnt; seq++) {
+		rule = &cc->arr_rule.arr[seq];
+
+		/* Only the pid of self could match */
+		if (rule->pid != -1 && rule->pid != (int)cc->pid)
 			continue;
-		if (rule->line != -1 && rule->line != line)
+
+		key.prog = rule->prog;
+		key.modu = rule->modu;
+		key.file = rule->file;
+		key.func = rule->func;
+		key.line = rule->line;
+
+		fields = (rule->prog ? RF_PROG : 0) | (rule->modu ? RF_MODU : 0) |
+			(rule->file ? RF_FILE : 0) | (rule->func ? RF_FUNC : 0) |
+			(rule->line != -1 ? RF_LINE : 0);
+		sh = &rc->shape[idx[fields]];
+
+		pb = ruleshape_find(sh, &key);
+		if (!*pb) {
+			b = nmem_alloz(1, rulebkt_s);
+			b->key = key;
+			b->rate_seq = -1;
+			*pb = b;
+			sh->cnt++;
+		}
+		b = *pb;
+
+		for (bits = rule->clr | rule->set; bits; bits &= bits - 1) {
+			bit = __builtin_ctz(bits);
+			b->seq[bit] = seq;
+		}
+		if (rule->rate != -1) {
+			b->rate = rule->rate;
+			b->rate_seq = seq;
+		}
+		b->touched |= rule->clr | rule->set;
+		nflg_clr(b->val, rule->clr);
+		nflg_set(b->val, rule->set);
+	}
+
+	rc->gen = cc->rule_gen;
+	return rc;
+}
+
+static unsigned int rulecomp_match(rulecomp_s *rc, const rulekey_s *site, unsigned int *rate)
+{
+	unsigned int all = 0, got = 0, bits, bit;
+	int best[32], s, i, rate_seq = -1;
+	ruleshape_s *sh;
+	rulekey_s key;
+	rulebkt_s *b;
+
+	for (s = 0; s < rc->shape_cnt; s++) {
+		sh = &rc->shape[s];
+
+		rulekey_mask(&key, site, sh->fields);
+		b = *ruleshape_find(sh, &key);
+		if (!b)
 			continue;
-		if (rule->pid != -1 && rule->pid != pid)
+
+		/* Same as the bits, the latest rule wins */
+		if (b->rate_seq > rate_seq) {
+			rate_seq = b->rate_seq;
+			*rate = b->rate ? (unsigned int)b->rate : DALOG_RATE_FREE;
+		}
+
+		/* Only one shape, or the first one matched */
+		if (!got) {
+			all = b->val;
+			got = b->touched;
+			for (bits = got; bits; bits &= bits - 1) {
+				i = __builtin_ctz(bits);
+				best[i] = b->seq[i];
+			}
 			continue;
+		}
 
-		nflg_clr(all, rule->clr);
-		nflg_set(all, rule->set);
+		for (bits = b->touched; bits; bits &= bits - 1) {
+			i = __builtin_ctz(bits);
+			bit = 1u << i;
+			if ((got & bit) && best[i] > b->seq[i])
+				continue;
+
+			best[i] = b->seq[i];
+			got |= bit;
+			if (b->val & bit)
+				nflg_set(all, bit);
+			else
+				nflg_clr(all, bit);
+		}
 	}
 
 	return all;
 }
 
+/**
+ * \brief The mask of the site, and the rate in messages per hour, 0 if
+ * no rate= for it, DALOG_RATE_FREE if rate=0.
+ */
+unsigned int dalog_calc_site(char *prog, char *modu, char *file, char *func, int line,
+		unsigned int *rate)
+{
+	dalogcc_s *cc = (dalogcc_s*)dalog_cc();
+	unsigned int all, dummy;
+	rulecomp_s *rc;
+	rulekey_s key;
+	dalthr_s *thr;
+
+	key.prog = prog;
+	key.modu = modu;
+	key.file = file;
+	key.func = func;
+	key.line = line;
+
+	if (!rate)
+		rate = &dummy;
+	*rate = 0;
+
+	/* Published by rule_publish, never a lock here */
+	natm_add(&cc->rule_readers, 1);
+	natm_fence();
+
+	rc = natm_load(&cc->rule_comp);
+	all = dalog_likely(rc) ? rulecomp_match(rc, &key, rate) : 0;
+
+	natm_add(&cc->rule_readers, -1);
+
+	thr = dalog_thr();
+	if (dalog_likely(thr))
+		thr->stat.evals++;
+	return all;
+}
+
+unsigned int dalog_calc_mask(char *prog, char *modu, char *file, char *func, int line)
+{
+	return dalog_calc_site(prog, modu, file, func, line, NULL);
+}
+
+/* Unit of dalog_rate_pass, 2^14 NS, about 16 US, the tat wraps in 19 hours */
+#define RATE_SHIFT      14
+
+/**
+ * \brief Token bucket of a site, by the theoretical arrival time.
+ *
+ * The time is in RATE_SHIFT, compared by the difference, so the tat is
+ * 32 bits. More than about 60000 a second is not limited.
+ *
+ * A second of messages may come at once, then one every 1/rate. The
+ * dropped ones are counted and told by the next one let go, with the
+ * type and the site of it. DALOG_RATE_FREE is never limited.
+ *
+ * \return 1 to log, 0 to drop it.
+ */
+int dalog_rate_pass(dalrate_s *rl, unsigned int rate, unsigned char type, unsigned int mask,
+		char *prog, char *modu, char *file, char *func, int line)
+{
+	unsigned long long ns = 3600000000000ULL / rate;
+	unsigned int now, tat, next, step, burst, dropped;
+	dalthr_s *thr;
+	int ahead;
+
+	step = (unsigned int)((ns + (1 << (RATE_SHIFT - 1))) >> RATE_SHIFT);
+	if (dalog_unlikely(!step))
+		return 1;
+	burst = ns < 1000000000ULL ? (unsigned int)((1000000000ULL - ns) >> RATE_SHIFT) : 0;
+
+	now = (unsigned int)(dalog_time_ns() >> RATE_SHIFT);
+	tat = natm_load(&rl->tat);
+	do {
+		/* Never that far ahead, idle for half of the wrap, or new */
+		ahead = (int)(tat - now);
+		if (ahead > (int)(burst + step) || !tat)
+			ahead = 0;
+
+		if (ahead > (int)burst) {
+			natm_add(&rl->dropped, 1);
+			thr = dalog_thr();
+			if (dalog_likely(thr))
+				thr->stat.drops_rate++;
+			return 0;
+		}
+		next = (ahead > 0 ? tat : now) + step;
+	} while (!natm_cas(&rl->tat, &tat, next));
+
+	dropped = __atomic_exchange_n(&rl->dropped, 0, __ATOMIC_ACQ_REL);
+	if (dalog_unlikely(dropped))
+		dalog_f(type, mask, prog, modu, file, func, line,
+				"%u messages of this site dropped, rate limited\n", dropped);
+	return 1;
+}
+
+/*-----------------------------------------------------------------------
+ * Sites of rate=
+ */
+/* Bytes of the packed arguments compared, a longer message is never collapsed */
+#define REP_ARGS        512
+
+/* In seconds, a run of repeats is told at least this often */
+#define REP_SECS        10
+
+static unsigned int rep_hash(const char *fmt, int lit, const char *args, int alen)
+{
+	unsigned int h = 2166136261U;
+	int i;
+
+	if (lit)
+		h = (h ^ (unsigned int)(uintptr_t)fmt) * 16777619U;
+	else
+		for (; *fmt; fmt++)
+			h = (h ^ (unsigned char)*fmt) * 16777619U;
+	for (i = 0; i < alen; i++)
+		h = (h ^ (unsigned char)args[i]) * 16777619U;
+
+	return h ? h : 1;
+}
+
+/* Tell the repeats not told yet, with the level and the mask of the site */
+static void rep_flush(dalsite_s *site, unsigned int now)
+{
+	unsigned int n, mask;
+	int lv;
+
+	natm_store(&site->rl.since, now);
+	n = __atomic_exchange_n(&site->rl.repeated, 0, __ATOMIC_ACQ_REL);
+	if (!n)
+		return;
+
+	lv = ffs((int)(site->level & DALOG_TYPE_ALL));
+	mask = natm_load(&site->mask) & ~DALOG_NEW;
+	dalog_f(lv ? "FACEWNID"[lv - 1] : 'I', mask, site->prog_name, site->modu_name,
+			site->file_name, site->func_name, site->line,
+			"last message repeated %u times\n", n);
+}
+
+/* Only one site has the repeats pending, the last one collapsed */
+static void rep_pending_flush(void)
+{
+	dalsite_s *site = __atomic_exchange_n(&__rep_pending, NULL, __ATOMIC_ACQ_REL);
+
+	if (site)
+		rep_flush(site, (unsigned int)(dalog_time_ns() / 1000000000ULL));
+}
+
+/**
+ * \brief A site given rate=, called by DALOG_SITE_CALL.
+ *
+ * The arguments are packed as the binary capture does, no formatting. A
+ * message the same as the last one of the site, by the hash of the fmt
+ * and the packed arguments, is only counted. The count is told before
+ * the next message of any site, or every REP_SECS while the repeats go
+ * on, and at exit. The others are given to dalog_rate_pass, then
+ * dalog_vf.
+ */
+int dalog_site_vf(dalsite_s *site, unsigned char type, unsigned int mask, const char *fmt, va_list ap)
+{
+	unsigned int h = 0, last, now;
+	dalsite_s *other;
+	char args[REP_ARGS];
+	va_list aq;
+	int alen;
+
+	va_copy(aq, ap);
+	alen = dalfmt_pack(args, sizeof(args), fmt, aq);
+	va_end(aq);
+	if (alen >= 0)
+		h = rep_hash(fmt, mask & DALOG_LIT, args, alen);
+
+	now = (unsigned int)(dalog_time_ns() / 1000000000ULL);
+	last = __atomic_exchange_n(&site->rl.last, h, __ATOMIC_ACQ_REL);
+	if (h && h == last) {
+		natm_add(&site->rl.repeated, 1);
+		other = __atomic_exchange_n(&__rep_pending, site, __ATOMIC_ACQ_REL);
+		if (other && other != site)
+			rep_flush(other, now);
+		if ((int)(now - natm_load(&site->rl.since)) >= REP_SECS)
+			rep_flush(site, now);
+		return 0;
+	}
+	rep_flush(site, now);
+
+	if (!dalog_rate_pass(&site->rl, site->rate, type, mask & ~DALOG_LIT, site->prog_name,
+				site->modu_name, site->file_name, site->func_name, site->line))
+		return 0;
+
+	return dalog_vf(type, mask, site->prog_name, site->modu_name, site->file_name,
+			site->func_name, site->line, fmt, ap);
+}
+
+int dalog_site_f(dalsite_s *site, unsigned char type, unsigned int mask, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = dalog_site_vf(site, type, mask, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
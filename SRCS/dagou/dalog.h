@@ -38,6 +38,9 @@ static char __attribute__((unused)) *__dal_prog_name = NULL;
 typedef void (*DAL_NLOGGER)(char *content, int len);
 typedef void (*DAL_RLOGGER)(unsigned char type, unsigned int mask, char *prog, char *modu, char *file, char *func, int ln, const char *fmt, va_list ap);
 
+/* Binary Logger, get the binary stream described in dalog_fmt.h */
+typedef int (*DAL_BLOGGER)(const void *dat, int len);
+
 /*-----------------------------------------------------------------------
  * Define DALOG_MODU_NAME if someone forgot it.
  */
@@ -64,6 +67,7 @@ typedef void (*DAL_RLOGGER)(unsigned char type, unsigned int mask, char *prog, c
 
 #define DALOG_RTM        0x00000100 /* s: Relative Time, in MS, 'ShiJian' */
 #define DALOG_ATM        0x00000200 /* S: ABS Time, in MS, 'ShiJian' */
+#define DALOG_NTM        0x00000400 /* u: Relative Time, in NS, same base as s: */
 
 #define DALOG_PID        0x00001000 /* j: Process ID, 'JinCheng' */
 #define DALOG_TID        0x00002000 /* x: Thread ID, 'XianCheng' */
@@ -74,18 +78,60 @@ typedef void (*DAL_RLOGGER)(unsigned char type, unsigned int mask, char *prog, c
 #define DALOG_FUNC       0x00080000 /* H: Function Name, 'HanShu' */
 #define DALOG_LINE       0x00100000 /* N: Line Number */
 
+#define DALOG_LIT        0x00400000 /* fmt is a literal, only given by DALOG_SITE_CALL */
+#define DALOG_FLT        0x00800000 /* Masked off, only for the flight recorder */
+#define DALOG_NEW        0x80000000 /* Site not calculated yet, see dalsite_s */
+
 #define DALOG_ALL        0xffffffff
 #define DALOG_DFT        (DALOG_FATAL | DALOG_ALERT | DALOG_CRIT | DALOG_ERR | DALOG_WARNING | DALOG_NOTICE | DALOG_ATM | DALOG_PROG | DALOG_MODU | DALOG_FILE | DALOG_LINE)
 
 /*-----------------------------------------------------------------------
  * Embedded variable used by dalog_xxx
  */
+extern unsigned int __dalog_epoch;
+
+/* DALOG_FLT if the flight recorder is on, mask of the masked off sites */
+extern unsigned int __dalog_flight;
+
+/*
+ * Version of the site: sum of the global epoch and the epochs of its
+ * names. A rule only bumps the epoch of its most specific name, so
+ * only the sites it could affect recalculate the mask.
+ *
+ * The interned name is prefixed with its epoch, see dalog_xxx_name_add.
+ */
+#define DALOG_NAME_EPOCH(name) \
+	((name) ? __atomic_load_n((unsigned int*)(void*)(name) - 1, __ATOMIC_ACQUIRE) : 0)
+
+#define DALOG_SITE_VER() (int)(__atomic_load_n(&__dalog_epoch, __ATOMIC_ACQUIRE) + \
+		DALOG_NAME_EPOCH(__dal_prog_name) + DALOG_NAME_EPOCH(__dal_modu_name) + \
+		DALOG_NAME_EPOCH(__dal_file_name) + DALOG_NAME_EPOCH(__dal_func_name))
+
+/* Per site, see dalog_site_vf. 32 bits, no libatomic on a 32 bits CPU */
+typedef struct _dalrate_s dalrate_s;
+struct _dalrate_s {
+	unsigned int tat;               /* When the bucket is full again, running freely */
+	unsigned int dropped;
+
+	unsigned int last;              /* Hash of the last message, 0 if none */
+	unsigned int repeated;          /* Same as the last one, not logged yet */
+	unsigned int since;             /* Second the repeats told last time */
+};
+
+/* Site rate of rate=0, no limit, but the repeats are still collapsed */
+#define DALOG_RATE_FREE  0xffffffff
+
+/*
+ * Open coded sites, as dalog_assert and dbus-print-message.c, checked by
+ * DALOG_SITE_VER. They are not in "dalog_sites": rate= of the rules does
+ * not limit or collapse them, and dr --sites does not show them.
+ */
 #define DALOG_INNER_VAR_DEF() \
 	static int __attribute__((unused)) __dal_ver_sav = -1; \
 	static char __attribute__((unused)) *__dal_modu_name = NULL; \
 	static char __attribute__((unused)) *__dal_func_name = NULL; \
 	static int __attribute__((unused)) __dal_mask = 0; \
-	int __attribute__((unused)) __dal_ver_get = dalog_touches()
+	int __attribute__((unused)) __dal_ver_get = DALOG_SITE_VER()
 
 #define DALOG_SETUP_NAME(modu, file, func) do { \
 	if (dalog_unlikely(__dal_file_name == NULL)) { \
@@ -102,34 +148,133 @@ typedef void (*DAL_RLOGGER)(unsigned char type, unsigned int mask, char *prog, c
 	} \
 } while (0)
 
-#define DALOG_CHK_AND_CALL(mask, indi, modu, file, func, line, fmt, ...) do { \
-	DALOG_INNER_VAR_DEF(); \
-	if (dalog_unlikely(__dal_ver_get > __dal_ver_sav)) { \
-		__dal_ver_sav = __dal_ver_get; \
-		DALOG_SETUP_NAME(modu, file, func); \
-		__dal_mask = dalog_calc_mask(__dal_prog_name, __dal_modu_name, __dal_file_name, __dal_func_name, line); \
-		if (!(__dal_mask & (mask))) { \
-			__dal_mask = 0; \
+/*
+ * One descriptor per dalog_xxx, all of a module are in the section
+ * "dalog_sites", which is handed to dalog_sites_add by the constructor
+ * below. dalog calculates the mask of all of them at once when a rule
+ * changed, so a site only loads its mask.
+ *
+ * DALOG_NEW is set until the first calculation, a site run before
+ * dalog_init, or not in the table, sets itself up.
+ */
+typedef struct _dalsite_s dalsite_s;
+struct _dalsite_s {
+	/* Given by the compiler */
+	const char *modu;
+	const char *file;
+	const char *func;
+	int line;
+	unsigned int level;     /* DALOG_XXX of the site */
+
+	/* Interned, by dalog_init or the first run */
+	char *prog_name;
+	char *modu_name;
+	char *file_name;
+	char *func_name;
+
+	/* Written by dalog only, see dalog_site_setup */
+	unsigned int mask;
+	unsigned int rate;
+	dalrate_s rl;
+};
+
+#define DALOG_SITE_SECTION "dalog_sites"
+
+extern dalsite_s __start_dalog_sites __attribute__((weak, visibility("hidden")));
+extern dalsite_s __stop_dalog_sites __attribute__((weak, visibility("hidden")));
+
+/* Weak, the tools include this only for the flags, without libdagou */
+void dalog_sites_add(dalsite_s *start, dalsite_s *stop) __attribute__((weak));
+void dalog_site_setup(dalsite_s *site);
+int dalog_site_get(unsigned int idx, char *buf, int size);
+
+void dalog_sites_del(dalsite_s *start) __attribute__((weak));
+void dalog_sites_unload(void *addr) __attribute__((weak));
+
+/* Once per translation unit, the same section is taken only once */
+static void __attribute__((constructor, unused)) __dalog_sites_ctor(void)
+{
+	if (&__start_dalog_sites != &__stop_dalog_sites && dalog_sites_add)
+		dalog_sites_add(&__start_dalog_sites, &__stop_dalog_sites);
+}
+
+static void __attribute__((destructor, unused)) __dalog_sites_dtor(void)
+{
+	if (&__start_dalog_sites != &__stop_dalog_sites && dalog_sites_del)
+		dalog_sites_del(&__start_dalog_sites);
+#ifdef __cplusplus
+	if (dalog_sites_unload)
+		dalog_sites_unload((void*)&__dalog_sites_dtor);
+#endif
+}
+
+/*
+ * g++ puts the static of an inline function or a template in a section
+ * group, and refuses it in one section with the others. The sites of
+ * C++ are kept by dalog from their first run, not known before it.
+ */
+#ifdef __cplusplus
+#define DALOG_SITE_ATTR __attribute__((aligned(8)))
+#else
+#define DALOG_SITE_ATTR __attribute__((section(DALOG_SITE_SECTION), aligned(8), used))
+#endif
+
+#define DALOG_SITE_DEF(site, lvl, modu, file, func, line) \
+	static dalsite_s site DALOG_SITE_ATTR = { \
+		(modu), (file), (func), (line), (lvl), NULL, NULL, NULL, NULL, DALOG_NEW, 0, { 0, 0, 0, 0, 0 } \
+	}
+
+/*
+ * lit is DALOG_LIT if the fmt is a literal, which the binary capture
+ * may refer by address, see DALOG_LIT_OF.
+ *
+ * A site given rate= goes to scall, dalog_site_f or dalog_site_vf, for
+ * the rate limit and the collapsing of the repeats, the others to call.
+ *
+ * The mask is loaded once, by acquire: dalog_site_setup stores the names
+ * and the rate before the mask, by release, another thread seeing the
+ * mask sees them too.
+ */
+#define DALOG_LIT_OF(fmt) (__builtin_constant_p(fmt) ? DALOG_LIT : 0)
+
+#define DALOG_SITE_CALL(site, indi, lit, call, scall, ...) do { \
+	unsigned int __dal_m = __atomic_load_n(&(site).mask, __ATOMIC_ACQUIRE); \
+	if (__dal_m) { \
+		if (dalog_unlikely(__dal_m & DALOG_NEW)) { \
+			dalog_site_setup(&(site)); \
+			__dal_m = __atomic_load_n(&(site).mask, __ATOMIC_ACQUIRE); \
 		} \
+		if (!__dal_m) \
+			; \
+		else if (dalog_likely(!(site).rate)) \
+			call(indi, __dal_m | (lit), (site).prog_name, (site).modu_name, (site).file_name, \
+					(site).func_name, (site).line, __VA_ARGS__); \
+		else \
+			scall(&(site), indi, __dal_m | (lit), __VA_ARGS__); \
 	} \
-	if (__dal_mask) { \
-		dalog_f(indi, __dal_mask, __dal_prog_name, modu, __dal_file_name, (char*)func, line, fmt, ##__VA_ARGS__); \
-	} \
+} while (0)
+
+#define DALOG_CHK_AND_CALL(mask, indi, modu, file, func, line, fmt, ...) do { \
+	DALOG_SITE_DEF(__dal_site, mask, modu, file, func, line); \
+	DALOG_SITE_CALL(__dal_site, indi, DALOG_LIT_OF(fmt), dalog_f, dalog_site_f, fmt, ##__VA_ARGS__); \
 } while (0)
 
 #define DALOG_CHK_AND_CALL_AP(mask, indi, modu, file, func, line, fmt, ap) do { \
-	DALOG_INNER_VAR_DEF(); \
-	if (dalog_unlikely(__dal_ver_get > __dal_ver_sav)) { \
-		__dal_ver_sav = __dal_ver_get; \
-		DALOG_SETUP_NAME(modu, file, func); \
-		__dal_mask = dalog_calc_mask(__dal_prog_name, __dal_modu_name, __dal_file_name, __dal_func_name, line); \
-		if (!(__dal_mask & (mask))) { \
-			__dal_mask = 0; \
-		} \
-	} \
-	if (__dal_mask) { \
-		dalog_vf(indi, __dal_mask, __dal_prog_name, modu, __dal_file_name, (char*)func, line, fmt, ap); \
-	} \
+	DALOG_SITE_DEF(__dal_site, mask, modu, file, func, line); \
+	DALOG_SITE_CALL(__dal_site, indi, 0, dalog_vf, dalog_site_vf, fmt, ap); \
+} while (0)
+
+/*
+ * Sites above DALOG_MIN_LEVEL are gone at compile time, but the format
+ * is still checked. e.g. -DDALOG_MIN_LEVEL=DALOG_INFO drops dalog_debug.
+ */
+#ifndef DALOG_MIN_LEVEL
+#define DALOG_MIN_LEVEL DALOG_DEBUG
+#endif
+
+#define DALOG_ELIDED(fmt, ...) do { \
+	if (0) \
+		dalog_f(0, 0, NULL, NULL, NULL, NULL, 0, fmt, ##__VA_ARGS__); \
 } while (0)
 
 /*-----------------------------------------------------------------------
@@ -139,21 +284,53 @@ typedef void (*DAL_RLOGGER)(unsigned char type, unsigned int mask, char *prog, c
 	dalog_f(0, 0, NULL, NULL, NULL, NULL, 0, fmt, ##__VA_ARGS__); \
 } while (0)
 
+#if DALOG_MIN_LEVEL >= DALOG_FATAL
 #define dalog_fatal(fmt, ...)       DALOG_CHK_AND_CALL(DALOG_FATAL,   'F', DALOG_MODU_NAME, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define dalog_fatal(fmt, ...)       DALOG_ELIDED(fmt, ##__VA_ARGS__)
+#endif
+#if DALOG_MIN_LEVEL >= DALOG_ALERT
 #define dalog_alert(fmt, ...)       DALOG_CHK_AND_CALL(DALOG_ALERT,   'A', DALOG_MODU_NAME, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define dalog_alert(fmt, ...)       DALOG_ELIDED(fmt, ##__VA_ARGS__)
+#endif
+#if DALOG_MIN_LEVEL >= DALOG_CRIT
 #define dalog_critical(fmt, ...)    DALOG_CHK_AND_CALL(DALOG_CRIT,    'C', DALOG_MODU_NAME, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define dalog_critical(fmt, ...)    DALOG_ELIDED(fmt, ##__VA_ARGS__)
+#endif
+#if DALOG_MIN_LEVEL >= DALOG_ERR
 #define dalog_error(fmt, ...)       DALOG_CHK_AND_CALL(DALOG_ERR,     'E', DALOG_MODU_NAME, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define dalog_error(fmt, ...)       DALOG_ELIDED(fmt, ##__VA_ARGS__)
+#endif
+#if DALOG_MIN_LEVEL >= DALOG_WARNING
 #define dalog_warning(fmt, ...)     DALOG_CHK_AND_CALL(DALOG_WARNING, 'W', DALOG_MODU_NAME, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define dalog_warning(fmt, ...)     DALOG_ELIDED(fmt, ##__VA_ARGS__)
+#endif
+#if DALOG_MIN_LEVEL >= DALOG_NOTICE
 #define dalog_notice(fmt, ...)      DALOG_CHK_AND_CALL(DALOG_NOTICE,  'N', DALOG_MODU_NAME, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define dalog_notice(fmt, ...)      DALOG_ELIDED(fmt, ##__VA_ARGS__)
+#endif
+#if DALOG_MIN_LEVEL >= DALOG_INFO
 #define dalog_info(fmt, ...)        DALOG_CHK_AND_CALL(DALOG_INFO,    'I', DALOG_MODU_NAME, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define dalog_info(fmt, ...)        DALOG_ELIDED(fmt, ##__VA_ARGS__)
+#endif
+#if DALOG_MIN_LEVEL >= DALOG_DEBUG
 #define dalog_debug(fmt, ...)       DALOG_CHK_AND_CALL(DALOG_DEBUG,   'D', DALOG_MODU_NAME, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#else
+#define dalog_debug(fmt, ...)       DALOG_ELIDED(fmt, ##__VA_ARGS__)
+#endif
 
 #define dalog_assert(_x_) do { \
 	if (!(_x_)) { \
 		DALOG_INNER_VAR_DEF(); \
-		if (__dal_ver_get > __dal_ver_sav) { \
-			__dal_ver_sav = __dal_ver_get; \
+		if (__dal_ver_get != __dal_ver_sav) { \
 			DALOG_SETUP_NAME(DALOG_MODU_NAME, __FILE__, __func__); \
+			__dal_ver_sav = DALOG_SITE_VER(); \
 		} \
 		dalog_f('!', DALOG_ALL, __dal_prog_name_, DALOG_MODU_NAME, __dal_file_name_, __FUNCTION__, __LINE__, \
 				"\n\tASSERT NG: \"%s\"\n\n", #_x_); \
@@ -171,16 +348,26 @@ char *dalog_prog_name_add(char *name);
 char *dalog_func_name_add(char *name);
 
 unsigned int dalog_calc_mask(char *prog, char *modu, char *file, char *func, int line);
+unsigned int dalog_calc_site(char *prog, char *modu, char *file, char *func, int line, unsigned int *rate);
+int dalog_rate_pass(dalrate_s *rl, unsigned int rate, unsigned char type, unsigned int mask,
+		char *prog, char *modu, char *file, char *func, int line);
 
 int dalog_f(unsigned char type, unsigned int mask, char *prog, char *modu, char *file, char *func, int ln, const char *fmt, ...) __attribute__ ((format (printf, 8, 9)));
 int dalog_vf(unsigned char type, unsigned int mask, char *prog, char *modu, char *file, char *func, int ln, const char *fmt, va_list ap);
 
+int dalog_site_f(dalsite_s *site, unsigned char type, unsigned int mask, const char *fmt, ...) __attribute__ ((format (printf, 4, 5)));
+int dalog_site_vf(dalsite_s *site, unsigned char type, unsigned int mask, const char *fmt, va_list ap);
+
 int dalog_add_logger(DAL_NLOGGER logger);
 int dalog_del_logger(DAL_NLOGGER logger);
 
 int dalog_add_rlogger(DAL_RLOGGER logger);
 int dalog_del_rlogger(DAL_RLOGGER logger);
 
+int dalog_add_logger_mask(DAL_NLOGGER logger, unsigned int mask);
+int dalog_add_rlogger_mask(DAL_RLOGGER logger, unsigned int mask);
+unsigned int dalog_mask_from_str(char *mask);
+
 void *dalog_attach(void *logcc);
 void dalog_touch(void);
 
@@ -188,8 +375,22 @@ void dalog_set_default_mask(unsigned int mask);
 void *dalog_init(int argc, char **argv);
 
 void dalog_rule_add(char *rule);
+void dalog_rule_add_lines(char *rules);
 void dalog_rule_del(unsigned int idx);
 void dalog_rule_clr(void);
+void dalog_rule_set(char *rules);
+int dalog_rule_get(unsigned int idx, char *buf, int size);
+
+/* Asynchronous output: 0 ring_size for default, env: DALOG_ASYNC */
+int dalog_async_start(unsigned int ring_size);
+void dalog_async_stop(void);
+unsigned long dalog_async_drops(void);
+
+/* Binary capture, env: DALOG_BINARY, only the dalog_xxx of a literal fmt */
+void dalog_async_binary(int on);
+
+int dalog_add_blogger(DAL_BLOGGER logger);
+int dalog_del_blogger(DAL_BLOGGER logger);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,679 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/**
+ * @file     dalog_async.c
+ * @brief    Asynchronous backend for dalog_vf.
+ *
+ * The caller only copy the formatted line into the ring of its own
+ * thread, the async thread drain all the rings and call the nloggers.
+ * When a ring is full the line is dropped and counted, the caller is
+ * never blocked.
+ *
+ * In binary mode, the caller only pack the arguments (dalog_fmt.c), the
+ * text is rendered by the async thread, and the binary loggers get the
+ * record as is. The fmt and names are referred by address, so they must
+ * live as long as the process, string literal and interned names do.
+ * Only the calls with DALOG_LIT come here, see dalog_vf.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <helper.h>
+#include <dalog.h>
+#include <dalog_inner.h>
+#include <nbuf.h>
+
+#define DFT_RING_SIZE   (32 * 1024)
+#define MIN_RING_SIZE   (4 * 1024)
+
+/* Max sleep of the async thread when idle, 1 << N ms */
+#define MAX_IDLE_SHIFT  4
+
+int __dalog_async_on = 0;
+int __dalog_async_bin = 0;
+int __dalog_blogger_cnt = 0;
+
+static unsigned int __ring_size = DFT_RING_SIZE;
+static pthread_t __async_thread;
+static int __async_quit = 0;
+
+static unsigned long __drops_reported = 0;
+
+/* Binary logger */
+#define MAX_BLOGGER 4
+
+typedef struct _dalbsink_s dalbsink_s;
+struct _dalbsink_s {
+	DAL_BLOGGER logger;
+	int started;            /* DALBIN_MAGIC and DALREC_HEAD sent */
+
+	/* Id of DALREC_STR already sent, open addressing */
+	unsigned int seen_size, seen_cnt;
+	unsigned long long *seen;
+
+	nbuf_s nb;
+};
+
+static dalbsink_s __bsinks[MAX_BLOGGER];
+static pthread_mutex_t __bsink_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*-----------------------------------------------------------------------
+ * Ring
+ */
+static dalring_s *dalring_new(unsigned int size)
+{
+	dalring_s *ring;
+
+	if (posix_memalign((void**)&ring, DALOG_CACHELINE, sizeof(dalring_s)))
+		return NULL;
+	memset(ring, 0, sizeof(dalring_s));
+
+	ring->buf = nmem_alloc(size, char);
+	if (!ring->buf) {
+		nmem_free(ring);
+		return NULL;
+	}
+	ring->size = size;
+
+	return ring;
+}
+
+/**
+ * \brief Reserve space for a record, return the payload address.
+ *
+ * It will not be seen by consumer until dalring_commit called.
+ */
+void *dalring_reserve(dalring_s *ring, unsigned short kind, unsigned int len)
+{
+	unsigned int head, tail, ofs, contig, need;
+	dalrec_s *rec;
+
+	need = DALOG_ALIGN8(sizeof(dalrec_s) + len);
+
+	head = ring->head;
+	tail = natm_load(&ring->tail);
+	ofs = head & (ring->size - 1);
+	contig = ring->size - ofs;
+
+	if (need > contig) {
+		/* Not enough space before the end, pad it and wrap */
+		if (ring->size - (head - tail) < contig + need) {
+			ring->drops++;
+			return NULL;
+		}
+
+		rec = (dalrec_s*)(ring->buf + ofs);
+		rec->len = contig - sizeof(dalrec_s);
+		rec->kind = DALREC_PAD;
+
+		head += contig;
+		ofs = 0;
+	} else if (ring->size - (head - tail) < need) {
+		ring->drops++;
+		return NULL;
+	}
+
+	rec = (dalrec_s*)(ring->buf + ofs);
+	rec->len = len;
+	rec->kind = kind;
+	rec->sid = 0;
+
+	ring->next = head + need;
+	return (void*)(rec + 1);
+}
+
+void dalring_commit(dalring_s *ring)
+{
+	natm_store(&ring->head, ring->next);
+}
+
+int dalring_empty(dalring_s *ring)
+{
+	return natm_load(&ring->head) == natm_load(&ring->tail);
+}
+
+/*-----------------------------------------------------------------------
+ * Binary logger
+ */
+static unsigned int seen_hash(unsigned long long id)
+{
+	return (unsigned int)(id >> 3) * 2654435761U;
+}
+
+static int seen_has(dalbsink_s *bs, unsigned long long id)
+{
+	unsigned int i;
+
+	if (!bs->seen_size)
+		return 0;
+
+	for (i = seen_hash(id) & (bs->seen_size - 1); bs->seen[i];
+			i = (i + 1) & (bs->seen_size - 1))
+		if (bs->seen[i] == id)
+			return 1;
+	return 0;
+}
+
+static void seen_add(dalbsink_s *bs, unsigned long long id)
+{
+	unsigned long long *old = bs->seen;
+	unsigned int i, j, old_size = bs->seen_size;
+
+	if (bs->seen_cnt * 2 >= bs->seen_size) {
+		bs->seen_size = old_size ? old_size * 2 : 256;
+		bs->seen = nmem_alloz(bs->seen_size, unsigned long long);
+		bs->seen_cnt = 0;
+
+		for (j = 0; j < old_size; j++)
+			if (old[j])
+				seen_add(bs, old[j]);
+		nmem_free_s(old);
+	}
+
+	for (i = seen_hash(id) & (bs->seen_size - 1); bs->seen[i];
+			i = (i + 1) & (bs->seen_size - 1))
+		;
+	bs->seen[i] = id;
+	bs->seen_cnt++;
+}
+
+static void seen_reset(dalbsink_s *bs)
+{
+	if (bs->seen)
+		memset(bs->seen, 0, bs->seen_size * sizeof(bs->seen[0]));
+	bs->seen_cnt = 0;
+}
+
+/* One record one call, the logger could keep it atomic */
+static int bsink_put(dalbsink_s *bs, unsigned short kind,
+		const void *d0, int l0, const void *d1, int l1)
+{
+	static const char zero[8];
+	dalrec_s rec;
+	int pid[2];
+
+	pid[0] = dalog_pid();
+	pid[1] = 0;
+
+	rec.len = sizeof(pid) + l0 + l1;
+	rec.kind = kind | DALREC_PID;
+	rec.sid = (unsigned short)pid[0];
+
+	nbuf_setlen(&bs->nb, 0);
+	nbuf_add(&bs->nb, &rec, sizeof(rec));
+	nbuf_add(&bs->nb, pid, sizeof(pid));
+	nbuf_add(&bs->nb, d0, l0);
+	if (l1)
+		nbuf_add(&bs->nb, d1, l1);
+	nbuf_add(&bs->nb, zero, DALOG_ALIGN8(rec.len) - rec.len);
+
+	return bs->logger(bs->nb.buf, bs->nb.len);
+}
+
+static int bsink_start(dalbsink_s *bs)
+{
+	dalbin_head_s hd;
+	struct tm tm;
+	time_t t;
+
+	t = time(NULL);
+	localtime_r(&t, &tm);
+
+	hd.order = DALBIN_ORDER;
+	hd.version = DALBIN_VERSION;
+	hd.pid = dalog_pid();
+	hd.gmtoff = (int)tm.tm_gmtoff;
+
+	if (bs->logger(DALBIN_MAGIC, 8))
+		return -1;
+	if (bsink_put(bs, DALREC_HEAD, &hd, sizeof(hd), NULL, 0))
+		return -1;
+
+	bs->started = 1;
+	return 0;
+}
+
+static void bsink_rec(dalbsink_s *bs, dalrec_s *rec)
+{
+	dalbin_s *bin = (dalbin_s*)(rec + 1);
+	unsigned long long ids[5];
+	const char *str;
+	int i;
+
+	if (!bs->started && bsink_start(bs))
+		return;
+
+	if (rec->kind == DALREC_BIN) {
+		ids[0] = bin->fmt;
+		ids[1] = bin->prog;
+		ids[2] = bin->modu;
+		ids[3] = bin->file;
+		ids[4] = bin->func;
+
+		for (i = 0; i < 5; i++) {
+			if (!ids[i] || seen_has(bs, ids[i]))
+				continue;
+
+			/* Not sent, not seen, send it next time */
+			str = (const char*)(uintptr_t)ids[i];
+			if (bsink_put(bs, DALREC_STR, &ids[i], 8, str, strlen(str) + 1))
+				return;
+			seen_add(bs, ids[i]);
+		}
+	}
+
+	bsink_put(bs, rec->kind, rec + 1, rec->len, NULL, 0);
+}
+
+/*-----------------------------------------------------------------------
+ * Render the binary record for nloggers
+ */
+static void render_bin(dalbin_s *bin, int len)
+{
+	char buffer[4096], *bufptr = buffer;
+	int ofs, ret, bufsize = sizeof(buffer);
+	const char *fmt, *args;
+	dalhead_s hd;
+
+	fmt = (const char*)(uintptr_t)bin->fmt;
+	args = (const char*)(bin + 1);
+	len -= sizeof(dalbin_s);
+
+	hd.type = bin->type;
+	hd.mask = bin->mask;
+	hd.pid = dalog_pid();
+	hd.tid = bin->tid;
+	hd.rtm = (unsigned long)(bin->rtm / 1000000);
+	hd.ntm = bin->rtm;
+	hd.atm = NULL;
+	hd.atm_ms = (unsigned int)(bin->atm / 1000000 % 1000);
+	hd.prog = (const char*)(uintptr_t)bin->prog;
+	hd.modu = (const char*)(uintptr_t)bin->modu;
+	hd.file = (const char*)(uintptr_t)bin->file;
+	hd.func = (const char*)(uintptr_t)bin->func;
+	hd.line = bin->line;
+
+	if (bin->mask & DALOG_ATM)
+		hd.atm = dalog_time_date((time_t)(bin->atm / 1000000000));
+
+	ofs = dalfmt_head(bufptr, &hd);
+	ret = dalfmt_render(bufptr + ofs, bufsize - ofs, fmt, args, len);
+	if (ret < 0)
+		return;
+	if (ret > bufsize - ofs - 1) {
+		bufsize = ret + ofs + 1;
+		bufptr = nmem_alloc(bufsize, char);
+
+		memcpy(bufptr, buffer, ofs);
+		dalfmt_render(bufptr + ofs, bufsize - ofs, fmt, args, len);
+	}
+
+	dalog_emit(bufptr, ret + ofs);
+
+	if (bufptr != buffer)
+		nmem_free(bufptr);
+}
+
+static int dalring_drain(dalring_s *ring)
+{
+	unsigned int head, tail;
+	dalrec_s *rec;
+	int i, cnt = 0;
+
+	tail = ring->tail;
+	head = natm_load(&ring->head);
+
+	while (tail != head) {
+		rec = (dalrec_s*)(ring->buf + (tail & (ring->size - 1)));
+
+		if (rec->kind == DALREC_TEXT || rec->kind == DALREC_BIN) {
+			/* The trailing '\0' is included in the payload */
+			if (rec->kind == DALREC_TEXT)
+				dalog_emit((char*)(rec + 1), (int)rec->len - 1);
+			else if (dalog_has_nlogger())
+				render_bin((dalbin_s*)(rec + 1), (int)rec->len);
+
+			if (__dalog_blogger_cnt) {
+				pthread_mutex_lock(&__bsink_mutex);
+				for (i = 0; i < MAX_BLOGGER; i++)
+					if (__bsinks[i].logger)
+						bsink_rec(&__bsinks[i], rec);
+				pthread_mutex_unlock(&__bsink_mutex);
+			}
+			cnt++;
+		}
+
+		tail += DALOG_ALIGN8(sizeof(dalrec_s) + rec->len);
+		natm_store(&ring->tail, tail);
+	}
+
+	return cnt;
+}
+
+/*-----------------------------------------------------------------------
+ * Producer
+ */
+int dalog_async_push(unsigned short kind, const void *dat, unsigned int len)
+{
+	dalthr_s *thr = dalog_thr();
+	int busy, ret = -1;
+	void *p;
+
+	if (dalog_unlikely(!thr))
+		return -1;
+
+	/*
+	 * Busy before the check of on, and dalog_async_stop clear on before
+	 * wait for the busy: either it is seen off here, or the last drain
+	 * is after the commit. Nested by a signal, so it is a depth.
+	 */
+	busy = thr->async_busy;
+	natm_store(&thr->async_busy, busy + 1);
+	natm_fence();
+	if (dalog_unlikely(!natm_load(&__dalog_async_on))) {
+		ret = 1;
+		goto done;
+	}
+
+	if (dalog_unlikely(!thr->ring)) {
+		thr->ring = dalring_new(__ring_size);
+		if (!thr->ring)
+			goto done;
+	}
+
+	p = dalring_reserve(thr->ring, kind, len);
+	if (dalog_unlikely(!p))
+		goto done;
+
+	memcpy(p, dat, len);
+	dalring_commit(thr->ring);
+	ret = 0;
+
+done:
+	natm_store(&thr->async_busy, busy);
+	return ret;
+}
+
+/**
+ * \brief Pack and queue, don't format.
+ *
+ * \return -1 if the fmt can not be packed, format it the old way.
+ */
+int dalog_async_push_bin(unsigned char type, unsigned int mask, char *prog, char *modu,
+		char *file, char *func, int ln, const char *fmt, va_list ap)
+{
+	unsigned long long buf[1024 / 8];
+	dalbin_s *bin = (dalbin_s*)buf;
+	int alen;
+
+	alen = dalfmt_pack((char*)(bin + 1), sizeof(buf) - sizeof(dalbin_s), fmt, ap);
+	if (alen < 0)
+		return -1;
+
+	bin->rtm = 0;
+	bin->atm = 0;
+	if (mask & DALOG_NTM)
+		bin->rtm = dalog_time_ns();
+	else if (mask & DALOG_RTM)
+		bin->rtm = dalog_time_rel();
+	if (mask & DALOG_ATM)
+		bin->atm = dalog_time_abs();
+
+	bin->fmt = (uintptr_t)fmt;
+	bin->prog = (uintptr_t)prog;
+	bin->modu = (uintptr_t)modu;
+	bin->file = (uintptr_t)file;
+	bin->func = (uintptr_t)func;
+
+	bin->mask = mask;
+	bin->line = ln;
+	bin->tid = (unsigned int)pthread_self();
+	bin->type = type;
+
+	/* Dropped is counted, still done, stopped is formatted */
+	return dalog_async_push(DALREC_BIN, bin, sizeof(dalbin_s) + alen) > 0 ? -1 : 0;
+}
+
+/*-----------------------------------------------------------------------
+ * Consumer
+ */
+static void report_drops(void)
+{
+	dalthr_s *thr;
+	unsigned long drops = 0;
+	unsigned long long rbuf[128 / 8];
+	dalrec_s *rec = (dalrec_s*)rbuf;
+	char *buf = (char*)(rec + 1);
+	int i, len;
+
+	for (thr = dalog_thr_list(); thr; thr = thr->next)
+		if (thr->ring)
+			drops += thr->ring->drops;
+
+	if (dalog_likely(drops == __drops_reported))
+		return;
+
+	len = sprintf(buf, "|!| dalog: %lu messages dropped, ring full\n",
+			drops - __drops_reported);
+	__drops_reported = drops;
+	dalog_emit(buf, len);
+
+	/* Let the capture know it too */
+	if (__dalog_blogger_cnt) {
+		rec->len = len + 1;
+		rec->kind = DALREC_TEXT;
+		rec->sid = 0;
+
+		pthread_mutex_lock(&__bsink_mutex);
+		for (i = 0; i < MAX_BLOGGER; i++)
+			if (__bsinks[i].logger)
+				bsink_rec(&__bsinks[i], rec);
+		pthread_mutex_unlock(&__bsink_mutex);
+	}
+}
+
+static int drain_all(void)
+{
+	dalthr_s *thr;
+	int st, cnt = 0;
+
+	for (thr = dalog_thr_list(); thr; thr = thr->next) {
+		st = natm_load(&thr->state);
+		if (!thr->ring || st == DALTHR_FREE)
+			continue;
+
+		cnt += dalring_drain(thr->ring);
+
+		/* Exited thread, the slot can be reused now */
+		if (st == DALTHR_DEAD)
+			natm_store(&thr->state, DALTHR_FREE);
+	}
+
+	report_drops();
+	return cnt;
+}
+
+static void *thread_async(void *user_data)
+{
+	unsigned int idle = 0;
+
+	for (;;) {
+		if (drain_all()) {
+			idle = 0;
+			continue;
+		}
+
+		if (natm_load(&__async_quit))
+			break;
+
+		usleep(1000 << idle);
+		if (idle < MAX_IDLE_SHIFT)
+			idle++;
+	}
+
+	drain_all();
+	return NULL;
+}
+
+static void async_atfork_child(void)
+{
+	dalthr_s *thr, *self = dalog_thr();
+	int i;
+
+	if (!__dalog_async_on)
+		return;
+
+	/* Only the forking thread survived, forget what others left */
+	for (thr = dalog_thr_list(); thr; thr = thr->next) {
+		if (thr == self)
+			continue;
+		if (thr->ring)
+			thr->ring->tail = thr->ring->head;
+		thr->async_busy = 0;
+		thr->state = DALTHR_FREE;
+	}
+
+	/* New pid, new stream */
+	for (i = 0; i < MAX_BLOGGER; i++) {
+		__bsinks[i].started = 0;
+		seen_reset(&__bsinks[i]);
+	}
+	dalog_shm_atfork_child();
+
+	__drops_reported = 0;
+	if (pthread_create(&__async_thread, NULL, thread_async, NULL))
+		__dalog_async_on = 0;
+}
+
+/*-----------------------------------------------------------------------
+ * API
+ */
+int dalog_async_start(unsigned int ring_size)
+{
+	static int once = 0;
+	unsigned int size;
+
+	if (__dalog_async_on)
+		return 0;
+
+	if (!ring_size)
+		ring_size = DFT_RING_SIZE;
+	for (size = MIN_RING_SIZE; size < ring_size; size <<= 1)
+		;
+	__ring_size = size;
+
+	__async_quit = 0;
+	if (pthread_create(&__async_thread, NULL, thread_async, NULL)) {
+		if (dalog_noisy())
+			fprintf(stderr, "dalog_async_start: pthread_create failed, e:%d\n", errno);
+		return -1;
+	}
+
+	if (!once) {
+		once = 1;
+		pthread_atfork(NULL, NULL, async_atfork_child);
+		atexit(dalog_async_stop);
+	}
+
+	__dalog_async_on = 1;
+	return 0;
+}
+
+void dalog_async_stop(void)
+{
+	dalthr_s *thr, *self = dalog_thr();
+
+	if (!__dalog_async_on)
+		return;
+
+	/* New lines go the sync way, wait the ones past the check */
+	natm_store(&__dalog_async_on, 0);
+	natm_fence();
+	for (thr = dalog_thr_list(); thr; thr = thr->next)
+		while (thr != self && natm_load(&thr->async_busy) &&
+				natm_load(&thr->state) != DALTHR_FREE)
+			sched_yield();
+
+	/* Then flush what left in rings */
+	natm_store(&__async_quit, 1);
+	pthread_join(__async_thread, NULL);
+}
+
+unsigned long dalog_async_drops(void)
+{
+	dalthr_s *thr;
+	unsigned long drops = 0;
+
+	for (thr = dalog_thr_list(); thr; thr = thr->next)
+		if (thr->ring)
+			drops += thr->ring->drops;
+
+	return drops;
+}
+
+void dalog_async_binary(int on)
+{
+	__dalog_async_bin = on;
+}
+
+/*-----------------------------------------------------------------------
+ * Binary logger: fed by the async thread, start it if not yet
+ */
+int dalog_add_blogger(DAL_BLOGGER logger)
+{
+	int i, ret = -1;
+
+	pthread_mutex_lock(&__bsink_mutex);
+	for (i = 0; i < MAX_BLOGGER; i++)
+		if (__bsinks[i].logger == logger) {
+			ret = 0;
+			goto done;
+		}
+
+	for (i = 0; i < MAX_BLOGGER; i++)
+		if (!__bsinks[i].logger) {
+			memset(&__bsinks[i], 0, sizeof(dalbsink_s));
+			nbuf_init(&__bsinks[i].nb, 1024);
+			__bsinks[i].logger = logger;
+			__dalog_blogger_cnt++;
+			ret = 0;
+			break;
+		}
+done:
+	pthread_mutex_unlock(&__bsink_mutex);
+
+	if (ret) {
+		if (dalog_noisy())
+			fprintf(stderr, "dalog_add_blogger: Only up to %d logger supported.\n", MAX_BLOGGER);
+		return -1;
+	}
+
+	return dalog_async_start(0);
+}
+
+int dalog_del_blogger(DAL_BLOGGER logger)
+{
+	int i, ret = -1;
+
+	pthread_mutex_lock(&__bsink_mutex);
+	for (i = 0; i < MAX_BLOGGER; i++)
+		if (__bsinks[i].logger == logger) {
+			nbuf_release(&__bsinks[i].nb);
+			nmem_free_s(__bsinks[i].seen);
+			memset(&__bsinks[i], 0, sizeof(dalbsink_s));
+			__dalog_blogger_cnt--;
+			ret = 0;
+			break;
+		}
+	pthread_mutex_unlock(&__bsink_mutex);
+
+	return ret;
+}
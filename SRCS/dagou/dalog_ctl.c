@@ -0,0 +1,413 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/**
+ * @file     dalog_ctl.c
+ * @brief    Control channel of dalog, the rules pushed by dr.
+ *
+ * Each process bind "@dalog.ctl.<pid>", see DALOG_CTL_NAME, and take
+ * the commands, one per line:
+ *
+ *      add prog=xxx,modu=xxx,...,mask=xxx
+ *      del <idx>
+ *      clr
+ *      list
+ *      sites
+ *      stats
+ *
+ * or "set" and the whole new rule set in the rest of the datagram. A
+ * command is applied as it comes, nothing is read again, but the "add"
+ * lines in a row are published at once. Only the same user or root is
+ * served.
+ *
+ * The rtcfg file is only watched if given by DALOG_RTCFG or
+ * --dalog-rtcfg, by the same thread, and only the lines appended since
+ * last time are read, also published at once.
+ *
+ * A forked child only closes what is of the parent in the atfork, the
+ * socket and the thread are made by its first log, most children exec
+ * before that.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+
+#include <helper.h>
+#include <dalog.h>
+#include <dalog_inner.h>
+#include <dalog_setup.h>
+
+/* In MS, a peer does not read is given up */
+#define CTL_SNDTIMEO    200
+
+/* In MS, the stats page is renewed */
+#define CTL_STATS_TICK  1000
+
+static int __ctl_fd = -1;
+static int __ctl_ino = -1;
+static char *__ctl_rtcfg = NULL;
+static long __ctl_rtcfg_ofs = 0;
+static int __ctl_started = 0;
+
+int __dalog_ctl_stale = 0;
+
+/*-----------------------------------------------------------------------
+ * rtcfg
+ */
+
+/* Only the lines appended since last time */
+static void rtcfg_apply(void)
+{
+	char *line = NULL, *rules = NULL;
+	size_t len = 0, rlen = 0;
+	struct stat st;
+	FILE *fp, *mp;
+
+	fp = fopen(__ctl_rtcfg, "rt");
+	if (!fp)
+		return;
+
+	mp = open_memstream(&rules, &rlen);
+	if (!mp) {
+		fclose(fp);
+		return;
+	}
+
+	/* Truncated, start over */
+	if (!fstat(fileno(fp), &st) && st.st_size < __ctl_rtcfg_ofs)
+		__ctl_rtcfg_ofs = 0;
+
+	fseek(fp, __ctl_rtcfg_ofs, SEEK_SET);
+	while (getline(&line, &len, fp) != -1) {
+		/* Not ended yet, take it next time */
+		if (!strchr(line, '\n'))
+			break;
+		fputs(line, mp);
+		__ctl_rtcfg_ofs = ftell(fp);
+	}
+
+	fclose(fp);
+	fclose(mp);
+	if (rlen)
+		dalog_rule_add_lines(rules);
+	nmem_free_s(rules);
+	nmem_free_s(line);
+}
+
+static int rtcfg_watch(void)
+{
+	FILE *fp;
+
+	__ctl_ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (__ctl_ino < 0)
+		return -1;
+
+	fp = fopen(__ctl_rtcfg, "a+");
+	if (fp)
+		fclose(fp);
+
+	if (inotify_add_watch(__ctl_ino, __ctl_rtcfg, IN_MODIFY) < 0) {
+		close(__ctl_ino);
+		__ctl_ino = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void rtcfg_read(void)
+{
+	char buf[2048];
+	int n, changed = 0;
+
+	while ((n = read(__ctl_ino, buf, sizeof(buf))) > 0)
+		changed = 1;
+	if (changed)
+		rtcfg_apply();
+}
+
+/*-----------------------------------------------------------------------
+ * Socket
+ */
+/* Blocked by a full queue of the peer, for CTL_SNDTIMEO at most */
+static void ctl_reply(struct sockaddr_un *to, socklen_t tlen, const char *buf, int len)
+{
+	if (tlen <= offsetof(struct sockaddr_un, sun_path))
+		return;
+	sendto(__ctl_fd, buf, len, MSG_NOSIGNAL, (struct sockaddr*)to, tlen);
+}
+
+static void ctl_list(struct sockaddr_un *to, socklen_t tlen)
+{
+	char buf[DALOG_CTL_MAX];
+	unsigned int i;
+	int n;
+
+	n = snprintf(buf, sizeof(buf), "# %d", (int)getpid());
+	ctl_reply(to, tlen, buf, n);
+
+	for (i = 0; (n = dalog_rule_get(i, buf, sizeof(buf))) >= 0; i++)
+		ctl_reply(to, tlen, buf, n);
+	ctl_reply(to, tlen, "", 0);
+}
+
+/* Many lines a datagram, there could be thousands of sites */
+static void ctl_sites(struct sockaddr_un *to, socklen_t tlen)
+{
+	char buf[DALOG_CTL_MAX], line[1024];
+	unsigned int i;
+	int n, len;
+
+	len = snprintf(buf, sizeof(buf), "# %d\n", (int)getpid());
+	for (i = 0; (n = dalog_site_get(i, line, sizeof(line))) >= 0; i++) {
+		if (len + n + 1 > (int)sizeof(buf)) {
+			ctl_reply(to, tlen, buf, len);
+			len = 0;
+		}
+		memcpy(buf + len, line, n);
+		len += n;
+		buf[len++] = '\n';
+	}
+	if (len)
+		ctl_reply(to, tlen, buf, len);
+	ctl_reply(to, tlen, "", 0);
+}
+
+static void ctl_stats(struct sockaddr_un *to, socklen_t tlen)
+{
+	char buf[2048];
+	int n;
+
+	n = snprintf(buf, sizeof(buf), "# %d\n", (int)getpid());
+	n += dalog_stats_text(buf + n, sizeof(buf) - n);
+	ctl_reply(to, tlen, buf, n);
+	ctl_reply(to, tlen, "", 0);
+}
+
+static void ctl_command(char *cmd, struct sockaddr_un *to, socklen_t tlen)
+{
+	if (!strncmp(cmd, "del ", 4))
+		dalog_rule_del((unsigned int)atoi(cmd + 4));
+	else if (!strcmp(cmd, "clr"))
+		dalog_rule_clr();
+	else if (!strcmp(cmd, "list"))
+		ctl_list(to, tlen);
+	else if (!strcmp(cmd, "sites"))
+		ctl_sites(to, tlen);
+	else if (!strcmp(cmd, "stats"))
+		ctl_stats(to, tlen);
+	else if (dalog_noisy())
+		fprintf(stderr, "dalog_ctl: bad command '%s'\n", cmd);
+}
+
+static void ctl_read(void)
+{
+	char buf[DALOG_CTL_MAX + 1], cbuf[CMSG_SPACE(sizeof(struct ucred))];
+	struct sockaddr_un from;
+	struct cmsghdr *cm;
+	struct ucred *cred;
+	struct msghdr msg;
+	struct iovec iov;
+	static char adds[DALOG_CTL_MAX + 1];
+	char *line, *eol;
+	int n, alen;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = buf;
+		iov.iov_len = DALOG_CTL_MAX;
+		msg.msg_name = &from;
+		msg.msg_namelen = sizeof(from);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		n = recvmsg(__ctl_fd, &msg, MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return;
+
+		cred = NULL;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_CREDENTIALS)
+				cred = (struct ucred*)CMSG_DATA(cm);
+		if (!cred || (cred->uid && cred->uid != getuid()))
+			continue;
+
+		buf[n] = '\0';
+		if (!strncmp(buf, "set", 3) && (buf[3] == '\n' || !buf[3])) {
+			dalog_rule_set(buf + 3 + !!buf[3]);
+			continue;
+		}
+
+		/* The "add" lines in a row are kept in adds till another command */
+		alen = 0;
+		for (line = buf; line && *line; line = eol) {
+			eol = strchr(line, '\n');
+			if (eol)
+				*eol++ = '\0';
+			if (!strncmp(line, "add ", 4)) {
+				alen += sprintf(adds + alen, "%s\n", line + 4);
+				continue;
+			}
+			if (alen) {
+				dalog_rule_add_lines(adds);
+				alen = 0;
+			}
+			if (*line)
+				ctl_command(line, &from, msg.msg_namelen);
+		}
+		if (alen)
+			dalog_rule_add_lines(adds);
+	}
+}
+
+static int ctl_open(void)
+{
+	struct sockaddr_un sun;
+	struct timeval tv;
+	socklen_t slen;
+	int on = 1;
+
+	__ctl_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (__ctl_fd < 0)
+		return -1;
+	setsockopt(__ctl_fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+
+	tv.tv_sec = 0;
+	tv.tv_usec = CTL_SNDTIMEO * 1000;
+	setsockopt(__ctl_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path + 1, sizeof(sun.sun_path) - 1, DALOG_CTL_NAME, (int)getpid());
+	slen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(sun.sun_path + 1);
+
+	if (bind(__ctl_fd, (struct sockaddr*)&sun, slen)) {
+		if (dalog_noisy())
+			fprintf(stderr, "dalog_ctl: bind @%s error: %s\n", sun.sun_path + 1, strerror(errno));
+		close(__ctl_fd);
+		__ctl_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void *thread_ctl(void *user_data)
+{
+	struct pollfd pfd[2];
+	int n;
+
+	pfd[0].fd = __ctl_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = __ctl_ino;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		n = poll(pfd, 2, dalog_stats_on() ? CTL_STATS_TICK : -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+
+		/* Each wake up, by the tick or a command */
+		dalog_stats_update();
+
+		if (pfd[0].revents)
+			ctl_read();
+		if (pfd[1].revents)
+			rtcfg_read();
+	}
+
+	dalog_stats_stop();
+	return NULL;
+}
+
+static int ctl_run(void)
+{
+	pthread_t thread;
+
+	if (ctl_open() && __ctl_ino < 0)
+		goto fail;
+
+	if (pthread_create(&thread, NULL, thread_ctl, NULL))
+		goto fail;
+	pthread_detach(thread);
+	return 0;
+
+fail:
+	/* The only one renew the page of counters */
+	dalog_stats_stop();
+	return -1;
+}
+
+/*
+ * The name and the watch are of the parent, and the thread is gone. Only
+ * close() here, the rest is not safe in the child of many threads.
+ */
+static void ctl_atfork_child(void)
+{
+	if (__ctl_fd >= 0)
+		close(__ctl_fd);
+	__ctl_fd = -1;
+
+	if (__ctl_ino >= 0)
+		close(__ctl_ino);
+	__ctl_ino = -1;
+
+	__dalog_ctl_stale = 1;
+}
+
+/**
+ * \brief Start again in the forked child, by dalog_vf, once.
+ */
+void dalog_ctl_restart(void)
+{
+	int stale = 1;
+
+	if (!natm_cas(&__dalog_ctl_stale, &stale, 0))
+		return;
+
+	if (__ctl_rtcfg)
+		rtcfg_watch();
+	ctl_run();
+}
+
+/*-----------------------------------------------------------------------
+ * API
+ */
+
+/**
+ * \brief Serve the control socket, and the rtcfg if not NULL.
+ */
+int dalog_ctl_start(const char *rtcfg)
+{
+	if (__ctl_started)
+		return 0;
+	__ctl_started = 1;
+
+	/* What is there now, as the processes started before have seen */
+	if (rtcfg) {
+		__ctl_rtcfg = strdup(rtcfg);
+		if (rtcfg_watch() && dalog_noisy())
+			fprintf(stderr, "dalog_ctl: can not watch '%s'\n", rtcfg);
+		rtcfg_apply();
+	}
+
+	pthread_atfork(NULL, NULL, ctl_atfork_child);
+	return ctl_run();
+}
@@ -0,0 +1,551 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/**
+ * @file     dalog_flight.c
+ * @brief    Flight recorder of dalog, env DALOG_FLIGHT.
+ *
+ * Every site, include the masked off ones, pack its arguments into a
+ * fixed size cell of the slot of its thread, nothing formatted. The
+ * slots are in a file mapped shared, layout in dalog_fmt.h, so what is
+ * recorded is in the page cache even if the process die hard.
+ *
+ * On SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT, the records of the
+ * last DALOG_FLIGHT_SECS seconds are rendered to dalog.crash.<pid>, in
+ * the order of time. If that failed too, dayi can still decode the
+ * dalog.flight.<pid> left there. The file is removed on normal exit.
+ *
+ * The strings referred by the records are copied to the file the first
+ * time a thread use them, a small cache per thread avoids the lock. A
+ * fmt not of DALOG_LIT may be gone at the crash, its text is packed in
+ * the cell instead, without the arguments.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <helper.h>
+#include <dalog.h>
+#include <dalog_inner.h>
+
+#define DFT_SLOT_SIZE   (256 * 1024)
+#define MIN_SLOT_SIZE   (16 * 1024)
+#define MAX_SLOT        64
+#define STR_SIZE        (256 * 1024)
+#define DFT_SECS        10
+
+/* Per thread cache of the strings already in the file */
+#define SEEN_SIZE       256
+
+/* Decoration of the records, the mask of the site is not recorded */
+#define FLT_DECOR       (DALOG_RTM | DALOG_ATM | DALOG_TID | DALOG_PROG | \
+		DALOG_MODU | DALOG_FILE | DALOG_FUNC | DALOG_LINE)
+
+#define ARGS_SIZE       (DALFLT_CELL - (int)sizeof(dalrec_s) - (int)sizeof(dalbin_s))
+
+unsigned int __dalog_flight = 0;
+
+struct _dalflt_thr_s {
+	unsigned int gen;       /* Of __flt_gen, changed by fork */
+	int slot;               /* -1 if no more slot */
+	const char *seen[SEEN_SIZE];
+};
+
+static dalflt_head_s *__flt = NULL;
+static size_t __flt_len = 0;
+static unsigned int __flt_slot_size;
+static unsigned int __flt_cells = 0;
+static unsigned int __flt_gen = 1;
+static int __flt_secs = DFT_SECS;
+static char __flt_dir[256] = "/tmp";
+static char __flt_path[300];
+
+/* Strings in the file, open addressing, under __flt_mutex */
+static pthread_mutex_t __flt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long *__flt_strs = NULL;
+static unsigned int __flt_str_size = 0, __flt_str_cnt = 0;
+
+static const char *__flt_lost = "(arguments not recorded) %s";
+
+static const int __flt_sigs[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+static struct sigaction __flt_old[sizeof(__flt_sigs) / sizeof(__flt_sigs[0])];
+
+/*-----------------------------------------------------------------------
+ * File
+ */
+static dalflt_slot_s *slot_at(int i)
+{
+	return (dalflt_slot_s*)((char*)__flt + __flt->slot_ofs + (size_t)i * __flt->slot_size);
+}
+
+static dalrec_s *cell_at(dalflt_slot_s *slot, unsigned int i)
+{
+	return (dalrec_s*)((char*)slot + DALFLT_SLOT_HEAD + (i & (__flt_cells - 1)) * DALFLT_CELL);
+}
+
+static int flt_map(void)
+{
+	dalflt_head_s *hd;
+	struct tm tm;
+	time_t t;
+	size_t len;
+	int fd;
+
+	sprintf(__flt_path, "%s/dalog.flight.%d", __flt_dir, (int)getpid());
+	len = 4096 + STR_SIZE + (size_t)MAX_SLOT * __flt_slot_size;
+
+	fd = open(__flt_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		if (dalog_noisy())
+			fprintf(stderr, "dalog_flight: open %s error: %s\n", __flt_path, strerror(errno));
+		return -1;
+	}
+
+	/* Sparse, the pages of the slots not taken cost nothing */
+	if (ftruncate(fd, len)) {
+		close(fd);
+		unlink(__flt_path);
+		return -1;
+	}
+
+	hd = (dalflt_head_s*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hd == MAP_FAILED) {
+		unlink(__flt_path);
+		return -1;
+	}
+
+	t = time(NULL);
+	localtime_r(&t, &tm);
+
+	hd->order = DALBIN_ORDER;
+	hd->version = DALBIN_VERSION;
+	hd->pid = (int)getpid();
+	hd->gmtoff = (int)tm.tm_gmtoff;
+	hd->rel0 = dalog_time_rel();
+	hd->abs0 = dalog_time_abs();
+	hd->str_ofs = 4096;
+	hd->str_size = STR_SIZE;
+	hd->str_used = 0;
+	hd->slot_ofs = 4096 + STR_SIZE;
+	hd->slot_size = __flt_slot_size;
+	hd->slot_max = MAX_SLOT;
+	hd->slot_cnt = 0;
+	natm_fence();
+	memcpy(hd->magic, DALFLT_MAGIC, 8);
+
+	__flt = hd;
+	__flt_len = len;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------
+ * Strings: under __flt_mutex
+ */
+static unsigned int str_hash(unsigned long long id)
+{
+	return (unsigned int)(id >> 3) * 2654435761U;
+}
+
+static int str_has(unsigned long long id)
+{
+	unsigned int i;
+
+	if (!__flt_str_size)
+		return 0;
+
+	for (i = str_hash(id) & (__flt_str_size - 1); __flt_strs[i];
+			i = (i + 1) & (__flt_str_size - 1))
+		if (__flt_strs[i] == id)
+			return 1;
+	return 0;
+}
+
+static void str_set(unsigned long long id)
+{
+	unsigned long long *old = __flt_strs;
+	unsigned int i, j, old_size = __flt_str_size;
+
+	if (__flt_str_cnt * 2 >= __flt_str_size) {
+		__flt_str_size = old_size ? old_size * 2 : 1024;
+		__flt_strs = nmem_alloz(__flt_str_size, unsigned long long);
+		__flt_str_cnt = 0;
+
+		for (j = 0; j < old_size; j++)
+			if (old[j])
+				str_set(old[j]);
+		nmem_free_s(old);
+	}
+
+	for (i = str_hash(id) & (__flt_str_size - 1); __flt_strs[i];
+			i = (i + 1) & (__flt_str_size - 1))
+		;
+	__flt_strs[i] = id;
+	__flt_str_cnt++;
+}
+
+/* Append a DALREC_STR, marked even if the area is full, not try again */
+static void str_publish(const char *str)
+{
+	unsigned long long id = (uintptr_t)str;
+	unsigned int used, len, need;
+	dalrec_s *rec;
+
+	pthread_mutex_lock(&__flt_mutex);
+	if (str_has(id))
+		goto done;
+	str_set(id);
+
+	len = 8 + strlen(str) + 1;
+	need = DALOG_ALIGN8(sizeof(dalrec_s) + len);
+	used = __flt->str_used;
+	if (used + need > __flt->str_size)
+		goto done;
+
+	rec = (dalrec_s*)((char*)__flt + __flt->str_ofs + used);
+	rec->len = len;
+	rec->kind = DALREC_STR;
+	rec->sid = (unsigned short)__flt->pid;
+	memcpy(rec + 1, &id, 8);
+	memcpy((char*)(rec + 1) + 8, str, len - 8);
+	natm_store(&__flt->str_used, used + need);
+
+done:
+	pthread_mutex_unlock(&__flt_mutex);
+}
+
+static inline void str_use(dalflt_thr_s *ft, const char *str)
+{
+	unsigned int h = ((uintptr_t)str >> 3) & (SEEN_SIZE - 1);
+
+	if (dalog_likely(!str || ft->seen[h] == str))
+		return;
+	str_publish(str);
+	ft->seen[h] = str;
+}
+
+/*-----------------------------------------------------------------------
+ * Record
+ */
+static dalflt_thr_s *flt_thr(void)
+{
+	dalthr_s *thr = dalog_thr();
+	dalflt_thr_s *ft;
+	unsigned int slot;
+
+	if (dalog_unlikely(!__flt || !thr))
+		return NULL;
+
+	ft = thr->flt;
+
+	if (dalog_likely(ft && ft->gen == __flt_gen))
+		return ft->slot >= 0 ? ft : NULL;
+
+	if (!ft) {
+		ft = nmem_alloz(1, dalflt_thr_s);
+		if (!ft)
+			return NULL;
+		thr->flt = ft;
+	}
+
+	/* First time, or forked: take a slot of the file */
+	memset(ft->seen, 0, sizeof(ft->seen));
+	ft->gen = __flt_gen;
+	slot = natm_add(&__flt->slot_cnt, 1) - 1;
+	ft->slot = slot < __flt->slot_max ? (int)slot : -1;
+	if (ft->slot < 0)
+		return NULL;
+
+	slot_at(ft->slot)->tid = (unsigned int)pthread_self();
+	return ft;
+}
+
+/* Pack the string as the argument of __flt_lost, cut if too long */
+static int pack_lost(char *args, const char *str)
+{
+	unsigned long long slen = strlen(str);
+
+	if (slen > ARGS_SIZE - 8 - 1)
+		slen = ARGS_SIZE - 8 - 1;
+
+	memcpy(args, &slen, 8);
+	memcpy(args + 8, str, slen);
+	args[8 + slen] = '\0';
+	return 8 + DALOG_ALIGN8(slen + 1);
+}
+
+void dalog_flight_put(unsigned char type, char *prog, char *modu, char *file,
+		char *func, int ln, const char *fmt, int lit, va_list ap)
+{
+	dalflt_thr_s *ft = flt_thr();
+	dalflt_slot_s *slot;
+	unsigned int head;
+	dalrec_s *rec;
+	dalbin_s *bin;
+	char *args;
+	int alen;
+
+	if (dalog_unlikely(!ft))
+		return;
+
+	slot = slot_at(ft->slot);
+	head = slot->head;
+
+	rec = cell_at(slot, head);
+	bin = (dalbin_s*)(rec + 1);
+	args = (char*)(bin + 1);
+
+	alen = lit ? dalfmt_pack(args, ARGS_SIZE, fmt, ap) : -1;
+	if (alen < 0) {
+		alen = pack_lost(args, fmt);
+		fmt = __flt_lost;
+	}
+
+	bin->rtm = dalog_time_rel();
+	bin->atm = 0;
+	bin->fmt = (uintptr_t)fmt;
+	bin->prog = (uintptr_t)prog;
+	bin->modu = (uintptr_t)modu;
+	bin->file = (uintptr_t)file;
+	bin->func = (uintptr_t)func;
+	bin->mask = FLT_DECOR;
+	bin->line = ln;
+	bin->tid = (unsigned int)pthread_self();
+	bin->type = type;
+
+	rec->len = sizeof(dalbin_s) + alen;
+	rec->kind = DALREC_BIN;
+	rec->sid = (unsigned short)__flt->pid;
+
+	str_use(ft, fmt);
+	str_use(ft, prog);
+	str_use(ft, modu);
+	str_use(ft, file);
+	str_use(ft, func);
+
+	natm_store(&slot->head, head + 1);
+}
+
+/*-----------------------------------------------------------------------
+ * Dump: called in the signal handler, no malloc and no lock
+ */
+static void dump_write(int fd, const char *buf, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void dump_rec(int fd, dalrec_s *rec, unsigned long long abs)
+{
+	static char buf[4096];
+	static char date[32];
+	static time_t date_sec = -1;
+	dalbin_s *bin = (dalbin_s*)(rec + 1);
+	dalhead_s hd;
+	struct tm tm;
+	time_t t;
+	int ofs, ret;
+
+	t = (time_t)(abs / 1000000000);
+	if (t != date_sec) {
+		t += __flt->gmtoff;
+		gmtime_r(&t, &tm);
+		strftime(date, sizeof(date), "%Y/%m/%d %H:%M:%S", &tm);
+		date_sec = (time_t)(abs / 1000000000);
+	}
+
+	hd.type = bin->type;
+	hd.mask = bin->mask;
+	hd.pid = __flt->pid;
+	hd.tid = bin->tid;
+	hd.rtm = (unsigned long)(bin->rtm / 1000000);
+	hd.ntm = bin->rtm;
+	hd.atm = date;
+	hd.atm_ms = (unsigned int)(abs / 1000000 % 1000);
+	hd.prog = (const char*)(uintptr_t)bin->prog;
+	hd.modu = (const char*)(uintptr_t)bin->modu;
+	hd.file = (const char*)(uintptr_t)bin->file;
+	hd.func = (const char*)(uintptr_t)bin->func;
+	hd.line = bin->line;
+
+	ofs = dalfmt_head(buf, &hd);
+	ret = dalfmt_render(buf + ofs, sizeof(buf) - ofs - 1, (const char*)(uintptr_t)bin->fmt,
+			(const char*)(bin + 1), rec->len - sizeof(dalbin_s));
+	if (ret < 0)
+		return;
+
+	ofs += ret > (int)sizeof(buf) - ofs - 2 ? (int)sizeof(buf) - ofs - 2 : ret;
+	if (buf[ofs - 1] != '\n')
+		buf[ofs++] = '\n';
+	dump_write(fd, buf, ofs);
+}
+
+static void flt_dump(int fd, int sig)
+{
+	static unsigned int pos[MAX_SLOT], end[MAX_SLOT];
+	unsigned long long rel, abs, cut, rtm = 0, best_rtm;
+	unsigned int i, cnt;
+	dalrec_s *rec;
+	char buf[256];
+	int best, len;
+
+	/* A fresh pair for the records, also for dayi */
+	rel = dalog_time_rel();
+	abs = dalog_time_abs();
+	__flt->rel0 = rel;
+	__flt->abs0 = abs;
+	cut = rel > (unsigned long long)__flt_secs * 1000000000 ?
+		rel - (unsigned long long)__flt_secs * 1000000000 : 0;
+
+	len = sprintf(buf, "|!| dalog: flight recorder of pid %d, signal %d, last %d seconds\n",
+			__flt->pid, sig, __flt_secs);
+	dump_write(fd, buf, len);
+
+	cnt = natm_load(&__flt->slot_cnt);
+	if (cnt > __flt->slot_max)
+		cnt = __flt->slot_max;
+	for (i = 0; i < cnt; i++) {
+		end[i] = natm_load(&slot_at(i)->head);
+		pos[i] = end[i] - __flt_cells;
+	}
+
+	/* Merge the slots by time */
+	for (;;) {
+		best = -1;
+		best_rtm = 0;
+		for (i = 0; i < cnt; i++) {
+			/* The head wraps, so by !=, and skip the cells not written */
+			for (; pos[i] != end[i]; pos[i]++) {
+				rec = cell_at(slot_at(i), pos[i]);
+				rtm = ((dalbin_s*)(rec + 1))->rtm;
+				if (rec->len && rtm >= cut)
+					break;
+			}
+			if (pos[i] == end[i])
+				continue;
+			if (best < 0 || rtm < best_rtm) {
+				best = i;
+				best_rtm = rtm;
+			}
+		}
+		if (best < 0)
+			break;
+
+		rec = cell_at(slot_at(best), pos[best]++);
+		dump_rec(fd, rec, abs - (rel - best_rtm));
+	}
+}
+
+static void flt_on_signal(int sig)
+{
+	char path[320];
+	unsigned int i;
+	int fd;
+
+	sprintf(path, "%s/dalog.crash.%d", __flt_dir, (int)getpid());
+	fd = __flt ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+	if (fd >= 0) {
+		flt_dump(fd, sig);
+		close(fd);
+	}
+
+	/* Let the old handler or the default one finish it */
+	for (i = 0; i < sizeof(__flt_sigs) / sizeof(__flt_sigs[0]); i++)
+		if (__flt_sigs[i] == sig)
+			sigaction(sig, &__flt_old[i], NULL);
+	raise(sig);
+}
+
+/*-----------------------------------------------------------------------
+ * Process
+ */
+static void flt_atfork_child(void)
+{
+	if (!__flt)
+		return;
+
+	/* The file is of the parent, the slots taken again */
+	munmap(__flt, __flt_len);
+	__flt = NULL;
+	pthread_mutex_init(&__flt_mutex, NULL);
+	nmem_free_sz(__flt_strs);
+	__flt_str_size = __flt_str_cnt = 0;
+	__flt_gen++;
+
+	if (flt_map())
+		__dalog_flight = 0;
+}
+
+/* Not crashed, the record is not needed */
+static void flt_exit(void)
+{
+	if (__flt && __flt->pid == (int)getpid())
+		unlink(__flt_path);
+}
+
+/**
+ * \brief Start the recorder, slot_size in bytes of each thread.
+ *
+ * env: DALOG_FLIGHT_DIR=<dir>, DALOG_FLIGHT_SECS=<seconds to dump>
+ */
+int dalog_flight_start(unsigned int slot_size)
+{
+	struct sigaction sa;
+	unsigned int i;
+	char *env;
+
+	if (__flt)
+		return 0;
+
+	if (!slot_size)
+		slot_size = DFT_SLOT_SIZE;
+	if (slot_size < MIN_SLOT_SIZE)
+		slot_size = MIN_SLOT_SIZE;
+	for (__flt_cells = 1; __flt_cells * DALFLT_CELL < slot_size; __flt_cells <<= 1)
+		;
+	__flt_slot_size = DALFLT_SLOT_HEAD + __flt_cells * DALFLT_CELL;
+
+	env = getenv("DALOG_FLIGHT_DIR");
+	if (env)
+		snprintf(__flt_dir, sizeof(__flt_dir), "%s", env);
+	env = getenv("DALOG_FLIGHT_SECS");
+	if (env && atoi(env) > 0)
+		__flt_secs = atoi(env);
+
+	if (flt_map())
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = flt_on_signal;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < sizeof(__flt_sigs) / sizeof(__flt_sigs[0]); i++)
+		sigaction(__flt_sigs[i], &sa, &__flt_old[i]);
+
+	pthread_atfork(NULL, NULL, flt_atfork_child);
+	atexit(flt_exit);
+
+	/* Masked off sites call in from now on */
+	__dalog_flight = DALOG_FLT;
+	return 0;
+}
@@ -0,0 +1,709 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/**
+ * @file     dalog_fmt.c
+ * @brief    Text header and binary record codec of dalog.
+ *
+ * Arguments are packed in 8 bytes slots, in the order they are consumed
+ * by the conversion specifiers of fmt:
+ *
+ *   d i                : signed, as long long
+ *   u o x X c p        : unsigned, as unsigned long long
+ *   e E f F g G a A    : double, long double is converted to double
+ *   '*' width/precision: int, as long long
+ *   m                  : errno when packed, as long long
+ *   s                  : u64 length (0xffffffff for NULL) + chars + '\0',
+ *                        then padded to 8 bytes
+ *
+ * Positional ('$'), %n and wide string are not supported, the caller
+ * should fall back to vsnprintf.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <dalog.h>
+#include <dalog_fmt.h>
+
+/*-----------------------------------------------------------------------
+ * Text header
+ */
+int dalfmt_head(char *buf, const dalhead_s *hd)
+{
+	unsigned int mask = hd->mask;
+	int ofs = 0;
+
+	/* Type */
+	if (dalog_likely(hd->type))
+		ofs += sprintf(buf, "|%c|", hd->type);
+
+	/* Time */
+	if (mask & DALOG_RTM)
+		ofs += sprintf(buf + ofs, "s:%lu|", hd->rtm);
+	if (mask & DALOG_NTM)
+		ofs += sprintf(buf + ofs, "u:%llu|", hd->ntm);
+	if (mask & DALOG_ATM)
+		ofs += sprintf(buf + ofs, "S:%s.%03d|", hd->atm, hd->atm_ms);
+
+	/* ID */
+	if (mask & DALOG_PID)
+		ofs += sprintf(buf + ofs, "j:%d|", hd->pid);
+	if (mask & DALOG_TID)
+		ofs += sprintf(buf + ofs, "x:%x|", hd->tid);
+
+	/* Name and LINE */
+	if ((mask & DALOG_PROG) && hd->prog)
+		ofs += sprintf(buf + ofs, "P:%s|", hd->prog);
+
+	if ((mask & DALOG_MODU) && hd->modu)
+		ofs += sprintf(buf + ofs, "M:%s|", hd->modu);
+
+	if ((mask & DALOG_FILE) && hd->file)
+		ofs += sprintf(buf + ofs, "F:%s|", hd->file);
+
+	if ((mask & DALOG_FUNC) && hd->func)
+		ofs += sprintf(buf + ofs, "H:%s|", hd->func);
+
+	if (mask & DALOG_LINE)
+		ofs += sprintf(buf + ofs, "L:%d|", hd->line);
+
+	if (dalog_likely(ofs))
+		ofs += sprintf(buf + ofs, " ");
+
+	return ofs;
+}
+
+/* Days since 1970/01/01 of the civil date */
+static long long civil_days(int y, int m, int d)
+{
+	int era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return (long long)era * 146097 + doe - 719468;
+}
+
+static int digits(const char *p, int n)
+{
+	int v = 0;
+
+	while (n--) {
+		if (*p < '0' || *p > '9')
+			return -1;
+		v = v * 10 + (*p++ - '0');
+	}
+	return v;
+}
+
+/* "YYYY/mm/dd HH:MM:SS", as timegm, but not touch the libc */
+static long long parse_atm(const char *p, int len)
+{
+	int y, m, d, hh, mm, ss;
+
+	if (len < 19 || p[4] != '/' || p[7] != '/' || p[10] != ' ' || p[13] != ':' || p[16] != ':')
+		return -1;
+
+	y = digits(p, 4);
+	m = digits(p + 5, 2);
+	d = digits(p + 8, 2);
+	hh = digits(p + 11, 2);
+	mm = digits(p + 14, 2);
+	ss = digits(p + 17, 2);
+	if (y < 0 || m < 1 || m > 12 || d < 1 || hh < 0 || mm < 0 || ss < 0)
+		return -1;
+
+	return civil_days(y, m, d) * 86400 + hh * 3600 + mm * 60 + ss;
+}
+
+/**
+ * \brief Pick the type, S:, P:, M:, F:, H: and L: of a line made by dalfmt_head.
+ *
+ * Return the length of the header, 0 if the line has none.
+ */
+int dalfmt_parse(const char *line, int len, daltext_s *tx)
+{
+	const char *p, *e, *end = line + len;
+
+	memset(tx, 0, sizeof(*tx));
+	tx->atm = -1;
+	tx->line = -1;
+
+	if (len < 4 || line[0] != '|' || line[2] != '|')
+		return 0;
+	tx->type = (unsigned char)line[1];
+
+	/* "x:...|" until the ' ' before the message */
+	for (p = line + 3; p + 1 < end && *p != ' '; p = e + 1) {
+		e = memchr(p, '|', end - p);
+		if (!e)
+			break;
+		if (e - p < 2 || p[1] != ':')
+			continue;
+
+		switch (p[0]) {
+		case 'S':
+			tx->atm = parse_atm(p + 2, e - p - 2);
+			break;
+		case 'P':
+			tx->prog = p + 2;
+			tx->prog_len = e - p - 2;
+			break;
+		case 'M':
+			tx->modu = p + 2;
+			tx->modu_len = e - p - 2;
+			break;
+		case 'F':
+			tx->file = p + 2;
+			tx->file_len = e - p - 2;
+			break;
+		case 'H':
+			tx->func = p + 2;
+			tx->func_len = e - p - 2;
+			break;
+		case 'L':
+			tx->line = atoi(p + 2);
+			break;
+		}
+	}
+
+	return p - line;
+}
+
+/*-----------------------------------------------------------------------
+ * Conversion specifier
+ */
+#define LM_NONE 0
+#define LM_HH   1
+#define LM_H    2
+#define LM_L    3
+#define LM_LL   4
+#define LM_LD   5       /* L */
+#define LM_J    6
+#define LM_Z    7
+#define LM_T    8
+
+/*
+ * The fmt may come from a capture file or a ring of another process, a
+ * longer specifier is refused, dalfmt_render rebuilds it in a spec[64].
+ */
+#define SPEC_FLAGS_MAX  8
+#define SPEC_DIGITS_MAX 6
+
+typedef struct _dalspec_s dalspec_s;
+struct _dalspec_s {
+	const char *flag;       /* after '%' */
+	int flag_len;
+
+	int star_w;             /* width is '*' */
+	const char *width;
+	int width_len;
+
+	int star_p;             /* precision is '*' */
+	int prec;               /* -1 if not given */
+
+	int lmod;
+	char conv;
+};
+
+/* Parse the specifier start at p[0] == '%', return where it ends */
+static const char *spec_parse(const char *p, dalspec_s *sp)
+{
+	const char *q;
+
+	memset(sp, 0, sizeof(*sp));
+	sp->prec = -1;
+
+	p++;
+	sp->flag = p;
+	while (*p && strchr("-+ #0'I", *p))
+		p++;
+	sp->flag_len = p - sp->flag;
+	if (sp->flag_len > SPEC_FLAGS_MAX)
+		return NULL;
+
+	if (*p == '*') {
+		sp->star_w = 1;
+		p++;
+	} else {
+		sp->width = p;
+		while (*p >= '0' && *p <= '9')
+			p++;
+		sp->width_len = p - sp->width;
+		if (*p == '$' || sp->width_len > SPEC_DIGITS_MAX)
+			return NULL;
+	}
+
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			sp->star_p = 1;
+			p++;
+		} else {
+			sp->prec = 0;
+			for (q = p; *p >= '0' && *p <= '9'; p++) {
+				if (p - q >= SPEC_DIGITS_MAX)
+					return NULL;
+				sp->prec = sp->prec * 10 + (*p - '0');
+			}
+		}
+	}
+
+	switch (*p) {
+	case 'h':
+		p++;
+		sp->lmod = LM_H;
+		if (*p == 'h') {
+			p++;
+			sp->lmod = LM_HH;
+		}
+		break;
+	case 'l':
+		p++;
+		sp->lmod = LM_L;
+		if (*p == 'l') {
+			p++;
+			sp->lmod = LM_LL;
+		}
+		break;
+	case 'q':
+		p++;
+		sp->lmod = LM_LL;
+		break;
+	case 'L':
+		p++;
+		sp->lmod = LM_LD;
+		break;
+	case 'j':
+		p++;
+		sp->lmod = LM_J;
+		break;
+	case 'z':
+	case 'Z':
+		p++;
+		sp->lmod = LM_Z;
+		break;
+	case 't':
+		p++;
+		sp->lmod = LM_T;
+		break;
+	}
+
+	sp->conv = *p;
+	if (!sp->conv || !strchr("diuoxXcpeEfFgGaAsm", sp->conv))
+		return NULL;
+	if (sp->lmod == LM_L && sp->conv == 's')
+		return NULL;
+
+	return p + 1;
+}
+
+/*-----------------------------------------------------------------------
+ * Pack
+ */
+#define PACK_U64(v) do { \
+	unsigned long long __v = (unsigned long long)(v); \
+	if (ofs + 8 > size) \
+		goto fail; \
+	memcpy(buf + ofs, &__v, 8); \
+	ofs += 8; \
+} while (0)
+
+#define PACK_DBL(v) do { \
+	double __v = (double)(v); \
+	if (ofs + 8 > size) \
+		goto fail; \
+	memcpy(buf + ofs, &__v, 8); \
+	ofs += 8; \
+} while (0)
+
+/**
+ * \brief Pack the arguments of fmt into buf.
+ *
+ * \return bytes used, -1 if not supported or buf too small.
+ */
+int dalfmt_pack(char *buf, int size, const char *fmt, va_list ap)
+{
+	int err = errno;
+	int ofs = 0, prec;
+	unsigned int slen;
+	long long sv;
+	unsigned long long uv;
+	const char *p, *q, *s;
+	dalspec_s sp;
+	va_list aq;
+
+	va_copy(aq, ap);
+
+	for (p = fmt; (p = strchr(p, '%')); p = q) {
+		if (p[1] == '%') {
+			q = p + 2;
+			continue;
+		}
+
+		q = spec_parse(p, &sp);
+		if (!q)
+			goto fail;
+
+		prec = sp.prec;
+		if (sp.star_w)
+			PACK_U64((long long)va_arg(aq, int));
+		if (sp.star_p) {
+			prec = va_arg(aq, int);
+			PACK_U64((long long)prec);
+		}
+
+		switch (sp.conv) {
+		case 'd':
+		case 'i':
+			switch (sp.lmod) {
+			case LM_L:
+				sv = va_arg(aq, long);
+				break;
+			case LM_LL:
+			case LM_LD:
+				sv = va_arg(aq, long long);
+				break;
+			case LM_J:
+				sv = va_arg(aq, intmax_t);
+				break;
+			case LM_Z:
+				sv = va_arg(aq, ssize_t);
+				break;
+			case LM_T:
+				sv = va_arg(aq, ptrdiff_t);
+				break;
+			default:
+				sv = va_arg(aq, int);
+				break;
+			}
+			PACK_U64(sv);
+			break;
+
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			switch (sp.lmod) {
+			case LM_L:
+				uv = va_arg(aq, unsigned long);
+				break;
+			case LM_LL:
+			case LM_LD:
+				uv = va_arg(aq, unsigned long long);
+				break;
+			case LM_J:
+				uv = va_arg(aq, uintmax_t);
+				break;
+			case LM_Z:
+				uv = va_arg(aq, size_t);
+				break;
+			case LM_T:
+				uv = va_arg(aq, ptrdiff_t);
+				break;
+			default:
+				uv = va_arg(aq, unsigned int);
+				break;
+			}
+			PACK_U64(uv);
+			break;
+
+		case 'c':
+			PACK_U64(va_arg(aq, unsigned int));
+			break;
+
+		case 'p':
+			PACK_U64((uintptr_t)va_arg(aq, void*));
+			break;
+
+		case 'm':
+			PACK_U64((long long)err);
+			break;
+
+		case 's':
+			s = va_arg(aq, const char*);
+			if (!s) {
+				PACK_U64(0xffffffffULL);
+				break;
+			}
+
+			/* "%.*s" may point to a buffer without '\0' */
+			slen = prec >= 0 ? strnlen(s, prec) : strlen(s);
+			if (ofs + 8 + (int)DALOG_ALIGN8(slen + 1) > size)
+				goto fail;
+
+			uv = slen;
+			memcpy(buf + ofs, &uv, 8);
+			memcpy(buf + ofs + 8, s, slen);
+			buf[ofs + 8 + slen] = '\0';
+			ofs += 8 + DALOG_ALIGN8(slen + 1);
+			break;
+
+		default:
+			if (sp.lmod == LM_LD)
+				PACK_DBL(va_arg(aq, long double));
+			else
+				PACK_DBL(va_arg(aq, double));
+			break;
+		}
+	}
+
+	va_end(aq);
+	return ofs;
+
+fail:
+	va_end(aq);
+	return -1;
+}
+
+/*-----------------------------------------------------------------------
+ * Render
+ */
+#define TAKE_U64(v) do { \
+	if (ofs + 8 > alen) \
+		return -1; \
+	memcpy(&(v), args + ofs, 8); \
+	ofs += 8; \
+} while (0)
+
+/* snprintf but never write beyond buf + size, return what it wanted */
+#define PUT(...) do { \
+	int __n, __room = size > total ? size - total : 0; \
+	__n = snprintf(__room ? buf + total : NULL, __room, __VA_ARGS__); \
+	if (__n > 0) \
+		total += __n; \
+} while (0)
+
+/**
+ * \brief Render fmt with the arguments packed by dalfmt_pack.
+ *
+ * Like snprintf, return the length of the whole output even it is
+ * truncated, -1 if args is malformed.
+ */
+int dalfmt_render(char *buf, int size, const char *fmt, const char *args, int alen)
+{
+	int total = 0, ofs = 0, n;
+	long long w, pr;
+	unsigned long long v;
+	double d;
+	const char *p, *q;
+	char spec[64], *o;
+	dalspec_s sp;
+
+	if (size > 0)
+		buf[0] = '\0';
+
+	for (p = fmt; *p; p = q) {
+		q = strchr(p, '%');
+		if (!q) {
+			PUT("%s", p);
+			break;
+		}
+		if (q > p)
+			PUT("%.*s", (int)(q - p), p);
+
+		if (q[1] == '%') {
+			PUT("%%");
+			q += 2;
+			continue;
+		}
+
+		p = q;
+		q = spec_parse(p, &sp);
+		if (!q) {
+			/* Not packed either, leave it as is */
+			PUT("%s", p);
+			break;
+		}
+
+		/* Rebuild the specifier without '*' and 'L' */
+		o = spec;
+		*o++ = '%';
+		memcpy(o, sp.flag, sp.flag_len);
+		o += sp.flag_len;
+
+		if (sp.star_w) {
+			TAKE_U64(w);
+			o += sprintf(o, "%d", (int)w);
+		} else if (sp.width_len) {
+			memcpy(o, sp.width, sp.width_len);
+			o += sp.width_len;
+		}
+
+		if (sp.star_p) {
+			TAKE_U64(pr);
+			if ((int)pr >= 0)
+				o += sprintf(o, ".%d", (int)pr);
+		} else if (sp.prec >= 0)
+			o += sprintf(o, ".%d", sp.prec);
+
+		switch (sp.lmod) {
+		case LM_HH:
+			*o++ = 'h';
+			*o++ = 'h';
+			break;
+		case LM_H:
+			*o++ = 'h';
+			break;
+		case LM_L:
+			*o++ = 'l';
+			break;
+		case LM_LD:
+			/* %Ld is %lld, for double it's packed as double */
+			if (!strchr("diuoxX", sp.conv))
+				break;
+			/* fall through */
+		case LM_LL:
+		case LM_J:
+			*o++ = 'l';
+			*o++ = 'l';
+			break;
+		case LM_Z:
+		case LM_T:
+			*o++ = 'z';
+			break;
+		}
+
+		/* Bounded by spec_parse, not to trust it blindly */
+		if (o - spec > (int)sizeof(spec) - 2)
+			return -1;
+		*o++ = sp.conv == 'm' ? 's' : sp.conv;
+		*o = '\0';
+
+		switch (sp.conv) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			TAKE_U64(v);
+			switch (sp.lmod) {
+			case LM_L:
+				PUT(spec, (long)v);
+				break;
+			case LM_LL:
+			case LM_LD:
+			case LM_J:
+				PUT(spec, (long long)v);
+				break;
+			case LM_Z:
+			case LM_T:
+				PUT(spec, (size_t)v);
+				break;
+			default:
+				PUT(spec, (int)v);
+				break;
+			}
+			break;
+
+		case 'c':
+			TAKE_U64(v);
+			PUT(spec, (int)v);
+			break;
+
+		case 'p':
+			TAKE_U64(v);
+			PUT(spec, (void*)(uintptr_t)v);
+			break;
+
+		case 'm':
+			TAKE_U64(v);
+			PUT(spec, strerror((int)v));
+			break;
+
+		case 's':
+			TAKE_U64(v);
+			if (v == 0xffffffffULL) {
+				PUT(spec, (char*)NULL);
+				break;
+			}
+			n = DALOG_ALIGN8((int)v + 1);
+			if (ofs + n > alen)
+				return -1;
+			PUT(spec, args + ofs);
+			ofs += n;
+			break;
+
+		default:
+			TAKE_U64(d);
+			PUT(spec, d);
+			break;
+		}
+	}
+
+	return total;
+}
+
+/*-----------------------------------------------------------------------
+ * Swap
+ */
+static void swap8(char *p)
+{
+	char c;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		c = p[i];
+		p[i] = p[7 - i];
+		p[7 - i] = c;
+	}
+}
+
+#define SWAP_U64() do { \
+	if (ofs + 8 > alen) \
+		return -1; \
+	swap8(args + ofs); \
+	ofs += 8; \
+} while (0)
+
+/**
+ * \brief Swap byte order of the packed arguments in place.
+ *
+ * For reading the capture of a box in other byte order.
+ *
+ * \return 0 if OK, -1 if args is malformed.
+ */
+int dalfmt_swap(const char *fmt, char *args, int alen)
+{
+	unsigned long long v;
+	const char *p;
+	dalspec_s sp;
+	int ofs = 0;
+
+	for (p = fmt; (p = strchr(p, '%')); ) {
+		if (p[1] == '%') {
+			p += 2;
+			continue;
+		}
+
+		p = spec_parse(p, &sp);
+		if (!p)
+			break;
+
+		if (sp.star_w)
+			SWAP_U64();
+		if (sp.star_p)
+			SWAP_U64();
+
+		SWAP_U64();
+		if (sp.conv != 's')
+			continue;
+
+		memcpy(&v, args + ofs - 8, 8);
+		if (v == 0xffffffffULL)
+			continue;
+		ofs += DALOG_ALIGN8((int)v + 1);
+		if (ofs > alen)
+			return -1;
+	}
+
+	return 0;
+}
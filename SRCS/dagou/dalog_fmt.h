@@ -0,0 +1,227 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/**
+ * @file     dalog_fmt.h
+ * @brief    Text header and binary record codec of dalog.
+ *
+ * Shared by libdagou and the host side tools, so it must not depend on
+ * anything in dalog.c.
+ */
+
+#ifndef __BKM_DALOG_FMT_H__
+#define __BKM_DALOG_FMT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdarg.h>
+
+#define DALOG_ALIGN8(x) (((x) + 7) & ~7)
+
+/*-----------------------------------------------------------------------
+ * Record: used by the async ring and the binary stream
+ */
+#define DALREC_PAD      0       /* Skip it */
+#define DALREC_TEXT     1       /* Formatted line, '\0' included */
+#define DALREC_BIN      2       /* dalbin_s + packed arguments */
+#define DALREC_STR      3       /* u64 id + string, '\0' included */
+#define DALREC_HEAD     4       /* dalbin_head_s */
+
+/* Flag of kind, the payload starts with int pid and 4 bytes of 0 */
+#define DALREC_PID      0x8000
+
+typedef struct _dalrec_s dalrec_s;
+struct _dalrec_s {
+	unsigned int len;       /* payload length, header not included */
+	unsigned short kind;    /* DALREC_XXX */
+	unsigned short sid;     /* Binary stream only, low 16 bits of pid */
+};
+
+/*-----------------------------------------------------------------------
+ * Binary stream:
+ *
+ * DALBIN_MAGIC, then records start with DALREC_HEAD. Every string
+ * referred by DALREC_BIN is sent as DALREC_STR before its first use,
+ * the id is the address of the string in the logging process.
+ *
+ * Processes may append to the same file, records of them are told
+ * apart by the pid of DALREC_PID, and DALBIN_MAGIC may appear again at
+ * any record boundary when a new process starts. Without DALREC_PID, as
+ * written by the older ones, only dalrec_s::sid is there, two pids of
+ * the same low 16 bits can not be told apart.
+ */
+#define DALBIN_MAGIC    "DALOGBIN"
+#define DALBIN_ORDER    0x01020304
+#define DALBIN_VERSION  1
+
+typedef struct _dalbin_head_s dalbin_head_s;
+struct _dalbin_head_s {
+	unsigned int order;     /* DALBIN_ORDER in the writer's byte order */
+	unsigned int version;
+	int pid;
+	int gmtoff;             /* Seconds east of UTC, used to render S: */
+};
+
+typedef struct _dalbin_s dalbin_s;
+struct _dalbin_s {
+	unsigned long long rtm; /* CLOCK_MONOTONIC, in NS, fine if DALOG_NTM */
+	unsigned long long atm; /* CLOCK_REALTIME, in NS */
+
+	/* Address of strings, also the id of DALREC_STR */
+	unsigned long long fmt;
+	unsigned long long prog;
+	unsigned long long modu;
+	unsigned long long file;
+	unsigned long long func;
+
+	unsigned int mask;
+	int line;
+	unsigned int tid;
+	unsigned char type;
+	unsigned char resv[3];
+
+	/* Packed arguments followed, see dalfmt_pack */
+};
+
+/*-----------------------------------------------------------------------
+ * Flight recorder file, see dalog_flight.c:
+ *
+ * dalflt_head_s, the string area at str_ofs, then slots at slot_ofs.
+ * The string area is DALREC_STR records, as in the binary stream. A
+ * slot is owned by a thread, DALFLT_SLOT_HEAD bytes of dalflt_slot_s,
+ * then cells of DALFLT_CELL bytes used in circle, each one holds a
+ * DALREC_BIN record. The cells before dalflt_slot_s::head are complete,
+ * head is 32 bits and wraps, the cells never written have len 0.
+ *
+ * dalbin_s::atm is not set, it is abs0 + (rtm - rel0). Fields are in
+ * the byte order of the writer, the same as the binary stream.
+ */
+#define DALFLT_MAGIC            "DALOGFLT"
+#define DALFLT_CELL             256
+#define DALFLT_SLOT_HEAD        64
+
+typedef struct _dalflt_head_s dalflt_head_s;
+struct _dalflt_head_s {
+	char magic[8];          /* Set after all the rest ready */
+	unsigned int order;     /* DALBIN_ORDER in the writer's byte order */
+	unsigned int version;
+	int pid;
+	int gmtoff;
+
+	/* Clocks read at the same time, see dalbin_s::atm above */
+	unsigned long long rel0;
+	unsigned long long abs0;
+
+	unsigned int str_ofs;
+	unsigned int str_size;
+	unsigned int str_used;  /* Bytes of the string area filled */
+
+	unsigned int slot_ofs;
+	unsigned int slot_size; /* DALFLT_SLOT_HEAD included */
+	unsigned int slot_max;
+	unsigned int slot_cnt;  /* Slots taken */
+	unsigned int resv;
+};
+
+typedef struct _dalflt_slot_s dalflt_slot_s;
+struct _dalflt_slot_s {
+	unsigned int head;      /* Cells written, run freely */
+	unsigned int tid;
+};
+
+/*-----------------------------------------------------------------------
+ * Index of a text log, FILE.idx, written by daxia with DAXIA_INDEX:
+ *
+ * DALIDX_MAGIC, then records framed by dalrec_s, sid is not used. The
+ * lines are cut into blocks of DALIDX_BLOCK bytes at most, a block
+ * never crosses a DALIDX_BUCKET of S: time, unless the line has no S:.
+ *
+ * A name is given by DALREC_IDXNAME before the first block refers it,
+ * DALREC_IDXBLK carries the posting keys of the block, the ids of the
+ * prog and modu seen in it, types is ~0 if there are too many of them.
+ * The bytes of FILE not covered by any block are not indexed yet, or
+ * the types is ~0, the readers should scan them as is.
+ */
+#define DALIDX_MAGIC    "DALOGIDX"
+#define DALIDX_BLOCK    (64 * 1024)
+#define DALIDX_BUCKET   60
+
+#define DALREC_IDXNAME  5       /* dalidx_name_s + name, '\0' included */
+#define DALREC_IDXBLK   6       /* dalidx_blk_s + u32 ids */
+
+typedef struct _dalidx_name_s dalidx_name_s;
+struct _dalidx_name_s {
+	unsigned int id;
+	unsigned int tag;       /* 'P' or 'M' */
+};
+
+typedef struct _dalidx_blk_s dalidx_blk_s;
+struct _dalidx_blk_s {
+	unsigned long long ofs; /* In FILE */
+	unsigned int len;
+	unsigned int nid;
+
+	/* S: of the lines, local time taken as UTC, -1 if none */
+	long long tmin;
+	long long tmax;
+
+	unsigned long long types;       /* 1 << (type & 63) of the lines */
+};
+
+/*-----------------------------------------------------------------------
+ * Text header, "|I|s:...|u:...|S:...|j:...|x:...|P:...|M:...|F:...|H:...|L:...| "
+ */
+typedef struct _dalhead_s dalhead_s;
+struct _dalhead_s {
+	unsigned char type;
+	unsigned int mask;
+
+	int pid;
+	unsigned int tid;
+
+	unsigned long rtm;      /* s: in MS */
+	unsigned long long ntm; /* u: in NS */
+	const char *atm;        /* S: "%Y/%m/%d %H:%M:%S" */
+	unsigned int atm_ms;
+
+	const char *prog;
+	const char *modu;
+	const char *file;
+	const char *func;
+	int line;
+};
+
+int dalfmt_head(char *buf, const dalhead_s *hd);
+
+/* Fields picked from a text line, point into the line */
+typedef struct _daltext_s daltext_s;
+struct _daltext_s {
+	unsigned char type;     /* 0 if no header */
+	long long atm;          /* S: in seconds, local time taken as UTC, -1 if none */
+
+	const char *prog;
+	const char *modu;
+	int prog_len;
+	int modu_len;
+
+	const char *file;
+	const char *func;
+	int file_len;
+	int func_len;
+	int line;               /* L:, -1 if none */
+};
+
+int dalfmt_parse(const char *line, int len, daltext_s *tx);
+
+/*-----------------------------------------------------------------------
+ * Arguments: packed by walking the conversion specifiers of fmt
+ */
+int dalfmt_pack(char *buf, int size, const char *fmt, va_list ap);
+int dalfmt_render(char *buf, int size, const char *fmt, const char *args, int alen);
+int dalfmt_swap(const char *fmt, char *args, int alen);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __BKM_DALOG_FMT_H__ */
@@ -0,0 +1,141 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/**
+ * @file     dalog_inner.h
+ * @brief    Shared by dalog*.c only, NOT a public interface.
+ */
+
+#ifndef __BKM_DALOG_INNER_H__
+#define __BKM_DALOG_INNER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <time.h>
+
+#include <dalog.h>
+#include <dalog_fmt.h>
+#include <dalog_setup.h>
+
+#define DALOG_CACHELINE 64
+
+/*-----------------------------------------------------------------------
+ * Ring: lock free SPSC byte ring, the owner thread produce and the
+ * async thread consume. Record is dalrec_s, see dalog_fmt.h
+ */
+typedef struct _dalring_s dalring_s;
+struct _dalring_s {
+	unsigned int size;      /* power of 2 */
+	char *buf;
+
+	/* Only the producer write it */
+	unsigned long drops;
+
+	/* Index run freely, the producer and consumer each own one line */
+	unsigned int head __attribute__((aligned(DALOG_CACHELINE)));
+	unsigned int next;      /* head after dalring_reserve */
+	unsigned int tail __attribute__((aligned(DALOG_CACHELINE)));
+};
+
+void *dalring_reserve(dalring_s *ring, unsigned short kind, unsigned int len);
+void dalring_commit(dalring_s *ring);
+int dalring_empty(dalring_s *ring);
+
+/*-----------------------------------------------------------------------
+ * Thread: Each thread who touched dalog has one, linked to a global
+ * list which never shrink, the slot of exited thread is reused.
+ */
+#define DALTHR_FREE     0
+#define DALTHR_LIVE     1
+#define DALTHR_DEAD     2       /* exited, but ring not drained yet */
+
+/* Longer messages than this are formatted in a buffer of their own */
+#define DALTHR_ARENA_MIN        (8 * 1024)
+#define DALTHR_ARENA_MAX        (1024 * 1024)
+
+typedef struct _dalflt_thr_s dalflt_thr_s;
+
+typedef struct _dalthr_s dalthr_s;
+struct _dalthr_s {
+	dalthr_s *next;
+	int state;
+
+	dalring_s *ring;
+	dalflt_thr_s *flt;      /* Flight recorder, see dalog_flight.c */
+
+	/* Entered the sinks at, 0 if not inside, see dalog-logger */
+	unsigned int sink_epoch;
+	int sink_depth;
+
+	/* Formatting arena, grown by the long messages and kept, see dalog_vf */
+	char *arena;
+	int arena_size;
+	int arena_busy;         /* A sink log again, or a signal came */
+
+	/* Inside dalog_async_push, waited by dalog_async_stop */
+	int async_busy;
+
+	/* Only the owner write it, a line of its own, see dalog_stats.c */
+	dalstats_s stat;
+};
+
+dalthr_s *dalog_thr(void);
+dalthr_s *dalog_thr_list(void);
+
+/*-----------------------------------------------------------------------
+ * Async
+ */
+extern int __dalog_async_on;
+extern int __dalog_async_bin;
+extern int __dalog_blogger_cnt;
+
+/* Return 1 if async is stopped, the caller should do it the sync way */
+int dalog_async_push(unsigned short kind, const void *dat, unsigned int len);
+int dalog_async_push_bin(unsigned char type, unsigned int mask, char *prog, char *modu,
+		char *file, char *func, int ln, const char *fmt, va_list ap);
+
+/*-----------------------------------------------------------------------
+ * Flight recorder, see dalog_flight.c
+ */
+int dalog_flight_start(unsigned int slot_size);
+void dalog_flight_put(unsigned char type, char *prog, char *modu, char *file,
+		char *func, int ln, const char *fmt, int lit, va_list ap);
+
+/* Shared memory sink is fed by the async thread, see dalog_shm.c */
+void dalog_shm_atfork_child(void);
+
+/*-----------------------------------------------------------------------
+ * Control channel of a forked child, started by its first log, see dalog_ctl.c
+ */
+extern int __dalog_ctl_stale;
+void dalog_ctl_restart(void);
+
+/*-----------------------------------------------------------------------
+ * Counters, see dalog_stats.c
+ */
+int dalog_stats_level(unsigned char type);
+void dalog_stats_sink(dalthr_s *thr, unsigned long long t0);
+
+/*-----------------------------------------------------------------------
+ * Time: in NS, see dalog_time.c
+ */
+void dalog_time_init(void);
+unsigned long long dalog_time_rel(void);
+unsigned long long dalog_time_abs(void);
+unsigned long long dalog_time_ns(void);
+const char *dalog_time_date(time_t sec);
+
+/*-----------------------------------------------------------------------
+ * Call by the async thread
+ */
+void dalog_emit(char *content, int len);
+int dalog_has_nlogger(void);
+int dalog_pid(void);
+int dalog_noisy(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __BKM_DALOG_INNER_H__ */
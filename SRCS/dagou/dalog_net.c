@@ -0,0 +1,608 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/**
+ * @file     dalog_net.c
+ * @brief    Network sink of dalog, used by DALOG_TO_NETWORK.
+ *
+ * The logger only copy the line into a bounded byte ring, and never
+ * block: if the ring is full, the line is dropped and counted.
+ *
+ * The sender thread connect, flush the ring in batch when it is big
+ * enough or too old, the wrapped ring is sent by one sendmsg with two
+ * iovecs. When the server is not reachable, it retry with exponential
+ * backoff and the lines pile up in the ring.
+ *
+ * udp:// and unix:// send one datagram per batch, cut at the end of a
+ * line, with a dalnet_dgram_s in front. They never wait for the socket,
+ * a datagram the kernel can not take at once is dropped, the sequence
+ * number still goes on so the server sees the gap.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include <helper.h>
+#include <dalog.h>
+#include <dalog_inner.h>
+#include <dalog_setup.h>
+
+#define DFT_BACKLOG     (256 * 1024)
+#define DFT_BATCH       (16 * 1024)
+#define DFT_UDP_BATCH   1400            /* One ethernet frame */
+#define DFT_FLUSH_MS    20
+
+#define MIN_BACKOFF_MS  100
+#define MAX_BACKOFF_MS  (30 * 1000)
+#define CONNECT_MS      2000
+#define QUIT_MS         1000
+
+/* Ring: [tail, head) to be sent, index run freely */
+static char *__ring = NULL;
+static unsigned int __ring_size = DFT_BACKLOG;
+static unsigned int __head = 0, __tail = 0;
+
+static unsigned int __batch = DFT_BATCH;
+static int __flush_ms = DFT_FLUSH_MS;
+
+static pthread_mutex_t __mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __cond = PTHREAD_COND_INITIALIZER;
+static pthread_t __net_thread;
+static int __running = 0, __quit = 0;
+
+static int __proto = DALNET_TCP;
+static char __host[128];
+static unsigned short __port;
+static int __sock = -1;
+
+/* Datagram: head of next one */
+static unsigned int __pid;
+static unsigned int __seq = 0;
+
+/* Last byte sent is not '\n', skip the rest of the line after reconnect */
+static int __midline = 0;
+
+static dalnet_stat_s __stat;
+static unsigned long __drops_reported = 0;
+
+/*-----------------------------------------------------------------------
+ * Ring
+ */
+static unsigned int ring_used(void)
+{
+	return __head - __tail;
+}
+
+/* Must hold __mutex */
+static int ring_put(const char *dat, unsigned int len)
+{
+	unsigned int ofs, n;
+
+	if (__ring_size - ring_used() < len)
+		return -1;
+
+	ofs = __head & (__ring_size - 1);
+	n = __ring_size - ofs;
+	if (n > len)
+		n = len;
+
+	memcpy(__ring + ofs, dat, n);
+	memcpy(__ring, dat + n, len - n);
+	__head += len;
+	return 0;
+}
+
+/* Skip the rest of a line already partly sent */
+static void ring_skip_line(void)
+{
+	char c;
+
+	while (__tail != __head) {
+		c = __ring[__tail & (__ring_size - 1)];
+		__tail++;
+		if (c == '\n')
+			break;
+	}
+}
+
+/*-----------------------------------------------------------------------
+ * Connection
+ */
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* __host is the path, "@name" is in the abstract namespace */
+static int net_connect_unix(void)
+{
+	struct sockaddr_un sun;
+	socklen_t slen;
+	int s;
+
+	/* Too long a path is not cut, it could name another socket */
+	if (strlen(__host) >= sizeof(sun.sun_path))
+		return -1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%.*s", (int)sizeof(sun.sun_path) - 1, __host);
+	slen = offsetof(struct sockaddr_un, sun_path) + strlen(sun.sun_path);
+	if (sun.sun_path[0] == '@')
+		sun.sun_path[0] = '\0';
+
+	s = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s < 0)
+		return -1;
+
+	/* Fail if the server is not there, retry later as tcp */
+	if (connect(s, (struct sockaddr*)&sun, slen)) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+static int net_connect(void)
+{
+	struct addrinfo hints, *res, *ai;
+	struct pollfd pfd;
+	char port[16];
+	int s = -1, err;
+	socklen_t elen;
+
+	if (__proto == DALNET_UNIX)
+		return net_connect_unix();
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = __proto == DALNET_UDP ? SOCK_DGRAM : SOCK_STREAM;
+	sprintf(port, "%u", __port);
+
+	/* Only the sender thread get blocked here */
+	if (getaddrinfo(__host, port, &hints, &res))
+		return -1;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				ai->ai_protocol);
+		if (s < 0)
+			continue;
+
+		if (!connect(s, ai->ai_addr, ai->ai_addrlen))
+			break;
+
+		if (errno == EINPROGRESS) {
+			pfd.fd = s;
+			pfd.events = POLLOUT;
+			err = -1;
+			elen = sizeof(err);
+			if (poll(&pfd, 1, CONNECT_MS) == 1 &&
+					!getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &elen) && !err)
+				break;
+		}
+
+		close(s);
+		s = -1;
+	}
+
+	freeaddrinfo(res);
+	return s;
+}
+
+static void net_close(void)
+{
+	if (__sock != -1)
+		close(__sock);
+	__sock = -1;
+}
+
+/*-----------------------------------------------------------------------
+ * Sender
+ */
+
+/* Send what in the ring, return -1 if connection broken */
+static int net_flush(void)
+{
+	unsigned int head, tail, ofs, len;
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct pollfd pfd;
+	ssize_t ret;
+
+	for (;;) {
+		pthread_mutex_lock(&__mutex);
+		head = __head;
+		tail = __tail;
+		pthread_mutex_unlock(&__mutex);
+
+		len = head - tail;
+		if (!len)
+			return 0;
+
+		/* The wrapped ring is two iovecs */
+		ofs = tail & (__ring_size - 1);
+		iov[0].iov_base = __ring + ofs;
+		iov[0].iov_len = len;
+		iov[1].iov_base = __ring;
+		iov[1].iov_len = 0;
+		if (ofs + len > __ring_size) {
+			iov[0].iov_len = __ring_size - ofs;
+			iov[1].iov_len = len - iov[0].iov_len;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+
+		ret = sendmsg(__sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+
+			/* Kernel buffer full, the lines pile up in the ring */
+			pfd.fd = __sock;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, 100) < 0 && errno != EINTR)
+				return -1;
+			if (pfd.revents & (POLLERR | POLLHUP))
+				return -1;
+			if (__quit && !(pfd.revents & POLLOUT))
+				return 0;
+			continue;
+		}
+
+		pthread_mutex_lock(&__mutex);
+		__tail += ret;
+		__stat.bytes += ret;
+		__stat.batches++;
+		__midline = __ring[(__tail - 1) & (__ring_size - 1)] != '\n';
+		pthread_mutex_unlock(&__mutex);
+	}
+}
+
+/* Lose [tail, tail + len) */
+static void dgram_drop(unsigned int len)
+{
+	unsigned int i, lines = 0;
+
+	pthread_mutex_lock(&__mutex);
+	for (i = 0; i < len; i++)
+		if (__ring[(__tail + i) & (__ring_size - 1)] == '\n')
+			lines++;
+	__tail += len;
+	__stat.drops += lines ? lines : 1;
+	pthread_mutex_unlock(&__mutex);
+}
+
+/* Send the ring as datagrams, return -1 if the socket is broken */
+static int net_flush_dgram(void)
+{
+	unsigned int head, tail, ofs, len, i;
+	dalnet_dgram_s dg;
+	int err;
+	struct iovec iov[3];
+	struct msghdr msg;
+	struct pollfd pfd;
+	ssize_t ret;
+
+	for (;;) {
+		pthread_mutex_lock(&__mutex);
+		head = __head;
+		tail = __tail;
+		pthread_mutex_unlock(&__mutex);
+
+		len = head - tail;
+		if (!len)
+			return 0;
+
+		/* Cut after the last '\n', a line longer than it is split */
+		if (len > __batch) {
+			for (i = __batch; i > 0; i--)
+				if (__ring[(tail + i - 1) & (__ring_size - 1)] == '\n')
+					break;
+			len = i ? i : __batch;
+		}
+
+		dg.magic = htonl(DALNET_MAGIC);
+		dg.pid = htonl(__pid);
+		dg.seq = htonl(__seq);
+		iov[0].iov_base = &dg;
+		iov[0].iov_len = sizeof(dg);
+
+		ofs = tail & (__ring_size - 1);
+		iov[1].iov_base = __ring + ofs;
+		iov[1].iov_len = len;
+		iov[2].iov_base = __ring;
+		iov[2].iov_len = 0;
+		if (ofs + len > __ring_size) {
+			iov[1].iov_len = __ring_size - ofs;
+			iov[2].iov_len = len - iov[1].iov_len;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov[2].iov_len ? 3 : 2;
+
+		ret = sendmsg(__sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			err = errno;
+			if (err == EINTR)
+				continue;
+
+			/* Busy: give it one flush time, the lines pile up in the ring */
+			if (err == EAGAIN || err == EWOULDBLOCK) {
+				pfd.fd = __sock;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, __quit ? 0 : __flush_ms) == 1 && (pfd.revents & POLLOUT))
+					continue;
+			}
+
+			/* Still busy, or nobody listen on the udp port: lose it */
+			if (err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS ||
+					(__proto == DALNET_UDP && err == ECONNREFUSED)) {
+				__seq++;
+				dgram_drop(len);
+				continue;
+			}
+			return -1;
+		}
+
+		__seq++;
+		pthread_mutex_lock(&__mutex);
+		__tail += len;
+		__stat.bytes += len;
+		__stat.batches++;
+		pthread_mutex_unlock(&__mutex);
+	}
+}
+
+static void report_drops(void)
+{
+	char buf[128];
+	int len;
+
+	if (dalog_likely(__stat.drops == __drops_reported))
+		return;
+
+	len = sprintf(buf, "|!| dalog: %lu messages dropped, network backlog full\n",
+			__stat.drops - __drops_reported);
+	if (!ring_put(buf, len))
+		__drops_reported = __stat.drops;
+}
+
+static void *thread_net(void *user_data)
+{
+	long long backoff = MIN_BACKOFF_MS, retry_at = 0, first_at = 0, quit_at = 0;
+	struct timespec ts;
+	unsigned int used;
+	long long now;
+
+	pthread_mutex_lock(&__mutex);
+	for (;;) {
+		now = now_ms();
+		used = ring_used();
+
+		/* Give the rest QUIT_MS to go when quit */
+		if (__quit) {
+			if (!quit_at)
+				quit_at = now + QUIT_MS;
+			if (__sock == -1 || !used || now >= quit_at)
+				break;
+		}
+
+		if (__sock == -1 && now >= retry_at) {
+			pthread_mutex_unlock(&__mutex);
+			__sock = net_connect();
+			pthread_mutex_lock(&__mutex);
+
+			if (__sock == -1) {
+				retry_at = now_ms() + backoff;
+				backoff = backoff * 2 > MAX_BACKOFF_MS ? MAX_BACKOFF_MS : backoff * 2;
+			} else {
+				backoff = MIN_BACKOFF_MS;
+				__stat.connects++;
+				if (__midline) {
+					ring_skip_line();
+					__midline = 0;
+				}
+			}
+			continue;
+		}
+
+		if (used && !first_at)
+			first_at = now;
+
+		/* Flush when big enough, old enough, or quit */
+		if (__sock != -1 && used && (__quit || used >= __batch || now - first_at >= __flush_ms)) {
+			report_drops();
+			pthread_mutex_unlock(&__mutex);
+			if (__proto == DALNET_TCP ? net_flush() : net_flush_dgram()) {
+				net_close();
+				retry_at = 0;
+			}
+			pthread_mutex_lock(&__mutex);
+			first_at = 0;
+			continue;
+		}
+
+		/* Wait for a batch, or the flush time, or the retry time */
+		now = __sock == -1 ? retry_at : used ? first_at + __flush_ms : now + 1000;
+		ts.tv_sec = now / 1000;
+		ts.tv_nsec = (now % 1000) * 1000000;
+		pthread_cond_timedwait(&__cond, &__mutex, &ts);
+	}
+	pthread_mutex_unlock(&__mutex);
+
+	net_close();
+	return NULL;
+}
+
+static int net_thread_start(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&__cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	__quit = 0;
+	if (pthread_create(&__net_thread, NULL, thread_net, NULL)) {
+		if (dalog_noisy())
+			fprintf(stderr, "dalog_net: pthread_create error: %s\n", strerror(errno));
+		return -1;
+	}
+	__running = 1;
+	return 0;
+}
+
+/* Child: the lines and connection belong to the parent */
+static void net_atfork_child(void)
+{
+	pthread_mutex_init(&__mutex, NULL);
+	__head = __tail = 0;
+	__midline = 0;
+	__drops_reported = 0;
+	__pid = (unsigned int)getpid();
+	__seq = 0;
+	memset(&__stat, 0, sizeof(__stat));
+	net_close();
+
+	if (__running)
+		net_thread_start();
+}
+
+/*-----------------------------------------------------------------------
+ * API
+ */
+static unsigned int env_kb(const char *name, unsigned int dft)
+{
+	char *env = getenv(name);
+
+	return env && atoi(env) > 0 ? (unsigned int)atoi(env) * 1024 : dft;
+}
+
+/**
+ * \brief Start the sink, the connection is made by the sender thread.
+ *
+ * proto is DALNET_XXX, host is the path for DALNET_UNIX.
+ * For datagram, the batch is the biggest payload of one datagram.
+ *
+ * env: DALOG_NET_BACKLOG=<KB>, DALOG_NET_BATCH=<KB>, DALOG_NET_FLUSH=<MS>
+ */
+int dalog_net_start(int proto, const char *host, unsigned short port)
+{
+	static int once = 0;
+	unsigned int size;
+	char *env;
+
+	if (__running)
+		return 0;
+
+	__proto = proto;
+	strncpy(__host, host, sizeof(__host) - 1);
+	__port = port;
+	__pid = (unsigned int)getpid();
+
+	size = env_kb("DALOG_NET_BACKLOG", DFT_BACKLOG);
+	for (__ring_size = 4096; __ring_size < size; __ring_size <<= 1)
+		;
+	__batch = env_kb("DALOG_NET_BATCH", proto == DALNET_UDP ? DFT_UDP_BATCH : DFT_BATCH);
+	if (proto != DALNET_TCP && __batch > DALNET_DGRAM_MAX - sizeof(dalnet_dgram_s))
+		__batch = DALNET_DGRAM_MAX - sizeof(dalnet_dgram_s);
+	if (__batch > __ring_size / 2)
+		__batch = __ring_size / 2;
+	env = getenv("DALOG_NET_FLUSH");
+	if (env && atoi(env) > 0)
+		__flush_ms = atoi(env);
+
+	__ring = nmem_alloc(__ring_size, char);
+	if (!__ring)
+		return -1;
+
+	if (net_thread_start()) {
+		nmem_free_z(__ring);
+		return -1;
+	}
+
+	if (!once) {
+		once = 1;
+		pthread_atfork(NULL, NULL, net_atfork_child);
+		atexit(dalog_net_stop);
+	}
+	return 0;
+}
+
+/* Flush what left if connected, then stop */
+void dalog_net_stop(void)
+{
+	if (!__running)
+		return;
+
+	pthread_mutex_lock(&__mutex);
+	__quit = 1;
+	pthread_cond_signal(&__cond);
+	pthread_mutex_unlock(&__mutex);
+
+	pthread_join(__net_thread, NULL);
+	__running = 0;
+
+	if (dalog_noisy())
+		fprintf(stderr, "dalog_net: bytes %lu, batches %lu, lines %lu, drops %lu, connects %lu\n",
+				__stat.bytes, __stat.batches, __stat.lines, __stat.drops, __stat.connects);
+}
+
+void dalog_net_stat(dalnet_stat_s *stat)
+{
+	pthread_mutex_lock(&__mutex);
+	*stat = __stat;
+	pthread_mutex_unlock(&__mutex);
+}
+
+/* DAL_NLOGGER */
+void dalog_net_logger(char *content, int len)
+{
+	int nl = len > 0 && content[len - 1] != '\n';
+	unsigned int used;
+
+	if (dalog_unlikely(!__running || len <= 0))
+		return;
+
+	pthread_mutex_lock(&__mutex);
+	if (__ring_size - ring_used() < (unsigned int)(len + nl)) {
+		__stat.drops++;
+		pthread_mutex_unlock(&__mutex);
+		return;
+	}
+
+	ring_put(content, len);
+	if (nl)
+		ring_put("\n", 1);
+	__stat.lines++;
+
+	/* Only wake it up when a batch is ready */
+	used = ring_used();
+	if (used >= __batch && used - len - nl < __batch)
+		pthread_cond_signal(&__cond);
+	pthread_mutex_unlock(&__mutex);
+}
@@ -2,11 +2,9 @@
 
 #include <helper.h>
 
-#include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <netdb.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -14,7 +12,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
-#include <sys/socket.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
@@ -27,10 +24,9 @@
 #include <dalog.h>
 #include <dalog_setup.h>
 
-static int __serv_sock = -1;
-
 static char __serv_addr[128];
 static unsigned short __serv_port;
+static int __serv_proto;
 
 static pid_t __pid;
 static char *__prg;
@@ -82,82 +78,53 @@ static void load_cfg_file(const char *path)
 	fclose(fp);
 }
 
-static int dalog_serv_from_kernel_cmdline(const char *url, char *serv, unsigned short *port)
+/*
+ * [tcp://]host:port, udp://host:port or unix://path, "[::1]:port" for
+ * IPv6. Bare host:port is tcp, as before.
+ */
+static int dalog_serv_from_kernel_cmdline(const char *url, int *proto, char *serv, unsigned short *port)
 {
-	int i;
+	const char *host, *colon;
+	int len;
+
+	if (!url)
+		return -1;
 
-	if (url && strchr(url, ':')) {
-		for (i = 0; url[i] != ':'; i++)
-			serv[i] = url[i];
-		serv[i] = '\0';
-		*port = atoi((const char*)&url[i + 1]);
+	*proto = DALNET_TCP;
+	*port = 0;
+	if (!strncmp(url, "tcp://", 6))
+		url += 6;
+	else if (!strncmp(url, "udp://", 6)) {
+		*proto = DALNET_UDP;
+		url += 6;
+	} else if (!strncmp(url, "unix://", 7)) {
+		*proto = DALNET_UNIX;
+		url += 7;
+		if (!*url || strlen(url) >= 108)
+			return -1;
+		strcpy(serv, url);
 		return 0;
 	}
-	return -1;
-}
-
-static void config_socket(int s)
-{
-	int yes = 1;
-	struct linger lin;
-
-	lin.l_onoff = 0;
-	lin.l_linger = 0;
-	setsockopt(s, SOL_SOCKET, SO_LINGER, (const char *) &lin, sizeof(lin));
-	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-}
-
-static int connect_dalog_serv(const char *server, unsigned short port, int *retfd)
-{
-	int sockfd;
-	struct hostent *he;
-	struct sockaddr_in their_addr;
 
-	printlog("connect_dalog_serv: server:<%s>, port:%d\n", server, port);
-
-	if ((he = gethostbyname(server)) == NULL) {
-		printlog("connect_dalog_serv: gethostbyname error: %s.\n", strerror(errno));
-		return -1;
-	}
-	if ((sockfd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
-		printlog("connect_dalog_serv: socket error: %s.\n", strerror(errno));
+	colon = strrchr(url, ':');
+	if (!colon || !colon[1])
 		return -1;
-	}
-
-	memset((char*)&their_addr, 0, sizeof(their_addr));
-	their_addr.sin_family = he->h_addrtype;
-	memcpy((char*)&their_addr.sin_addr, he->h_addr, he->h_length);
-	their_addr.sin_port = htons(port);
 
-	if (connect(sockfd, (struct sockaddr *)&their_addr,
-				sizeof their_addr) == -1) {
-		printlog("connect_dalog_serv: connect error: %s.\n", strerror(errno));
-		close(sockfd);
-		return -1;
+	host = url;
+	len = colon - url;
+	if (len >= 2 && host[0] == '[' && host[len - 1] == ']') {
+		host++;
+		len -= 2;
 	}
+	if (len <= 0 || len >= 128)
+		return -1;
 
-	config_socket(sockfd);
-
-	*retfd = sockfd;
-	printlog("connect_dalog_serv: retfd: %d\n", sockfd);
+	memcpy(serv, host, len);
+	serv[len] = '\0';
+	*port = (unsigned short)atoi(colon + 1);
 	return 0;
 }
 
-static void logger_network(char *content, int len)
-{
-	if (__serv_sock == -1)
-		connect_dalog_serv(__serv_addr, __serv_port, &__serv_sock);
-	if (__serv_sock == -1)
-		return;
-
-	if (len != send(__serv_sock, content, len, 0)) {
-		printlog("logger_network: send error: %s, %d\n", strerror(errno), __serv_sock);
-		if (__serv_sock != -1)
-			close(__serv_sock);
-		__serv_sock = -1;
-	} else if (content[len - 1] != '\n')
-		send(__serv_sock, "\n", 1, 0);
-}
 static void logger_file(char *content, int len)
 {
 	static FILE *fp = NULL;
@@ -177,6 +144,20 @@ static void logger_syslog(char *content, int len)
 {
 	syslog(LOG_INFO, "%s", content);
 }
+static int logger_binary(const void *dat, int len)
+{
+	static FILE *fp = NULL;
+
+	if (!fp)
+		fp = fopen(getenv("DALOG_TO_BINARY"), "ab");
+	if (!fp)
+		return -1;
+
+	if (len != fwrite(dat, 1, len, fp))
+		return -1;
+	fflush(fp);
+	return 0;
+}
 
 static char *get_prog_name()
 {
@@ -194,6 +175,17 @@ static char *get_prog_name()
 	return strdup(basename(buf));
 }
 
+/* DALOG_TO_XXX_MASK=<level letters>, only these go to the sink */
+static void setup_logger(DAL_NLOGGER logger, const char *mask_env)
+{
+	char *mask = getenv(mask_env);
+
+	if (mask)
+		dalog_add_logger_mask(logger, dalog_mask_from_str(mask));
+	else
+		dalog_add_logger(logger);
+}
+
 void dalog_setup()
 {
 	static int inited = 0;
@@ -217,20 +209,36 @@ void dalog_setup()
 	env = getenv("DALOG_TO_LOCAL");
 	if (env) {
 		printlog("daLog: DALOG_TO_LOCAL opened <%s>\n", env);
-		dalog_add_logger(logger_file);
+		setup_logger(logger_file, "DALOG_TO_LOCAL_MASK");
 	}
 	env = getenv("DALOG_TO_SYSLOG");
 	if (env) {
 		printlog("daLog: DALOG_TO_SYSLOG opened <%s>\n", env);
-		dalog_add_logger(logger_syslog);
+		setup_logger(logger_syslog, "DALOG_TO_SYSLOG_MASK");
+	}
+	env = getenv("DALOG_TO_BINARY");
+	if (env) {
+		printlog("daLog: DALOG_TO_BINARY opened <%s>\n", env);
+		dalog_add_blogger(logger_binary);
+		dalog_async_binary(1);
+	}
+	env = getenv("DALOG_TO_SHM");
+	if (env) {
+		printlog("daLog: DALOG_TO_SHM opened <%s>\n", env);
+
+		/* DALOG_TO_SHM=<ring size in KB>, 0 for default */
+		if (!dalog_shm_start((unsigned int)atoi(env) * 1024)) {
+			dalog_add_blogger(dalog_shm_logger);
+			dalog_async_binary(1);
+		}
 	}
 	env = getenv("DALOG_TO_NETWORK");
 	if (env) {
 		printlog("daLog: DALOG_TO_NETWORK opened <%s>\n", env);
-		dalog_add_logger(logger_network);
 
-		if (!dalog_serv_from_kernel_cmdline(env, __serv_addr, &__serv_port))
-			connect_dalog_serv(__serv_addr, __serv_port, &__serv_sock);
+		if (!dalog_serv_from_kernel_cmdline(env, &__serv_proto, __serv_addr, &__serv_port) &&
+				!dalog_net_start(__serv_proto, __serv_addr, __serv_port))
+			setup_logger(dalog_net_logger, "DALOG_TO_NETWORK_MASK");
 	}
 }
 
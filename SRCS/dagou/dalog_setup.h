@@ -13,6 +13,142 @@ extern "C" {
 
 void dalog_setup(void);
 
+/*-----------------------------------------------------------------------
+ * Network sink, see dalog_net.c
+ */
+typedef struct _dalnet_stat_s dalnet_stat_s;
+struct _dalnet_stat_s {
+	unsigned long bytes;
+	unsigned long batches;
+	unsigned long lines;
+	unsigned long drops;
+	unsigned long connects;
+};
+
+/* Transport of DALOG_TO_NETWORK, tcp://, udp:// or unix:// */
+#define DALNET_TCP      0
+#define DALNET_UDP      1
+#define DALNET_UNIX     2
+
+/*
+ * Each datagram of udp:// and unix:// is a dalnet_dgram_s followed by
+ * the lines, fields are in network order. seq is per sender process and
+ * increased for every datagram, include the dropped ones, so the server
+ * can tell how many are lost.
+ */
+#define DALNET_MAGIC    0x44414c44      /* "DALD" */
+#define DALNET_DGRAM_MAX (60 * 1024)
+
+typedef struct _dalnet_dgram_s dalnet_dgram_s;
+struct _dalnet_dgram_s {
+	unsigned int magic;
+	unsigned int pid;
+	unsigned int seq;
+};
+
+int dalog_net_start(int proto, const char *host, unsigned short port);
+void dalog_net_stop(void);
+void dalog_net_stat(dalnet_stat_s *stat);
+void dalog_net_logger(char *content, int len);
+
+/*-----------------------------------------------------------------------
+ * Shared memory sink, see dalog_shm.c
+ *
+ * /dev/shm/dalog.<pid> is a dalshm_s, then a byte ring of the binary
+ * stream (dalog_fmt.h) at DALSHM_DATA. The process write head and the
+ * collector write tail, both run freely. A record is never split by
+ * head, but may wrap around the end of the ring.
+ *
+ * All shared words are 32 bits, a 64 bits atomic of a 32 bits CPU may
+ * be a lock of libatomic, which is not shared by the processes. So the
+ * ring is DALSHM_MAX at most, head - tail is never ambiguous.
+ */
+#define DALSHM_MAGIC    0x324d5344      /* "DSM2" */
+#define DALSHM_NAME     "/dalog.%d"
+#define DALSHM_DATA     256
+#define DALSHM_MAX      (1U << 31)
+
+typedef struct _dalshm_s dalshm_s;
+struct _dalshm_s {
+	unsigned int magic;     /* Set after all the rest ready */
+	unsigned int size;      /* Of the ring, power of 2 */
+	int pid;
+
+	/* Records the ring had no room for, only the process write it */
+	unsigned int drops;
+
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int tail __attribute__((aligned(64)));
+};
+
+int dalog_shm_start(unsigned int size);
+int dalog_shm_logger(const void *dat, int len);
+
+/*-----------------------------------------------------------------------
+ * Counters of dalog itself, see dalog_stats.c
+ *
+ * Each thread counts its own, always. A dalstats_s is the sum of them,
+ * DALOG_STATS=1 keep it in the page DALOG_STATS_PATH, renewed every
+ * second by the ctl thread, and no page if the ctl thread is not there.
+ * seq is odd while being written, read again if it is odd or changed.
+ *
+ * msgs is indexed by the level "facewnid", the last for the others.
+ * sink_hist[i] counts the sink calls less than 2^(i + 7) NS, the last
+ * one all the longer. The net_xxx are of the process, not the threads.
+ */
+#define DALOG_STATS_PATH        "/tmp/dalog.%d.stats"
+#define DALOG_STATS_MSGS        9
+#define DALOG_STATS_HIST        16
+
+typedef struct _dalstats_s dalstats_s;
+struct _dalstats_s {
+	unsigned int seq;
+	int pid;
+	unsigned long long stamp;       /* dalog_time_abs of the update */
+
+	unsigned long long msgs[DALOG_STATS_MSGS];
+	unsigned long long bytes;       /* Formatted, header included */
+	unsigned long long heap;        /* malloc by the formatting */
+
+	unsigned long long drops_ring;  /* No room in the async ring */
+	unsigned long long drops_rate;  /* Rate limited by the rule */
+	unsigned long long evals;       /* Mask of a site calculated */
+
+	unsigned long long sink_calls;
+	unsigned long long sink_ns;
+	unsigned long long sink_hist[DALOG_STATS_HIST];
+
+	/* The network sink, see dalnet_stat_s */
+	unsigned long long net_bytes;
+	unsigned long long net_batches;
+	unsigned long long net_lines;
+	unsigned long long net_drops;
+	unsigned long long net_connects;
+} __attribute__((aligned(64)));
+
+void dalog_stats_sum(dalstats_s *st);
+int dalog_stats_text(char *buf, int size);
+int dalog_stats_start(void);
+void dalog_stats_stop(void);
+void dalog_stats_update(void);
+int dalog_stats_on(void);
+
+/*-----------------------------------------------------------------------
+ * Control channel, see dalog_ctl.c
+ *
+ * Each process bind DALOG_CTL_NAME of its pid in the abstract namespace
+ * of unix datagram, "add <rule>", "del <idx>", "clr", "list", "sites"
+ * and "stats" are taken, one per line. A datagram start with the line
+ * "set" replace all the rules by the lines after it. The reply of
+ * "list" is one datagram for each line, the first is "# <pid>", the
+ * last is empty. "sites" and "stats" are replied the same, but many
+ * lines a datagram.
+ */
+#define DALOG_CTL_NAME  "dalog.ctl.%d"
+#define DALOG_CTL_MAX   (64 * 1024)
+
+int dalog_ctl_start(const char *rtcfg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,153 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/**
+ * @file     dalog_shm.c
+ * @brief    Shared memory sink of dalog, used by DALOG_TO_SHM.
+ *
+ * It is a binary logger, fed by the async thread, so the process only
+ * pack the arguments and copy the record, no format, no syscall. The
+ * collector (daxia with DAXIA_SHM) drain and render the rings of all
+ * the processes, and remove the ring after its process is gone, so the
+ * lines not drained yet survive the crash of the process.
+ *
+ * The ring is a single producer: only the async thread call the logger,
+ * with the mutex of the binary loggers held.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <helper.h>
+#include <dalog.h>
+#include <dalog_inner.h>
+#include <dalog_setup.h>
+
+#define DFT_SHM_SIZE    (1024 * 1024)
+#define MIN_SHM_SIZE    (64 * 1024)
+
+static unsigned int __shm_size = DFT_SHM_SIZE;
+static dalshm_s *__shm = NULL;
+static char *__shm_data = NULL;
+static size_t __shm_len = 0;
+
+/*-----------------------------------------------------------------------
+ * Ring
+ */
+static int shm_map(void)
+{
+	char name[32];
+	dalshm_s *shm;
+	size_t len;
+	int fd;
+
+	sprintf(name, DALSHM_NAME, (int)getpid());
+	len = DALSHM_DATA + __shm_size;
+
+	/* Left by a dead process of the same pid, the collector missed it */
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		shm_unlink(name);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	}
+	if (fd < 0) {
+		if (dalog_noisy())
+			fprintf(stderr, "dalog_shm: shm_open %s error: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, len)) {
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+
+	shm = (dalshm_s*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		shm_unlink(name);
+		return -1;
+	}
+
+	shm->size = __shm_size;
+	shm->pid = (int)getpid();
+	shm->drops = 0;
+	shm->head = shm->tail = 0;
+	natm_store(&shm->magic, DALSHM_MAGIC);
+
+	__shm = shm;
+	__shm_data = (char*)shm + DALSHM_DATA;
+	__shm_len = len;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------
+ * API
+ */
+
+/**
+ * \brief Create the ring of this process, size in bytes, 0 for default.
+ *
+ * Add dalog_shm_logger by dalog_add_blogger to feed it.
+ */
+int dalog_shm_start(unsigned int size)
+{
+	if (__shm)
+		return 0;
+
+	if (!size)
+		size = DFT_SHM_SIZE;
+	for (__shm_size = MIN_SHM_SIZE; __shm_size < size && __shm_size < DALSHM_MAX; __shm_size <<= 1)
+		;
+
+	return shm_map();
+}
+
+/* DAL_BLOGGER */
+int dalog_shm_logger(const void *dat, int len)
+{
+	unsigned int head, tail, ofs, n;
+
+	if (dalog_unlikely(!__shm))
+		return -1;
+
+	head = __shm->head;
+	tail = natm_load(&__shm->tail);
+	if (__shm_size - (head - tail) < (unsigned int)len) {
+		natm_store(&__shm->drops, __shm->drops + 1);
+		return -1;
+	}
+
+	ofs = head & (__shm_size - 1);
+	n = __shm_size - ofs;
+	if (n > (unsigned int)len)
+		n = len;
+
+	memcpy(__shm_data + ofs, dat, n);
+	memcpy(__shm_data, (const char*)dat + n, len - n);
+	natm_store(&__shm->head, head + len);
+	return 0;
+}
+
+/*
+ * Child: the mapping is shared with the parent, the child has a ring of
+ * its own. Called by the async module before its thread restart, the
+ * binary loggers restart the stream with DALBIN_MAGIC.
+ */
+void dalog_shm_atfork_child(void)
+{
+	if (!__shm)
+		return;
+
+	munmap(__shm, __shm_len);
+	__shm = NULL;
+	if (shm_map() && dalog_noisy())
+		fprintf(stderr, "dalog_shm: no ring for child %d\n", (int)getpid());
+}
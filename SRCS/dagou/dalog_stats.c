@@ -0,0 +1,259 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/**
+ * @file     dalog_stats.c
+ * @brief    Counters of dalog itself, what the logging costs the process.
+ *
+ * Each thread counts in the dalstats_s of its dalthr_s, by plain
+ * increase, no atomic, no shared line. Only the sum is read, by the
+ * "stats" of the ctl socket (dr --stats), or from the page
+ * DALOG_STATS_PATH if DALOG_STATS=1, renewed by the ctl thread every
+ * second. Without the ctl thread the page is removed, not left as is.
+ *
+ * The sum is not a snapshot, a counter read may be a little behind its
+ * thread. The counters are read plainly, on a 32 bits CPU one may be
+ * torn once when its low word carries.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <helper.h>
+#include <dalog.h>
+#include <dalog_inner.h>
+#include <dalog_setup.h>
+
+static dalstats_s *__stats = NULL;
+static char __stats_path[64];
+
+static const char *__stats_levels = "facewnid";
+
+/* No natm_load, a 64 bits atomic of a 32 bits CPU is a call of libatomic */
+#define STAT_GET(v)     (*(volatile unsigned long long*)&(v))
+
+/*-----------------------------------------------------------------------
+ * Count
+ */
+int dalog_stats_level(unsigned char type)
+{
+	switch (type) {
+	case 'F': return 0;
+	case 'A': return 1;
+	case 'C': return 2;
+	case 'E': return 3;
+	case 'W': return 4;
+	case 'N': return 5;
+	case 'I': return 6;
+	case 'D': return 7;
+	default: return DALOG_STATS_MSGS - 1;
+	}
+}
+
+/* A sink call started at t0 is returned */
+void dalog_stats_sink(dalthr_s *thr, unsigned long long t0)
+{
+	unsigned long long ns = dalog_time_ns() - t0, v;
+	int i;
+
+	thr->stat.sink_calls++;
+	thr->stat.sink_ns += ns;
+
+	for (i = 0, v = ns >> 7; v && i < DALOG_STATS_HIST - 1; i++)
+		v >>= 1;
+	thr->stat.sink_hist[i]++;
+}
+
+/*-----------------------------------------------------------------------
+ * Page
+ */
+static int stats_map(void)
+{
+	dalstats_s *st;
+	int fd;
+
+	snprintf(__stats_path, sizeof(__stats_path), DALOG_STATS_PATH, (int)getpid());
+
+	fd = open(__stats_path, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		if (dalog_noisy())
+			fprintf(stderr, "dalog_stats: open %s error: %s\n", __stats_path, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(dalstats_s))) {
+		close(fd);
+		unlink(__stats_path);
+		return -1;
+	}
+
+	st = (dalstats_s*)mmap(NULL, sizeof(dalstats_s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (st == MAP_FAILED) {
+		unlink(__stats_path);
+		return -1;
+	}
+
+	st->pid = (int)getpid();
+	natm_store(&__stats, st);
+	dalog_stats_update();
+	return 0;
+}
+
+/* The page is of the parent, the child has its own */
+static void stats_atfork_child(void)
+{
+	if (!__stats)
+		return;
+
+	munmap(__stats, sizeof(dalstats_s));
+	__stats = NULL;
+	if (stats_map() && dalog_noisy())
+		fprintf(stderr, "dalog_stats: no page for child %d\n", (int)getpid());
+}
+
+static void stats_exit(void)
+{
+	if (__stats && __stats->pid == (int)getpid())
+		unlink(__stats_path);
+}
+
+/*-----------------------------------------------------------------------
+ * API
+ */
+
+/**
+ * \brief The sum of all the threads, the exited ones included.
+ */
+void dalog_stats_sum(dalstats_s *st)
+{
+	dalnet_stat_s ns;
+	dalthr_s *thr;
+	int i;
+
+	memset(st, 0, sizeof(dalstats_s));
+	st->pid = dalog_pid();
+	st->stamp = dalog_time_abs();
+
+	for (thr = dalog_thr_list(); thr; thr = thr->next) {
+		for (i = 0; i < DALOG_STATS_MSGS; i++)
+			st->msgs[i] += STAT_GET(thr->stat.msgs[i]);
+		st->bytes += STAT_GET(thr->stat.bytes);
+		st->heap += STAT_GET(thr->stat.heap);
+
+		if (thr->ring)
+			st->drops_ring += natm_load(&thr->ring->drops);
+		st->drops_rate += STAT_GET(thr->stat.drops_rate);
+		st->evals += STAT_GET(thr->stat.evals);
+
+		st->sink_calls += STAT_GET(thr->stat.sink_calls);
+		st->sink_ns += STAT_GET(thr->stat.sink_ns);
+		for (i = 0; i < DALOG_STATS_HIST; i++)
+			st->sink_hist[i] += STAT_GET(thr->stat.sink_hist[i]);
+	}
+
+	dalog_net_stat(&ns);
+	st->net_bytes = ns.bytes;
+	st->net_batches = ns.batches;
+	st->net_lines = ns.lines;
+	st->net_drops = ns.drops;
+	st->net_connects = ns.connects;
+}
+
+/**
+ * \brief The sum in lines of "name value", as dr --stats shows.
+ *
+ * \return length of the text.
+ */
+int dalog_stats_text(char *buf, int size)
+{
+	dalstats_s st;
+	int i, n;
+
+	dalog_stats_sum(&st);
+
+	n = snprintf(buf, size, "msgs");
+	for (i = 0; i < DALOG_STATS_MSGS - 1; i++)
+		n += snprintf(buf + n, size > n ? size - n : 0, " %c=%llu", __stats_levels[i], st.msgs[i]);
+	n += snprintf(buf + n, size > n ? size - n : 0, " other=%llu\n", st.msgs[i]);
+
+	n += snprintf(buf + n, size > n ? size - n : 0,
+			"bytes %llu\nheap %llu\ndrops ring=%llu rate=%llu\nevals %llu\n"
+			"sink calls=%llu ns=%llu avg=%llu\nsink_hist",
+			st.bytes, st.heap, st.drops_ring, st.drops_rate, st.evals,
+			st.sink_calls, st.sink_ns, st.sink_calls ? st.sink_ns / st.sink_calls : 0);
+
+	/* The upper bound of each bucket in NS */
+	for (i = 0; i < DALOG_STATS_HIST - 1; i++)
+		n += snprintf(buf + n, size > n ? size - n : 0, " <%llu=%llu", 1ULL << (i + 7), st.sink_hist[i]);
+	n += snprintf(buf + n, size > n ? size - n : 0, " more=%llu\n", st.sink_hist[i]);
+
+	n += snprintf(buf + n, size > n ? size - n : 0,
+			"net bytes=%llu batches=%llu lines=%llu drops=%llu connects=%llu\n",
+			st.net_bytes, st.net_batches, st.net_lines, st.net_drops, st.net_connects);
+
+	return n < size ? n : size - 1;
+}
+
+/**
+ * \brief Keep the sum in DALOG_STATS_PATH, till the process exit.
+ */
+int dalog_stats_start(void)
+{
+	if (__stats)
+		return 0;
+
+	if (stats_map())
+		return -1;
+
+	pthread_atfork(NULL, NULL, stats_atfork_child);
+	atexit(stats_exit);
+	return 0;
+}
+
+/**
+ * \brief No one renew the page, remove it, by the ctl thread or its starter.
+ */
+void dalog_stats_stop(void)
+{
+	dalstats_s *st = __stats;
+
+	if (!st)
+		return;
+
+	natm_store(&__stats, NULL);
+	unlink(__stats_path);
+	munmap(st, sizeof(dalstats_s));
+}
+
+int dalog_stats_on(void)
+{
+	return natm_load(&__stats) != NULL;
+}
+
+/* Only the ctl thread call it, the one writer of the page */
+void dalog_stats_update(void)
+{
+	dalstats_s st;
+
+	if (!__stats)
+		return;
+
+	dalog_stats_sum(&st);
+
+	natm_store(&__stats->seq, __stats->seq + 1);
+	natm_fence();
+
+	__stats->stamp = st.stamp;
+	memcpy(__stats->msgs, st.msgs, sizeof(dalstats_s) - offsetof(dalstats_s, msgs));
+
+	natm_store(&__stats->seq, __stats->seq + 1);
+}
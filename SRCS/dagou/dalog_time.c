@@ -0,0 +1,171 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/**
+ * @file     dalog_time.c
+ * @brief    Timestamp of dalog, cheap clocks and cached date string.
+ *
+ * s: and S: are in MS, the coarse clocks are good enough and they are
+ * read from vDSO without any syscall. Set env DALOG_CLOCK=fine to use
+ * the fine ones, if the tick of the box is too long.
+ *
+ * u: is in NS, the fine clock is always used, or the cycle counter if
+ * built with DALOG_CLOCK_TSC.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <helper.h>
+#include <dalog_inner.h>
+
+static clockid_t __clk_rel = CLOCK_MONOTONIC;
+static clockid_t __clk_abs = CLOCK_REALTIME;
+
+/* Cached "%Y/%m/%d %H:%M:%S" of the second __t_date_sec */
+static __thread time_t __t_date_sec = -1;
+static __thread char __t_date[32];
+
+static inline unsigned long long ts_ns(const struct timespec *ts)
+{
+	return (unsigned long long)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/*-----------------------------------------------------------------------
+ * Cycle counter, NS = __tsc_ns0 + (cycle - __tsc0) * __tsc_scale
+ */
+#ifdef DALOG_CLOCK_TSC
+static int __tsc_on = 0;
+static unsigned long long __tsc0, __tsc_ns0;
+static double __tsc_scale;
+
+static inline unsigned long long tsc_read(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((unsigned long long)hi << 32) | lo;
+#elif defined(__aarch64__)
+	unsigned long long v;
+
+	__asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(v) :: "memory");
+	return v;
+#else
+	return 0;
+#endif
+}
+
+static void tsc_calibrate(void)
+{
+	unsigned long long c0, c1, n0;
+	struct timespec ts;
+
+#if defined(__aarch64__)
+	/* The frequency is given */
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(c1));
+	if (!c1)
+		return;
+
+	c0 = tsc_read();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	n0 = ts_ns(&ts);
+	__tsc_scale = 1e9 / (double)c1;
+#else
+	struct timespec delay = { 0, 10 * 1000000 };
+	unsigned long long n1;
+
+	/* Run along with CLOCK_MONOTONIC for a while */
+	c0 = tsc_read();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	n0 = ts_ns(&ts);
+
+	nanosleep(&delay, NULL);
+
+	c1 = tsc_read();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	n1 = ts_ns(&ts);
+
+	if (c1 <= c0)
+		return;
+	__tsc_scale = (double)(n1 - n0) / (double)(c1 - c0);
+#endif
+
+	__tsc0 = c0;
+	__tsc_ns0 = n0;
+	__tsc_on = 1;
+}
+#endif
+
+/*-----------------------------------------------------------------------
+ * API
+ */
+void dalog_time_init(void)
+{
+	char *env = getenv("DALOG_CLOCK");
+	struct timespec ts;
+
+#ifdef DALOG_CLOCK_TSC
+	tsc_calibrate();
+#endif
+
+	if (env && !strcmp(env, "fine"))
+		return;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	if (!clock_getres(CLOCK_MONOTONIC_COARSE, &ts))
+		__clk_rel = CLOCK_MONOTONIC_COARSE;
+	if (!clock_getres(CLOCK_REALTIME_COARSE, &ts))
+		__clk_abs = CLOCK_REALTIME_COARSE;
+#endif
+}
+
+/* s: */
+unsigned long long dalog_time_rel(void)
+{
+	struct timespec ts;
+
+	clock_gettime(__clk_rel, &ts);
+	return ts_ns(&ts);
+}
+
+/* S: */
+unsigned long long dalog_time_abs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(__clk_abs, &ts);
+	return ts_ns(&ts);
+}
+
+/* u: same base as s:, but fine */
+unsigned long long dalog_time_ns(void)
+{
+	struct timespec ts;
+
+#ifdef DALOG_CLOCK_TSC
+	if (dalog_likely(__tsc_on))
+		return __tsc_ns0 + (unsigned long long)((double)(tsc_read() - __tsc0) * __tsc_scale);
+#endif
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_ns(&ts);
+}
+
+/**
+ * \brief Local date of the sec, only formatted when the second changed.
+ *
+ * The buffer is per thread, valid until next call of the thread.
+ */
+const char *dalog_time_date(time_t sec)
+{
+	struct tm tm;
+
+	if (dalog_unlikely(sec != __t_date_sec)) {
+		localtime_r(&sec, &tm);
+		strftime(__t_date, sizeof(__t_date), "%Y/%m/%d %H:%M:%S", &tm);
+		__t_date_sec = sec;
+	}
+	return __t_date;
+}
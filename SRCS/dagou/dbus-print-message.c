@@ -366,9 +366,9 @@ static void dumphead_met (DBusMessage *message)
     const int line = __LINE__;
 
     DALOG_INNER_VAR_DEF();
-    if (dalog_unlikely(__dal_ver_get > __dal_ver_sav)) {
-        __dal_ver_sav = __dal_ver_get;
+    if (dalog_unlikely(__dal_ver_get != __dal_ver_sav)) {
         DALOG_SETUP_NAME(DALOG_MODU_NAME, __FILE__, __func__);
+        __dal_ver_sav = DALOG_SITE_VER();
         __dal_mask = dalog_calc_mask(__dal_prog_name, __dal_modu_name, __dal_file_name, __dal_func_name, line);
         if (!(__dal_mask & (DALOG_INFO))) {
             __dal_mask = 0;
@@ -409,9 +409,9 @@ static void dumphead_sig (DBusMessage *message)
     const int line = __LINE__;
 
     DALOG_INNER_VAR_DEF();
-    if (dalog_unlikely(__dal_ver_get > __dal_ver_sav)) {
-        __dal_ver_sav = __dal_ver_get;
+    if (dalog_unlikely(__dal_ver_get != __dal_ver_sav)) {
         DALOG_SETUP_NAME(DALOG_MODU_NAME, __FILE__, __func__);
+        __dal_ver_sav = DALOG_SITE_VER();
         __dal_mask = dalog_calc_mask(__dal_prog_name, __dal_modu_name, __dal_file_name, __dal_func_name, line);
         if (!(__dal_mask & (DALOG_INFO))) {
             __dal_mask = 0;
@@ -452,9 +452,9 @@ static void dumphead_ret (DBusMessage *message)
     const int line = __LINE__;
 
     DALOG_INNER_VAR_DEF();
-    if (dalog_unlikely(__dal_ver_get > __dal_ver_sav)) {
-        __dal_ver_sav = __dal_ver_get;
+    if (dalog_unlikely(__dal_ver_get != __dal_ver_sav)) {
         DALOG_SETUP_NAME(DALOG_MODU_NAME, __FILE__, __func__);
+        __dal_ver_sav = DALOG_SITE_VER();
         __dal_mask = dalog_calc_mask(__dal_prog_name, __dal_modu_name, __dal_file_name, __dal_func_name, line);
         if (!(__dal_mask & (DALOG_INFO))) {
             __dal_mask = 0;
@@ -492,9 +492,9 @@ static void dumphead_err (DBusMessage *message)
     const int line = __LINE__;
 
     DALOG_INNER_VAR_DEF();
-    if (dalog_unlikely(__dal_ver_get > __dal_ver_sav)) {
-        __dal_ver_sav = __dal_ver_get;
+    if (dalog_unlikely(__dal_ver_get != __dal_ver_sav)) {
         DALOG_SETUP_NAME(DALOG_MODU_NAME, __FILE__, __func__);
+        __dal_ver_sav = DALOG_SITE_VER();
         __dal_mask = dalog_calc_mask(__dal_prog_name, __dal_modu_name, __dal_file_name, __dal_func_name, line);
         if (!(__dal_mask & (DALOG_INFO))) {
             __dal_mask = 0;
@@ -533,9 +533,9 @@ static void dumpfull_met (DBusMessage *message)
     const int line = __LINE__;
 
     DALOG_INNER_VAR_DEF();
-    if (dalog_unlikely(__dal_ver_get > __dal_ver_sav)) {
-        __dal_ver_sav = __dal_ver_get;
+    if (dalog_unlikely(__dal_ver_get != __dal_ver_sav)) {
         DALOG_SETUP_NAME(DALOG_MODU_NAME, __FILE__, __func__);
+        __dal_ver_sav = DALOG_SITE_VER();
         __dal_mask = dalog_calc_mask(__dal_prog_name, __dal_modu_name, __dal_file_name, __dal_func_name, line);
         if (!(__dal_mask & (DALOG_DEBUG))) {
             __dal_mask = 0;
@@ -577,9 +577,9 @@ static void dumpfull_sig (DBusMessage *message)
     const int line = __LINE__;
 
     DALOG_INNER_VAR_DEF();
-    if (dalog_unlikely(__dal_ver_get > __dal_ver_sav)) {
-        __dal_ver_sav = __dal_ver_get;
+    if (dalog_unlikely(__dal_ver_get != __dal_ver_sav)) {
         DALOG_SETUP_NAME(DALOG_MODU_NAME, __FILE__, __func__);
+        __dal_ver_sav = DALOG_SITE_VER();
         __dal_mask = dalog_calc_mask(__dal_prog_name, __dal_modu_name, __dal_file_name, __dal_func_name, line);
         if (!(__dal_mask & (DALOG_DEBUG))) {
             __dal_mask = 0;
@@ -621,9 +621,9 @@ static void dumpfull_ret (DBusMessage *message)
     const int line = __LINE__;
 
     DALOG_INNER_VAR_DEF();
-    if (dalog_unlikely(__dal_ver_get > __dal_ver_sav)) {
-        __dal_ver_sav = __dal_ver_get;
+    if (dalog_unlikely(__dal_ver_get != __dal_ver_sav)) {
         DALOG_SETUP_NAME(DALOG_MODU_NAME, __FILE__, __func__);
+        __dal_ver_sav = DALOG_SITE_VER();
         __dal_mask = dalog_calc_mask(__dal_prog_name, __dal_modu_name, __dal_file_name, __dal_func_name, line);
         if (!(__dal_mask & (DALOG_DEBUG))) {
             __dal_mask = 0;
@@ -662,9 +662,9 @@ static void dumpfull_err (DBusMessage *message)
     const int line = __LINE__;
 
     DALOG_INNER_VAR_DEF();
-    if (dalog_unlikely(__dal_ver_get > __dal_ver_sav)) {
-        __dal_ver_sav = __dal_ver_get;
+    if (dalog_unlikely(__dal_ver_get != __dal_ver_sav)) {
         DALOG_SETUP_NAME(DALOG_MODU_NAME, __FILE__, __func__);
+        __dal_ver_sav = DALOG_SITE_VER();
         __dal_mask = dalog_calc_mask(__dal_prog_name, __dal_modu_name, __dal_file_name, __dal_func_name, line);
         if (!(__dal_mask & (DALOG_DEBUG))) {
             __dal_mask = 0;
@@ -65,6 +65,15 @@ extern "C" {
 #define nflg_chk_any(flg, bits) ((flg) & (bits))
 #define nflg_chk_all(flg, bits) (((flg) & (bits)) == (bits))
 
+/*-----------------------------------------------------------------------
+ * natm: atomic access, wrap the gcc __atomic builtins
+ */
+#define natm_load(p)            __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define natm_store(p, v)        __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define natm_add(p, v)          __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+#define natm_cas(p, o, n)       __atomic_compare_exchange_n((p), (o), (n), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define natm_fence()            __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,167 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/*
+ * Hot path cost of the dalog_xxx, in ns per call.
+ *
+ * - disabled: the site is masked off
+ * - enabled: to a sink does nothing, no header
+ * - flags: every combination of the header flags sSjxPMFHN
+ * - threads: 1 to 64 threads on the same site
+ * - touch: dalog_touch() and the first call after it
+ *
+ * Printed as JSON, to compare between the releases.
+ *
+ * usage: bench-hot [calls] [max threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define DALOG_MODU_NAME "BENCH"
+#include <dalog.h>
+
+static const char *__flags = "sSjxPMFHN";
+
+static long __calls = 1000000;
+static int __thread_max = 64;
+static int __first = 1;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void null_sink(char *content, int len)
+{
+}
+
+static void result(const char *name, const char *arg, long calls, double ns)
+{
+	printf("%s\n    {\"name\": \"%s\", \"arg\": \"%s\", \"calls\": %ld, \"ns_per_call\": %.2f}",
+			__first ? "" : ",", name, arg, calls, ns / calls);
+	__first = 0;
+}
+
+static void rule(const char *mask)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "mask=%s", mask);
+	dalog_rule_clr();
+	dalog_rule_add(buf);
+}
+
+/* The same site for all, as a hot loop does */
+static double loop(long calls)
+{
+	double t0;
+	long i;
+
+	t0 = now_ns();
+	for (i = 0; i < calls; i++)
+		dalog_debug("bench %ld %s\n", i, "hot");
+	return now_ns() - t0;
+}
+
+static void *thread_loop(void *user_data)
+{
+	loop((long)user_data);
+	return NULL;
+}
+
+static void bench_flags(void)
+{
+	char mask[16], arg[16];
+	long calls = __calls / 50;
+	int combo, i, n;
+
+	for (combo = 0; combo < 1 << 9; combo++) {
+		n = 0;
+		mask[n++] = 'd';
+		for (i = 0; i < 9; i++)
+			if (combo & (1 << i))
+				mask[n++] = __flags[i];
+		mask[n] = '\0';
+
+		rule(mask);
+		strcpy(arg, mask + 1);
+		result("flags", arg, calls, loop(calls));
+	}
+}
+
+static void bench_threads(void)
+{
+	pthread_t thr[256];
+	long calls;
+	double t0;
+	char arg[16];
+	int n, i;
+
+	rule("d");
+	for (n = 1; n <= __thread_max && n <= 256; n *= 2) {
+		calls = __calls / n;
+
+		t0 = now_ns();
+		for (i = 0; i < n; i++)
+			pthread_create(&thr[i], NULL, thread_loop, (void*)calls);
+		for (i = 0; i < n; i++)
+			pthread_join(thr[i], NULL);
+
+		/* Wall time over all the calls, the cost seen by the process */
+		sprintf(arg, "%d", n);
+		result("threads", arg, calls * n, now_ns() - t0);
+	}
+}
+
+static void bench_touch(void)
+{
+	long i, calls = __calls / 100;
+	double t0, t_touch = 0, t_call = 0;
+
+	rule("d");
+	for (i = 0; i < calls; i++) {
+		t0 = now_ns();
+		dalog_touch();
+		t_touch += now_ns() - t0;
+
+		t0 = now_ns();
+		dalog_debug("bench %ld %s\n", i, "touched");
+		t_call += now_ns() - t0;
+	}
+	result("touch", "dalog_touch", calls, t_touch);
+	result("touch", "first_call", calls, t_call);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		__calls = atol(argv[1]);
+	if (argc > 2)
+		__thread_max = atoi(argv[2]);
+
+	dalog_init(argc, argv);
+	dalog_add_logger(null_sink);
+
+	printf("{\n  \"bench\": \"dalog-hot\",\n  \"results\": [");
+
+	rule("facewni");
+	loop(__calls / 10);
+	result("disabled", "", __calls, loop(__calls));
+
+	rule("d");
+	loop(__calls / 10);
+	result("enabled", "", __calls, loop(__calls));
+
+	bench_flags();
+	bench_threads();
+	bench_touch();
+
+	printf("\n  ]\n}\n");
+	return 0;
+}
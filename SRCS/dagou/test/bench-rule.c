@@ -0,0 +1,225 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/*
+ * Cost of a rule change, and re-evaluation cost of dalog_calc_mask.
+ *
+ * The rules but the last are given by one dalog_rule_add_lines, as the
+ * ctl socket does for a datagram, the last by dalog_rule_add. Both build
+ * the compiled rules once, "publish" and "add" are what they take.
+ *
+ * Every site is evaluated once after a rule change, which is what
+ * happens to all the sites after dalog_touch(). The result is checked
+ * against a linear walk of the same rules.
+ *
+ * usage: bench-rule [sites] [max rules]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DALOG_MODU_NAME "BENCH"
+#include <dalog.h>
+
+typedef struct _site_s site_s;
+struct _site_s {
+	char *prog, *modu, *file, *func;
+	int line;
+};
+
+typedef struct _brule_s brule_s;
+struct _brule_s {
+	char *prog, *modu, *file, *func;
+	int line;
+	unsigned int set, clr;
+};
+
+static const char *__levels = "facewnid";
+static const unsigned int __level_bits[] = {
+	DALOG_FATAL, DALOG_ALERT, DALOG_CRIT, DALOG_ERR,
+	DALOG_WARNING, DALOG_NOTICE, DALOG_INFO, DALOG_DEBUG,
+};
+
+static site_s *__sites;
+static brule_s *__rules;
+static int __site_cnt = 50000;
+static int __rule_max = 10000;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char *name(char *(*add)(char *), const char *fmt, int i)
+{
+	char buf[64];
+
+	sprintf(buf, fmt, i);
+	return add(buf);
+}
+
+static void make_sites(void)
+{
+	site_s *s;
+	int i;
+
+	__sites = (site_s*)calloc(__site_cnt, sizeof(site_s));
+	for (i = 0; i < __site_cnt; i++) {
+		s = &__sites[i];
+		s->prog = dalog_prog_name_add("bench");
+		s->modu = name(dalog_modu_name_add, "M%d", i % 100);
+		s->file = name(dalog_file_name_add, "f%d.c", i % 1000);
+		s->func = name(dalog_func_name_add, "fn%d", i % 20000);
+		s->line = i % 500 + 1;
+	}
+}
+
+/* Make one rule like the one from dr, return the text of it */
+static void make_rule(brule_s *r, char *text)
+{
+	int i, n, shape = rand() % 5;
+	char *p;
+
+	memset(r, 0, sizeof(*r));
+	r->line = -1;
+
+	p = text;
+	switch (shape) {
+	case 0:
+		p += sprintf(p, "file=f%d.c,", rand() % 1000);
+		break;
+	case 1:
+		p += sprintf(p, "func=fn%d,", rand() % 20000);
+		break;
+	case 2:
+		p += sprintf(p, "modu=M%d,", rand() % 100);
+		break;
+	case 3:
+		p += sprintf(p, "file=f%d.c,line=%d,", rand() % 1000, rand() % 500 + 1);
+		break;
+	case 4:
+		p += sprintf(p, "prog=bench,modu=M%d,", rand() % 100);
+		break;
+	}
+
+	p += sprintf(p, "mask=");
+	for (n = rand() % 3 + 1; n; n--) {
+		i = rand() % 8;
+		if (rand() % 3 == 0) {
+			*p++ = '-';
+			r->clr |= __level_bits[i];
+		} else
+			r->set |= __level_bits[i];
+		*p++ = __levels[i];
+	}
+	*p = '\0';
+
+	/* Same names as dalog_rule_add interned */
+	if (strstr(text, "prog="))
+		r->prog = dalog_prog_name_add("bench");
+	if ((p = strstr(text, "modu=")))
+		r->modu = name(dalog_modu_name_add, "M%d", atoi(p + 6));
+	if ((p = strstr(text, "file=")))
+		r->file = name(dalog_file_name_add, "f%d.c", atoi(p + 6));
+	if ((p = strstr(text, "func=")))
+		r->func = name(dalog_func_name_add, "fn%d", atoi(p + 7));
+	if ((p = strstr(text, "line=")))
+		r->line = atoi(p + 5);
+}
+
+static unsigned int linear_mask(site_s *s, int cnt)
+{
+	unsigned int all = 0;
+	brule_s *r;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		r = &__rules[i];
+		if (r->prog && r->prog != s->prog)
+			continue;
+		if (r->modu && r->modu != s->modu)
+			continue;
+		if (r->file && r->file != s->file)
+			continue;
+		if (r->func && r->func != s->func)
+			continue;
+		if (r->line != -1 && r->line != s->line)
+			continue;
+
+		all &= ~r->clr;
+		all |= r->set;
+	}
+	return all;
+}
+
+static void run(int rule_cnt)
+{
+	double t0, t_publish, t_add, t_comp, t_linear;
+	unsigned int sum = 0;
+	char *text, *p;
+	int i, bad = 0;
+
+	text = (char*)malloc(rule_cnt * 256);
+	for (i = 0, p = text; i < rule_cnt - 1; i++) {
+		make_rule(&__rules[i], p);
+		p += strlen(p);
+		*p++ = '\n';
+	}
+	*p = '\0';
+
+	dalog_rule_clr();
+	t0 = now_ns();
+	dalog_rule_add_lines(text);
+	t_publish = now_ns() - t0;
+
+	make_rule(&__rules[i], text);
+	t0 = now_ns();
+	dalog_rule_add(text);
+	t_add = now_ns() - t0;
+	free(text);
+
+	t0 = now_ns();
+	for (i = 0; i < __site_cnt; i++)
+		sum += dalog_calc_mask(__sites[i].prog, __sites[i].modu,
+				__sites[i].file, __sites[i].func, __sites[i].line);
+	t_comp = now_ns() - t0;
+
+	t0 = now_ns();
+	for (i = 0; i < __site_cnt; i++)
+		sum += linear_mask(&__sites[i], rule_cnt);
+	t_linear = now_ns() - t0;
+
+	for (i = 0; i < __site_cnt; i++)
+		if (linear_mask(&__sites[i], rule_cnt) != dalog_calc_mask(__sites[i].prog,
+					__sites[i].modu, __sites[i].file, __sites[i].func,
+					__sites[i].line))
+			bad++;
+
+	printf("rules %6d  sites %6d  publish %9.1f us  add %9.1f us  compiled %7.1f ns/site  linear %9.1f ns/site  %s (%u)\n",
+			rule_cnt, __site_cnt, t_publish / 1000, t_add / 1000, t_comp / __site_cnt,
+			t_linear / __site_cnt, bad ? "MISMATCH" : "ok", sum & 1);
+}
+
+int main(int argc, char *argv[])
+{
+	int n;
+
+	if (argc > 1)
+		__site_cnt = atoi(argv[1]);
+	if (argc > 2)
+		__rule_max = atoi(argv[2]);
+
+	srand(1);
+	make_sites();
+	__rules = (brule_s*)calloc(__rule_max, sizeof(brule_s));
+
+	for (n = 10; n < __rule_max; n *= 10)
+		run(n);
+	run(__rule_max);
+
+	return 0;
+}
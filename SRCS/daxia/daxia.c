@@ -2,6 +2,8 @@
 
 /* DA xiashuidao */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,6 +13,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
@@ -19,14 +23,27 @@
 
 #include <stdarg.h>
 #include <assert.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <helper.h>
+#include <dalog_setup.h>
+
+#include "daxia.h"
 
 #define BACK_LOG 50
 #define EPOLL_MAX 50
+#define DGRAM_SRC_MAX 1024
+#define DGRAM_RCVBUF (4 * 1024 * 1024)
+#define CONN_BUF (64 * 1024)
+#define WORKER_OUT (256 * 1024)
+#define WORKER_MAX 64
 
 static void config_socket(int s);
 static void ignore_pipe();
 
-static void printlog(const char *fmt, ...)
+void printlog(const char *fmt, ...)
 {
 	va_list arg;
 	int done;
@@ -34,11 +51,14 @@ static void printlog(const char *fmt, ...)
 	int ret;
 
 	static FILE *fp = NULL;
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 	va_start(arg, fmt);
 	done = vsnprintf(buf, sizeof(buf), fmt, arg);
 	va_end(arg);
 
+	/* Called by all the workers */
+	pthread_mutex_lock(&mutex);
 	if (!fp) {
 		logto = getenv("DAXIA_LOG_TO");
 		if (!logto)
@@ -46,6 +66,7 @@ static void printlog(const char *fmt, ...)
 
 		fp = fopen(logto, "a+");
 	}
+	pthread_mutex_unlock(&mutex);
 
 	if (!fp)
 		return;
@@ -56,35 +77,425 @@ static void printlog(const char *fmt, ...)
 
 /*-----------------------------------------------------------------------
  * Server
+ *
+ * The main thread accept, and hand the connection to the workers by
+ * turn. Each worker has an epoll of its own, edge triggered, and cut
+ * the stream of each connection at the line end, so the lines from the
+ * different boxes never mix. The whole lines of one round are queued
+ * for the writer at once.
+ *
+ * With DAXIA_SPLICE, each tcp connection is archived as is to a file of
+ * its own by daxia_raw.c, the worker never read the bytes.
  */
-static int process_dalog_data(int s, char *buf, int len, FILE *fp)
+typedef struct _worker_s worker_s;
+struct _worker_s {
+	int epoll_fd;
+
+	/* Whole lines of this round, all go to of */
+	outf_s *of;
+	char *out;
+	int olen, osize;
+};
+
+typedef struct _conn_s conn_s;
+struct _conn_s {
+	int fd;
+	int dgram;
+
+	char addr[32];
+	outf_s *of;             /* Unless split by prog */
+	raw_s *raw;             /* DAXIA_SPLICE */
+
+	/* Tail of the stream, not ended by '\n' yet, room for one more */
+	char *buf;
+	int len;
+};
+
+static worker_s *__workers = NULL;
+static int __worker_cnt = 0;
+static const char *__splice_file = NULL;
+
+static void worker_commit(worker_s *w)
 {
-	if (len != fwrite(buf, sizeof(char), len, fp))
-		printlog("fwrite error: %d\n", errno);
-	fflush(fp);
-	return 0;
+	if (w->olen)
+		daxia_out_put(w->of, w->out, w->olen);
+	w->olen = 0;
 }
 
-static void close_connect(int s)
+static void worker_out(worker_s *w, outf_s *of, const char *buf, int len)
 {
-	close(s);
+	if (w->of != of || w->olen + len > w->osize) {
+		worker_commit(w);
+		w->of = of;
+		if (len > w->osize) {
+			daxia_out_put(of, buf, len);
+			return;
+		}
+	}
+	memcpy(w->out + w->olen, buf, len);
+	w->olen += len;
 }
 
-static void *worker_thread_or_server(unsigned short port, const char *file)
+/* Whole lines from addr, of is the file if known */
+static void worker_lines(worker_s *w, const char *addr, outf_s *of, const char *buf, int len)
 {
-	int ready, i, n, bufsize = 256 * 1024;
-	void *buf;
+	int n;
 
-	int s_listen, new_fd;
-	struct sockaddr_in their_addr;
+	if (of) {
+		worker_out(w, of, buf, len);
+		return;
+	}
+
+	while (len > 0) {
+		n = daxia_out_next(addr, buf, len, &of);
+		worker_out(w, of, buf, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+static void worker_add(worker_s *w, conn_s *c)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.ptr = c;
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev))
+		printlog("c:%s, e:%s\n", "epoll_ctl", strerror(errno));
+}
+
+/* A line longer than the buffer is cut into pieces */
+static void process_dalog_data(worker_s *w, conn_s *c)
+{
+	char *eol;
+	int n;
+
+	eol = memrchr(c->buf, '\n', c->len);
+	if (!eol) {
+		if (c->len < CONN_BUF)
+			return;
+		c->buf[c->len++] = '\n';
+		worker_lines(w, c->addr, c->of, c->buf, c->len);
+		c->len = 0;
+		return;
+	}
+
+	n = eol - c->buf + 1;
+	worker_lines(w, c->addr, c->of, c->buf, n);
+	c->len -= n;
+	memmove(c->buf, eol + 1, c->len);
+}
+
+static void close_connect(worker_s *w, conn_s *c)
+{
+	if (c->raw)
+		daxia_raw_close(c->raw);
+
+	/* The last line without '\n' */
+	if (c->len) {
+		c->buf[c->len++] = '\n';
+		worker_lines(w, c->addr, c->of, c->buf, c->len);
+	}
+
+	printlog("Remote close socket, addr:%s, fd:%d\n", c->addr, c->fd);
+	close(c->fd);
+	nmem_free(c->buf);
+	nmem_free(c);
+}
+
+/* Edge triggered, read until EAGAIN */
+static void read_stream(worker_s *w, conn_s *c)
+{
+	int n;
+
+	if (c->raw) {
+		if (daxia_raw_read(c->raw, c->fd))
+			close_connect(w, c);
+		return;
+	}
+
+	for (;;) {
+		n = recv(c->fd, c->buf + c->len, CONN_BUF - c->len, 0);
+		if (n > 0) {
+			c->len += n;
+			process_dalog_data(w, c);
+			continue;
+		}
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		if (n < 0)
+			printlog("c:%s, e:%s\n", "recv", strerror(errno));
+		close_connect(w, c);
+		return;
+	}
+}
+
+/*-----------------------------------------------------------------------
+ * Datagram, the udp:// and unix:// of DALOG_TO_NETWORK
+ */
+typedef struct _dgsrc_s dgsrc_s;
+struct _dgsrc_s {
+	unsigned int addr;      /* IPv4 of the sender, 0 for unix */
+	unsigned int pid;
+	unsigned int next;      /* Expected seq */
+	unsigned long lost;
+	time_t seen;
+};
+
+static dgsrc_s __dgsrcs[DGRAM_SRC_MAX];
+static int __dgsrc_cnt = 0;
+
+/* Find the sender, or take the slot of the one quiet for longest */
+static dgsrc_s *dgram_src(unsigned int addr, unsigned int pid, int *isnew)
+{
+	dgsrc_s *src, *old = NULL;
+	int i;
+
+	*isnew = 0;
+	for (i = 0; i < __dgsrc_cnt; i++) {
+		src = &__dgsrcs[i];
+		if (src->addr == addr && src->pid == pid)
+			return src;
+		if (!old || src->seen < old->seen)
+			old = src;
+	}
+
+	*isnew = 1;
+	if (__dgsrc_cnt < DGRAM_SRC_MAX)
+		old = &__dgsrcs[__dgsrc_cnt++];
+	memset(old, 0, sizeof(*old));
+	old->addr = addr;
+	old->pid = pid;
+	return old;
+}
+
+static void dgram_addr_str(unsigned int addr, char *buf)
+{
+	unsigned char *a = (unsigned char*)&addr;
+
+	if (addr)
+		sprintf(buf, "%d.%d.%d.%d", a[0], a[1], a[2], a[3]);
+	else
+		strcpy(buf, "unix");
+}
+
+/* Check the seq, report the gap both here and in the log file */
+static void process_dalog_dgram(worker_s *w, unsigned int addr, char *buf, int len)
+{
+	dalnet_dgram_s *dg = (dalnet_dgram_s*)buf;
+	unsigned int pid, seq, lost;
+	char from[32], note[128];
+	dgsrc_s *src;
+	int isnew, n;
+
+	dgram_addr_str(addr, from);
+
+	/* Not from dalog, keep it as is */
+	if (len < (int)sizeof(*dg) || ntohl(dg->magic) != DALNET_MAGIC) {
+		worker_lines(w, from, NULL, buf, len);
+		return;
+	}
+
+	pid = ntohl(dg->pid);
+	seq = ntohl(dg->seq);
+	src = dgram_src(addr, pid, &isnew);
+	src->seen = time(NULL);
+
+	if (isnew || seq == 0) {
+		printlog("New sender, addr:%s, pid:%u, seq:%u\n", from, pid, seq);
+	} else if ((int)(seq - src->next) > 0) {
+		lost = seq - src->next;
+		src->lost += lost;
+		printlog("Lost %u datagrams, addr:%s, pid:%u, seq:%u-%u, total:%lu\n",
+				lost, from, pid, src->next, seq - 1, src->lost);
+		n = snprintf(note, sizeof(note), "|!| daxia: %u datagrams lost from %s pid %u\n",
+				lost, from, pid);
+		worker_lines(w, from, NULL, note, n);
+	} else if (seq != src->next) {
+		printlog("Out of order datagram, addr:%s, pid:%u, seq:%u, expect:%u\n",
+				from, pid, seq, src->next);
+		worker_lines(w, from, NULL, buf + sizeof(*dg), len - sizeof(*dg));
+		return;
+	}
+
+	src->next = seq + 1;
+	worker_lines(w, from, NULL, buf + sizeof(*dg), len - sizeof(*dg));
+}
+
+static int open_dgram_udp(unsigned short port)
+{
 	struct sockaddr_in my_addr;
+	int s, size = DGRAM_RCVBUF;
+
+	if ((s = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) == -1) {
+		printlog("c:%s, e:%s\n", "socket", strerror(errno));
+		return -1;
+	}
+	config_socket(s);
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	memset(&my_addr, 0, sizeof(my_addr));
+	my_addr.sin_family = AF_INET;
+	my_addr.sin_port = htons(port);
+	my_addr.sin_addr.s_addr = INADDR_ANY;
+	if (bind(s, (struct sockaddr *) &my_addr, sizeof(my_addr)) == -1) {
+		printlog("c:%s, e:%s\n", "bind udp", strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/* "@name" is in the abstract namespace */
+static int open_dgram_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	int s, size = DGRAM_RCVBUF;
+	socklen_t slen;
+
+	if ((s = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0)) == -1) {
+		printlog("c:%s, e:%s\n", "socket", strerror(errno));
+		return -1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	slen = offsetof(struct sockaddr_un, sun_path) + strlen(sun.sun_path);
+	if (sun.sun_path[0] == '@')
+		sun.sun_path[0] = '\0';
+	else
+		unlink(path);
+
+	if (bind(s, (struct sockaddr *) &sun, slen) == -1) {
+		printlog("c:%s, e:%s\n", "bind unix", strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	/* Any process on the box may log */
+	if (path[0] != '@')
+		chmod(path, 0666);
+	return s;
+}
+
+/* Drain the socket, datagram never close */
+static void read_dgram(worker_s *w, int s, char *buf, int bufsize)
+{
+	struct sockaddr_in their_addr;
 	socklen_t sin_size;
+	unsigned int addr;
+	int n;
+
+	for (;;) {
+		sin_size = sizeof(their_addr);
+		memset(&their_addr, 0, sizeof(their_addr));
+		n = recvfrom(s, buf, bufsize, 0, (struct sockaddr *)&their_addr, &sin_size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				printlog("c:%s, e:%s\n", "recvfrom", strerror(errno));
+			break;
+		}
+
+		addr = 0;
+		if (their_addr.sin_family == AF_INET)
+			addr = their_addr.sin_addr.s_addr;
+		process_dalog_dgram(w, addr, buf, n);
+	}
+}
+
+static void *worker_thread(void *user_data)
+{
+	worker_s *w = (worker_s*)user_data;
+	struct epoll_event epoll_events[EPOLL_MAX], *e;
+	char *buf;
+	int ready, i;
+	conn_s *c;
+
+	/* recvfrom of the datagrams */
+	buf = nmem_alloc(DALNET_DGRAM_MAX, char);
+
+	for (;;) {
+		do
+			ready = epoll_wait(w->epoll_fd, epoll_events, EPOLL_MAX, -1);
+		while ((ready == -1) && (errno == EINTR));
+
+		for (i = 0; i < ready; i++) {
+			e = epoll_events + i;
+			c = (conn_s*)e->data.ptr;
+
+			if (c->dgram)
+				read_dgram(w, c->fd, buf, DALNET_DGRAM_MAX);
+			else
+				read_stream(w, c);
+		}
+
+		/* One queue for all the connections of this round */
+		if (w->olen)
+			worker_commit(w);
+	}
+
+	nmem_free(buf);
+	return NULL;
+}
+
+static int start_workers(int cnt)
+{
+	pthread_t thread;
+	worker_s *w;
+	int i;
+
+	__workers = nmem_alloz(cnt, worker_s);
+	for (i = 0; i < cnt; i++) {
+		w = &__workers[i];
+		w->osize = WORKER_OUT;
+		w->out = nmem_alloc(w->osize, char);
+		w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (w->epoll_fd == -1) {
+			printlog("c:%s, e:%s\n", "epoll_create", strerror(errno));
+			return -1;
+		}
+
+		if (pthread_create(&thread, NULL, worker_thread, w)) {
+			printlog("c:%s, e:%s\n", "pthread_create", strerror(errno));
+			return -1;
+		}
+		pthread_detach(thread);
+		__worker_cnt++;
+	}
+	return 0;
+}
 
-	int epoll_fd = -1;
-	struct epoll_event epoll_events[EPOLL_MAX];
-	struct epoll_event ev, *e;
+/* The senders of datagram are tracked by the first worker only */
+static void add_dgram(int s)
+{
+	conn_s *c;
 
-	FILE *fp = NULL;
+	if (s == -1)
+		return;
+
+	c = nmem_alloz(1, conn_s);
+	c->fd = s;
+	c->dgram = 1;
+	worker_add(&__workers[0], c);
+}
+
+static void *worker_thread_or_server(unsigned short port, const char *upath)
+{
+	int s_listen, new_fd, turn = 0;
+	struct sockaddr_in their_addr;
+	struct sockaddr_in my_addr;
+	unsigned char addr[4];
+	socklen_t sin_size;
+	conn_s *c;
 
 	ignore_pipe();
 
@@ -109,71 +520,40 @@ static void *worker_thread_or_server(unsigned short port, const char *file)
 		return NULL;
 	}
 
-	epoll_fd = epoll_create(EPOLL_MAX);
-	memset(&ev, 0, sizeof(ev));
-	ev.data.fd = s_listen;
-	ev.events = EPOLLIN;
-	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s_listen, &ev);
+	/* udp:// on the same port, unix:// if asked */
+	add_dgram(open_dgram_udp(port));
+	if (upath)
+		add_dgram(open_dgram_unix(upath));
 
-	buf = malloc(bufsize);
 	for (;;) {
-		do
-			ready = epoll_wait(epoll_fd, epoll_events, EPOLL_MAX, -1);
-		while ((ready == -1) && (errno == EINTR));
+		sin_size = sizeof(their_addr);
+		new_fd = accept4(s_listen, (struct sockaddr *)&their_addr, &sin_size,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_fd == -1) {
+			if (errno != EINTR)
+				printlog("c:%s, e:%s\n", "accept", strerror(errno));
+			continue;
+		}
 
-		for (i = 0; i < ready; i++) {
-			e = epoll_events + i;
+		c = nmem_alloz(1, conn_s);
+		c->fd = new_fd;
+		c->buf = nmem_alloc(CONN_BUF + 1, char);
+		memcpy(addr, &their_addr.sin_addr.s_addr, 4);
+		sprintf(c->addr, "%d.%d.%d.%d", addr[0], addr[1], addr[2], addr[3]);
 
-			if (e->data.fd == s_listen) {
-				sin_size = sizeof(their_addr);
-				if ((new_fd = accept(s_listen, (struct sockaddr *)&their_addr, &sin_size)) == -1) {
-					printlog("c:%s, e:%s\n", "accept", strerror(errno));
-					continue;
-				}
-
-				unsigned char addr[4];
-				memcpy(addr, &their_addr.sin_addr.s_addr, 4);
-				printlog("New connect, addr:%d.%d.%d.%d, port:%d, fd:%d\n",
-						addr[0], addr[1], addr[2], addr[3],
-						ntohs(their_addr.sin_port),
-						new_fd);
-
-				struct epoll_event ev;
-				memset(&ev, 0, sizeof(ev));
-				ev.data.fd = new_fd;
-				ev.events = EPOLLIN;
-				epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &ev);
+		/* Or go the way of the lines */
+		if (__splice_file)
+			c->raw = daxia_raw_open(__splice_file, c->addr, ntohs(their_addr.sin_port));
 
-				continue;
-			} else if (!(e->events & EPOLLIN)) {
-				printlog("!!! Not EPOLLIN: event is %08x, fd:%d\n", e->events, e->data.fd);
-				continue;
-			}
-
-			if ((n = recv(e->data.fd, buf, bufsize, 0)) > 0) {
-				if (!fp)
-					fp = fopen(file, "a+");
-
-				if (!fp) {
-					printlog("Open '%s' NG\n", file);
-					continue;
-				}
-
-				if (process_dalog_data(e->data.fd, buf, n, fp))
-					close_connect(e->data.fd);
-			} else {
-				printlog("Remote close socket: %d\n", e->data.fd);
-				close_connect(e->data.fd);
-
-				/* XXX: Should not put it here */
-				fflush(fp);
-			}
-		}
-	}
-	free(buf);
+		if (!c->raw && !(daxia_out_split() & DAXIA_SPLIT_PROG))
+			c->of = daxia_out_file(c->addr, NULL, 0);
 
-	close(epoll_fd);
-	epoll_fd = -1;
+		printlog("New connect, addr:%s, port:%d, fd:%d, worker:%d\n",
+				c->addr, ntohs(their_addr.sin_port), new_fd, turn);
+
+		worker_add(&__workers[turn], c);
+		turn = (turn + 1) % __worker_cnt;
+	}
 
 	return NULL;
 }
@@ -202,6 +582,20 @@ static void help(int die)
 {
 	printf("usage: daxia [PORT] [TOFILE]\n");
 	printf("       environ: DAXIA_PORT DAXIA_FILE\n");
+	printf("       environ: DAXIA_UNIX=<path>, also take unix:// datagrams\n");
+	printf("       environ: DAXIA_SHM, also drain DALOG_TO_SHM rings\n");
+	printf("       tcp and udp are both served on PORT\n");
+	printf("       environ: DAXIA_THREADS=<N>, workers, default by CPU count\n");
+	printf("       environ: DAXIA_FLUSH_MS=<MS>, max delay of the write, default 20\n");
+	printf("       environ: DAXIA_SPLIT=addr,prog, TOFILE.<addr>.<prog> for each\n");
+	printf("       environ: DAXIA_ROTATE_MB=<MB> DAXIA_ROTATE_SEC=<SEC>, rotate TOFILE\n");
+	printf("       environ: DAXIA_COMPRESS=gzip|zstd, for the rotated out\n");
+	printf("       environ: DAXIA_PREALLOC_MB=<MB>, fallocate ahead, default 16, 0 off\n");
+	printf("       environ: DAXIA_INDEX, keep TOFILE.idx for dayi to query\n");
+	printf("       environ: DAXIA_SPLICE, archive each tcp connection as is by splice,\n");
+	printf("                to TOFILE.<addr>.<port>, not split, rotated or subscribed\n");
+	printf("       environ: DAXIA_SUB_PORT=<PORT> DAXIA_SUB_UNIX=<path>, live tail\n");
+	printf("                for the subscribers, see dr --tail\n");
 	printf("       environ: DAXIA_NO_LOG_TO_FILE\n");
 	printf("       environ: DAXIA_NO_LOG_TO_STDOUT\n");
 
@@ -214,6 +608,7 @@ int main(int argc, char *argv[])
 	unsigned short port;
 	const char *file;
 	char *env;
+	int threads;
 
 	if (argc < 3) {
 		env = getenv("DAXIA_PORT");
@@ -230,7 +625,27 @@ int main(int argc, char *argv[])
 		file = strdup(argv[2]);
 	}
 
-	worker_thread_or_server(port, file);
+	env = getenv("DAXIA_THREADS");
+	threads = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+	if (threads > WORKER_MAX)
+		threads = WORKER_MAX;
+
+	if (daxia_out_open(file) || start_workers(threads))
+		return -1;
+
+	if (getenv("DAXIA_SPLICE"))
+		__splice_file = file;
+
+	if (getenv("DAXIA_SHM"))
+		daxia_shm_start();
+
+	env = getenv("DAXIA_SUB_PORT");
+	if (env || getenv("DAXIA_SUB_UNIX"))
+		daxia_sub_start(env ? (unsigned short)atoi(env) : 0, getenv("DAXIA_SUB_UNIX"));
+
+	worker_thread_or_server(port, getenv("DAXIA_UNIX"));
 
 	free((void*)file);
 	return 0;
@@ -0,0 +1,43 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+#ifndef __BKM_DAXIA_H__
+#define __BKM_DAXIA_H__
+
+void printlog(const char *fmt, ...);
+
+/* daxia_out.c */
+#define DAXIA_SPLIT_ADDR        0x01
+#define DAXIA_SPLIT_PROG        0x02
+
+typedef struct _outf_s outf_s;
+
+int daxia_out_open(const char *file);
+int daxia_out_split(void);
+outf_s *daxia_out_file(const char *addr, const char *prog, int plen);
+int daxia_out_next(const char *addr, const char *buf, int len, outf_s **file);
+const char *daxia_line_prog(const char *line, int len, int *plen);
+void daxia_out_put(outf_s *of, const char *buf, int len);
+
+/* daxia_idx.c */
+typedef struct _idx_s idx_s;
+
+idx_s *daxia_idx_open(const char *path, long long size);
+void daxia_idx_add(idx_s *ix, long long ofs, const char *buf, int len);
+void daxia_idx_flush(idx_s *ix);
+void daxia_idx_close(idx_s *ix, const char *path);
+
+/* daxia_raw.c */
+typedef struct _raw_s raw_s;
+
+raw_s *daxia_raw_open(const char *file, const char *addr, int port);
+int daxia_raw_read(raw_s *raw, int s);
+void daxia_raw_close(raw_s *raw);
+
+/* daxia_shm.c */
+int daxia_shm_start(void);
+
+/* daxia_sub.c */
+int daxia_sub_start(unsigned short port, const char *upath);
+void daxia_sub_feed(const char *buf, int len);
+
+#endif /* __BKM_DAXIA_H__ */
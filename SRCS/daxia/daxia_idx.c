@@ -0,0 +1,367 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/*
+ * Index of the output, FILE.idx, see DALIDX_MAGIC of dalog_fmt.h.
+ *
+ * Each index is used by one thread, the writer of daxia_out.c or the
+ * worker of a DAXIA_SPLICE connection, so no lock. The lines are parsed
+ * as they are written, the records of the closed blocks are appended to
+ * the index after each write of the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <helper.h>
+#include <dalog_fmt.h>
+
+#include "daxia.h"
+
+/* Keys of one block, more than this are not indexed */
+#define BLK_IDS         256
+#define IDX_NAME_MAX    255
+
+typedef struct _idxname_s idxname_s;
+struct _idxname_s {
+	idxname_s *next;
+	unsigned int hash;
+	unsigned int id;
+	char tag;
+	char name[0];
+};
+
+struct _idx_s {
+	char *path;
+	int fd;
+
+	/* Names of this index */
+	idxname_s **names;
+	unsigned int size, cnt;
+
+	/* The block being filled */
+	dalidx_blk_s blk;
+	unsigned int ids[BLK_IDS];
+	int full;
+
+	/* Records not written yet */
+	char *out;
+	int olen, osize;
+};
+
+/*-----------------------------------------------------------------------
+ * Names
+ */
+static unsigned int name_hash(char tag, const char *name, int len)
+{
+	unsigned int h = 2166136261u ^ (unsigned char)tag;
+	int i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	return h;
+}
+
+static void out_rec(idx_s *ix, unsigned short kind, const void *d0, int l0, const void *d1, int l1)
+{
+	static const char zero[8];
+	dalrec_s rec;
+	int need;
+
+	rec.len = l0 + l1;
+	rec.kind = kind;
+	rec.sid = 0;
+	need = sizeof(rec) + DALOG_ALIGN8(rec.len);
+
+	if (ix->olen + need > ix->osize) {
+		while (ix->olen + need > ix->osize)
+			ix->osize = ix->osize ? ix->osize * 2 : 64 * 1024;
+		ix->out = (char*)nmem_realloc(ix->out, ix->osize);
+	}
+
+	memcpy(ix->out + ix->olen, &rec, sizeof(rec));
+	memcpy(ix->out + ix->olen + sizeof(rec), d0, l0);
+	memcpy(ix->out + ix->olen + sizeof(rec) + l0, d1, l1);
+	memcpy(ix->out + ix->olen + sizeof(rec) + rec.len, zero, DALOG_ALIGN8(rec.len) - rec.len);
+	ix->olen += need;
+}
+
+static void out_rec_magic(idx_s *ix)
+{
+	if (ix->olen + 8 > ix->osize) {
+		ix->osize += 64 * 1024;
+		ix->out = (char*)nmem_realloc(ix->out, ix->osize);
+	}
+	memcpy(ix->out + ix->olen, DALIDX_MAGIC, 8);
+	ix->olen += 8;
+}
+
+static unsigned int name_put(idx_s *ix, char tag, const char *name, int len, unsigned int id)
+{
+	unsigned int i, hash = name_hash(tag, name, len);
+	idxname_s *nm, **old;
+
+	/* Keep the chains short */
+	if (ix->cnt >= ix->size) {
+		old = ix->names;
+		i = ix->size;
+		ix->size = ix->size ? ix->size * 2 : 256;
+		ix->names = nmem_alloz(ix->size, idxname_s*);
+		while (i--)
+			while ((nm = old[i])) {
+				old[i] = nm->next;
+				nm->next = ix->names[nm->hash & (ix->size - 1)];
+				ix->names[nm->hash & (ix->size - 1)] = nm;
+			}
+		nmem_free_s(old);
+	}
+
+	nm = (idxname_s*)nmem_alloc(sizeof(idxname_s) + len + 1, char);
+	nm->hash = hash;
+	nm->id = id;
+	nm->tag = tag;
+	memcpy(nm->name, name, len);
+	nm->name[len] = '\0';
+
+	nm->next = ix->names[hash & (ix->size - 1)];
+	ix->names[hash & (ix->size - 1)] = nm;
+	ix->cnt++;
+	return id;
+}
+
+static unsigned int name_id(idx_s *ix, char tag, const char *name, int len)
+{
+	unsigned int hash = name_hash(tag, name, len);
+	char buf[IDX_NAME_MAX + 1];
+	dalidx_name_s dn;
+	idxname_s *nm;
+
+	if (len > IDX_NAME_MAX)
+		len = IDX_NAME_MAX;
+
+	if (ix->size)
+		for (nm = ix->names[hash & (ix->size - 1)]; nm; nm = nm->next)
+			if (nm->hash == hash && nm->tag == tag && !strncmp(nm->name, name, len) && !nm->name[len])
+				return nm->id;
+
+	memcpy(buf, name, len);
+	buf[len] = '\0';
+
+	dn.id = ix->cnt + 1;
+	dn.tag = tag;
+	out_rec(ix, DALREC_IDXNAME, &dn, sizeof(dn), buf, len + 1);
+	return name_put(ix, tag, name, len, dn.id);
+}
+
+/* Names given by the index left by last run, cut the broken tail */
+static int name_load(idx_s *ix)
+{
+	dalidx_name_s *dn;
+	struct stat st;
+	dalrec_s *rec;
+	char *buf;
+	size_t ofs;
+
+	if (fstat(ix->fd, &st) || st.st_size < 8)
+		return -1;
+
+	buf = nmem_alloc(st.st_size, char);
+	if (pread(ix->fd, buf, st.st_size, 0) != st.st_size || memcmp(buf, DALIDX_MAGIC, 8)) {
+		nmem_free(buf);
+		return -1;
+	}
+
+	for (ofs = 8; ofs + sizeof(dalrec_s) <= (size_t)st.st_size; ofs += sizeof(dalrec_s) + DALOG_ALIGN8(rec->len)) {
+		rec = (dalrec_s*)(buf + ofs);
+		if (DALOG_ALIGN8(rec->len) > st.st_size - ofs - sizeof(dalrec_s))
+			break;
+		if (rec->kind != DALREC_IDXNAME || rec->len <= sizeof(*dn))
+			continue;
+
+		dn = (dalidx_name_s*)(rec + 1);
+		name_put(ix, (char)dn->tag, (char*)(dn + 1), strnlen((char*)(dn + 1), rec->len - sizeof(*dn)), dn->id);
+	}
+	nmem_free(buf);
+
+	if (ofs != (size_t)st.st_size && ftruncate(ix->fd, ofs))
+		printlog("c:%s, e:%s\n", "ftruncate", strerror(errno));
+	return 0;
+}
+
+/*-----------------------------------------------------------------------
+ * Block
+ */
+static void blk_reset(idx_s *ix, long long ofs)
+{
+	memset(&ix->blk, 0, sizeof(ix->blk));
+	ix->blk.ofs = ofs;
+	ix->blk.tmin = ix->blk.tmax = -1;
+	ix->full = 0;
+}
+
+static void blk_close(idx_s *ix)
+{
+	long long end = ix->blk.ofs + ix->blk.len;
+
+	if (!ix->blk.len)
+		return;
+
+	/* Too many keys, must be scanned anyway */
+	if (ix->full) {
+		ix->blk.nid = 0;
+		ix->blk.types = ~0ULL;
+	}
+	out_rec(ix, DALREC_IDXBLK, &ix->blk, sizeof(ix->blk), ix->ids, ix->blk.nid * sizeof(unsigned int));
+	blk_reset(ix, end);
+}
+
+static void blk_key(idx_s *ix, unsigned int id)
+{
+	unsigned int i;
+
+	for (i = 0; i < ix->blk.nid; i++)
+		if (ix->ids[i] == id)
+			return;
+	if (ix->blk.nid < BLK_IDS)
+		ix->ids[ix->blk.nid++] = id;
+	else
+		ix->full = 1;
+}
+
+static void blk_line(idx_s *ix, const char *line, int len)
+{
+	daltext_s tx;
+
+	dalfmt_parse(line, len, &tx);
+
+	/* A new block for the new bucket, or it is full */
+	if (ix->blk.len && (ix->blk.len + len > DALIDX_BLOCK ||
+				(tx.atm >= 0 && ix->blk.tmin >= 0 &&
+				 tx.atm / DALIDX_BUCKET != ix->blk.tmin / DALIDX_BUCKET)))
+		blk_close(ix);
+
+	ix->blk.len += len;
+	ix->blk.types |= 1ULL << (tx.type & 63);
+
+	if (tx.atm >= 0) {
+		if (ix->blk.tmin < 0 || tx.atm < ix->blk.tmin)
+			ix->blk.tmin = tx.atm;
+		if (tx.atm > ix->blk.tmax)
+			ix->blk.tmax = tx.atm;
+	}
+
+	if (tx.prog)
+		blk_key(ix, name_id(ix, 'P', tx.prog, tx.prog_len));
+	if (tx.modu)
+		blk_key(ix, name_id(ix, 'M', tx.modu, tx.modu_len));
+}
+
+/*-----------------------------------------------------------------------
+ * API
+ */
+
+/* Index of path, which is size bytes long now */
+idx_s *daxia_idx_open(const char *path, long long size)
+{
+	idx_s *ix;
+	int len;
+
+	ix = nmem_alloz(1, idx_s);
+	len = strlen(path) + 5;
+	ix->path = nmem_alloc(len, char);
+	snprintf(ix->path, len, "%s.idx", path);
+
+	ix->fd = open(ix->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (ix->fd < 0) {
+		printlog("Open '%s' NG: %s\n", ix->path, strerror(errno));
+		nmem_free(ix->path);
+		nmem_free(ix);
+		return NULL;
+	}
+
+	/* Not an index, start over */
+	if (name_load(ix)) {
+		if (ftruncate(ix->fd, 0))
+			printlog("c:%s, e:%s\n", "ftruncate", strerror(errno));
+		out_rec_magic(ix);
+	}
+
+	blk_reset(ix, size);
+	return ix;
+}
+
+/* buf is written to ofs of the file */
+void daxia_idx_add(idx_s *ix, long long ofs, const char *buf, int len)
+{
+	const char *p = buf, *eol, *end = buf + len;
+
+	/* Something not seen in between, left unindexed */
+	if (ofs != (long long)(ix->blk.ofs + ix->blk.len)) {
+		blk_close(ix);
+		blk_reset(ix, ofs);
+	}
+
+	for (; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end - 1;
+		blk_line(ix, p, eol + 1 - p);
+	}
+}
+
+/* Append the records of the closed blocks */
+void daxia_idx_flush(idx_s *ix)
+{
+	int ofs = 0, n;
+
+	while (ofs < ix->olen) {
+		n = write(ix->fd, ix->out + ofs, ix->olen - ofs);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			printlog("c:%s, e:%s\n", "write", strerror(errno));
+			break;
+		}
+		ofs += n;
+	}
+	ix->olen = 0;
+}
+
+/* Close the last block, and rename it with the file, or remove it if NULL */
+void daxia_idx_close(idx_s *ix, const char *path)
+{
+	idxname_s *nm;
+	char *to;
+	int len;
+	unsigned int i;
+
+	blk_close(ix);
+	daxia_idx_flush(ix);
+	close(ix->fd);
+
+	if (path) {
+		len = strlen(path) + 5;
+		to = nmem_alloc(len, char);
+		snprintf(to, len, "%s.idx", path);
+		if (rename(ix->path, to))
+			printlog("c:%s %s, e:%s\n", "rename", to, strerror(errno));
+		nmem_free(to);
+	} else
+		unlink(ix->path);
+
+	for (i = 0; i < ix->size; i++)
+		while ((nm = ix->names[i])) {
+			ix->names[i] = nm->next;
+			nmem_free(nm);
+		}
+	nmem_free_s(ix->names);
+	nmem_free_s(ix->out);
+	nmem_free(ix->path);
+	nmem_free(ix);
+}
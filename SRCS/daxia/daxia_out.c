@@ -0,0 +1,596 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/*
+ * Output of daxia: group commit, split and rotate.
+ *
+ * The workers and the shm collector only append whole lines to the
+ * pending buffer of a file, the writer thread swap them out and write
+ * each file in one go, when it is big enough or it has waited for
+ * DAXIA_FLUSH_MS. When the disk can not keep up, the producers wait for
+ * room, so the senders are pushed back by TCP instead of eating the
+ * memory of the box.
+ *
+ * DAXIA_SPLIT=addr,prog split the lines by the sender and by the P: tag,
+ * into FILE.<addr>, FILE.<prog> or FILE.<addr>.<prog>. Only the writer
+ * touch the fd, it also rotate the file when it grow to DAXIA_ROTATE_MB
+ * or it crossed DAXIA_ROTATE_SEC, and start DAXIA_COMPRESS on the one
+ * rotated out. With DAXIA_INDEX, it keep FILE.idx along, for dayi.
+ *
+ * The lines are also copied to the subscribers of daxia_sub.c.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <helper.h>
+
+#include "daxia.h"
+
+#define OUT_HIGH        (256 * 1024)
+#define OUT_SIZE        (8 * 1024 * 1024)
+#define DFT_FLUSH_MS    20
+#define DFT_PREALLOC_MB 16
+
+#define OUTF_HASH       1024
+#define OUTF_MAX        4096
+#define PROG_MAX        64
+
+struct _outf_s {
+	outf_s *next;           /* All, only prepended */
+	outf_s *hnext;          /* Same hash */
+	outf_s *dnext;          /* Dirty, pending not empty */
+	outf_s *wnext;          /* Being written */
+
+	char *path;
+	unsigned int hash;
+
+	/* Filled by the producers, under __out_mutex */
+	char *pend;
+	int plen, psize;
+
+	/* Writer only */
+	char *wbuf;
+	int wlen, wsize;
+	int fd;
+	idx_s *idx;
+	long long size;         /* Of the active segment */
+	long long alloc;        /* Preallocated to */
+	time_t opened;
+};
+
+static pthread_mutex_t __out_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __out_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t __out_room = PTHREAD_COND_INITIALIZER;
+
+static const char *__out_file = NULL;
+static int __flush_ms = DFT_FLUSH_MS;
+static int __split = 0;
+
+static long long __rotate_size = 0;
+static int __rotate_sec = 0;
+static long long __prealloc = (long long)DFT_PREALLOC_MB << 20;
+static const char *__compress = NULL;
+static int __index = 0;
+
+static outf_s *__outfs = NULL;
+static outf_s *__outf_main = NULL;
+static outf_s *__outf_hash[OUTF_HASH];
+static int __outf_cnt = 0;
+
+/* Pending bytes of all the files, and the files with them */
+static int __ptotal = 0;
+static outf_s *__dirty = NULL;
+
+/*-----------------------------------------------------------------------
+ * File
+ */
+static unsigned int name_hash(const char *str)
+{
+	unsigned int h = 2166136261u;
+
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619u;
+	return h;
+}
+
+/* Keep the name in the directory of FILE */
+static void name_clean(char *dst, const char *src, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = (src[i] == '/' || src[i] <= ' ' || src[i] > '~') ? '_' : src[i];
+	dst[len] = '\0';
+}
+
+static int outf_open(outf_s *of)
+{
+	struct stat st;
+
+	of->fd = open(of->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (of->fd < 0) {
+		printlog("Open '%s' NG: %s\n", of->path, strerror(errno));
+		return -1;
+	}
+
+	of->size = of->alloc = 0;
+	if (!fstat(of->fd, &st))
+		of->size = of->alloc = st.st_size;
+	of->opened = time(NULL);
+
+	if (__index)
+		of->idx = daxia_idx_open(of->path, of->size);
+	return 0;
+}
+
+/* Ahead of the data, so the file is not fragmented by the small writes */
+static void outf_prealloc(outf_s *of, int len)
+{
+	long long want;
+
+	if (!__prealloc || of->size + len <= of->alloc)
+		return;
+
+	want = of->size + len + __prealloc;
+	if (__rotate_size && want > __rotate_size)
+		want = of->size + len > __rotate_size ? of->size + len : __rotate_size;
+
+	if (fallocate(of->fd, FALLOC_FL_KEEP_SIZE, of->alloc, want - of->alloc)) {
+		/* Not supported by the fs, write as is */
+		of->alloc = 0x7fffffffffffffffLL;
+		return;
+	}
+	of->alloc = want;
+}
+
+/* Suffix added by DAXIA_COMPRESS */
+static const char *compress_ext(void)
+{
+	if (!__compress)
+		return NULL;
+	if (strstr(__compress, "zstd"))
+		return ".zst";
+	if (strstr(__compress, "xz"))
+		return ".xz";
+	if (strstr(__compress, "bzip2"))
+		return ".bz2";
+	return ".gz";
+}
+
+/* Neither the rotated nor the compressed one there */
+static int name_taken(char *path)
+{
+	const char *ext = compress_ext();
+	int len = strlen(path), ret;
+
+	if (!access(path, F_OK))
+		return 1;
+	if (!ext)
+		return 0;
+
+	strcpy(path + len, ext);
+	ret = !access(path, F_OK);
+	path[len] = '\0';
+	return ret;
+}
+
+static void compress_start(const char *path)
+{
+	extern char **environ;
+	char *argv[5];
+	pid_t pid;
+	int err, i = 0;
+
+	argv[i++] = (char*)__compress;
+	argv[i++] = "-q";
+
+	/* Not keep the source, as gzip */
+	if (strstr(__compress, "zstd"))
+		argv[i++] = "--rm";
+	argv[i++] = (char*)path;
+	argv[i] = NULL;
+
+	err = posix_spawnp(&pid, __compress, NULL, NULL, argv, environ);
+	if (err)
+		printlog("c:%s %s, e:%s\n", __compress, path, strerror(err));
+}
+
+static void outf_rotate(outf_s *of)
+{
+	char stamp[32], *path;
+	struct tm tm;
+	time_t now;
+	int i, len;
+
+	/* Nothing in it, keep it for the next period */
+	if (!of->size) {
+		of->opened = time(NULL);
+		return;
+	}
+
+	/* Give back the space preallocated */
+	if (of->alloc > of->size && ftruncate(of->fd, of->size))
+		printlog("c:%s, e:%s\n", "ftruncate", strerror(errno));
+	close(of->fd);
+	of->fd = -1;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+	len = strlen(of->path) + sizeof(stamp) + 24;
+	path = nmem_alloc(len, char);
+	snprintf(path, len, "%s.%s", of->path, stamp);
+	for (i = 1; name_taken(path); i++)
+		snprintf(path, len, "%s.%s.%d", of->path, stamp, i);
+
+	if (rename(of->path, path))
+		printlog("c:%s %s, e:%s\n", "rename", path, strerror(errno));
+	else if (__compress)
+		compress_start(path);
+
+	/* Useless for the compressed one, it can not be seeked */
+	if (of->idx) {
+		daxia_idx_close(of->idx, __compress ? NULL : path);
+		of->idx = NULL;
+	}
+	nmem_free(path);
+
+	outf_open(of);
+}
+
+static int outf_expired(outf_s *of, time_t now)
+{
+	return __rotate_sec && of->fd >= 0 && now / __rotate_sec != of->opened / __rotate_sec;
+}
+
+static void outf_write(outf_s *of, const char *buf, int len)
+{
+	long long start;
+	int ofs = 0, n;
+
+	if (of->fd < 0 && outf_open(of))
+		return;
+
+	if (outf_expired(of, time(NULL)) || (__rotate_size && of->size && of->size + len > __rotate_size))
+		outf_rotate(of);
+	if (of->fd < 0)
+		return;
+
+	outf_prealloc(of, len);
+
+	start = of->size;
+	while (ofs < len) {
+		n = write(of->fd, buf + ofs, len - ofs);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			printlog("c:%s, e:%s\n", "write", strerror(errno));
+			break;
+		}
+		ofs += n;
+	}
+	of->size += ofs;
+
+	if (of->idx) {
+		daxia_idx_add(of->idx, start, buf, ofs);
+		daxia_idx_flush(of->idx);
+	}
+}
+
+/* Under __out_mutex */
+static outf_s *outf_find(const char *path)
+{
+	unsigned int hash = name_hash(path);
+	outf_s *of;
+
+	for (of = __outf_hash[hash % OUTF_HASH]; of; of = of->hnext)
+		if (of->hash == hash && !strcmp(of->path, path))
+			return of;
+
+	/* Too many, share the main one */
+	if (__outf_cnt >= OUTF_MAX && __outf_main)
+		return __outf_main;
+
+	of = nmem_alloz(1, outf_s);
+	of->path = strdup(path);
+	of->hash = hash;
+	of->fd = -1;
+
+	of->hnext = __outf_hash[hash % OUTF_HASH];
+	__outf_hash[hash % OUTF_HASH] = of;
+	of->next = __outfs;
+	natm_store(&__outfs, of);
+	__outf_cnt++;
+	return of;
+}
+
+/*-----------------------------------------------------------------------
+ * Writer
+ */
+
+/* The quiet ones are not rotated by outf_write */
+static void rotate_expired(void)
+{
+	static time_t last = 0;
+	time_t now = time(NULL);
+	outf_s *of;
+
+	if (!__rotate_sec || now == last)
+		return;
+	last = now;
+
+	for (of = natm_load(&__outfs); of; of = of->next)
+		if (outf_expired(of, now))
+			outf_rotate(of);
+}
+
+static void *thread_writer(void *user_data)
+{
+	outf_s *of, *dirty;
+	struct timespec ts;
+	char *buf;
+	int size;
+
+	pthread_mutex_lock(&__out_mutex);
+	for (;;) {
+		while (!__dirty) {
+			if (!__rotate_sec) {
+				pthread_cond_wait(&__out_cond, &__out_mutex);
+				continue;
+			}
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			if (!pthread_cond_timedwait(&__out_cond, &__out_mutex, &ts))
+				continue;
+
+			pthread_mutex_unlock(&__out_mutex);
+			rotate_expired();
+			pthread_mutex_lock(&__out_mutex);
+		}
+
+		/* Give the others a chance to join this write */
+		if (__ptotal < OUT_HIGH) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += __flush_ms * 1000000L;
+			ts.tv_sec += ts.tv_nsec / 1000000000L;
+			ts.tv_nsec %= 1000000000L;
+			while (__ptotal < OUT_HIGH)
+				if (pthread_cond_timedwait(&__out_cond, &__out_mutex, &ts))
+					break;
+		}
+
+		dirty = NULL;
+		for (of = __dirty; of; of = of->dnext) {
+			buf = of->pend;
+			size = of->psize;
+			of->pend = of->wbuf;
+			of->psize = of->wsize;
+			of->wbuf = buf;
+			of->wsize = size;
+			of->wlen = of->plen;
+			of->plen = 0;
+			of->wnext = dirty;
+			dirty = of;
+		}
+		__dirty = NULL;
+		__ptotal = 0;
+		pthread_cond_broadcast(&__out_room);
+		pthread_mutex_unlock(&__out_mutex);
+
+		for (of = dirty; of; of = of->wnext)
+			outf_write(of, of->wbuf, of->wlen);
+		rotate_expired();
+
+		pthread_mutex_lock(&__out_mutex);
+	}
+	return NULL;
+}
+
+/*-----------------------------------------------------------------------
+ * API
+ */
+int daxia_out_open(const char *file)
+{
+	pthread_t thread;
+	char *env;
+
+	__out_file = file;
+
+	env = getenv("DAXIA_FLUSH_MS");
+	if (env)
+		__flush_ms = atoi(env);
+
+	env = getenv("DAXIA_SPLIT");
+	if (env && strstr(env, "addr"))
+		__split |= DAXIA_SPLIT_ADDR;
+	if (env && strstr(env, "prog"))
+		__split |= DAXIA_SPLIT_PROG;
+
+	env = getenv("DAXIA_ROTATE_MB");
+	if (env)
+		__rotate_size = atoll(env) << 20;
+	env = getenv("DAXIA_ROTATE_SEC");
+	if (env)
+		__rotate_sec = atoi(env);
+	env = getenv("DAXIA_PREALLOC_MB");
+	if (env)
+		__prealloc = atoll(env) << 20;
+	__compress = getenv("DAXIA_COMPRESS");
+	__index = !!getenv("DAXIA_INDEX");
+
+	/* The compressors are not waited */
+	if (__compress) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_DFL;
+		sa.sa_flags = SA_NOCLDWAIT;
+		sigaction(SIGCHLD, &sa, 0);
+	}
+
+	/* Fail early if the main one can not be written */
+	__outf_main = outf_find(file);
+	if (outf_open(__outf_main))
+		return -1;
+
+	if (pthread_create(&thread, NULL, thread_writer, NULL)) {
+		printlog("c:%s, e:%s\n", "pthread_create", strerror(errno));
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+int daxia_out_split(void)
+{
+	return __split;
+}
+
+/**
+ * \brief File of the lines from addr with the P: tag prog.
+ *
+ * Either is ignored if DAXIA_SPLIT not ask for it, prog is not '\0'
+ * ended, NULL for the lines without P: tag.
+ */
+outf_s *daxia_out_file(const char *addr, const char *prog, int plen)
+{
+	char *path, pbuf[PROG_MAX + 1];
+	int len;
+	outf_s *of;
+
+	if (!(__split & DAXIA_SPLIT_ADDR))
+		addr = NULL;
+	if (!(__split & DAXIA_SPLIT_PROG))
+		prog = NULL;
+	if (!addr && !(__split & DAXIA_SPLIT_PROG))
+		return __outf_main;
+
+	if (!prog) {
+		prog = "-";
+		plen = 1;
+	}
+	if (plen > PROG_MAX)
+		plen = PROG_MAX;
+	name_clean(pbuf, prog, plen);
+
+	len = strlen(__out_file) + (addr ? strlen(addr) : 0) + plen + 4;
+	path = nmem_alloc(len, char);
+	if (!(__split & DAXIA_SPLIT_PROG))
+		snprintf(path, len, "%s.%s", __out_file, addr);
+	else if (addr)
+		snprintf(path, len, "%s.%s.%s", __out_file, addr, pbuf);
+	else
+		snprintf(path, len, "%s.%s", __out_file, pbuf);
+
+	pthread_mutex_lock(&__out_mutex);
+	of = outf_find(path);
+	pthread_mutex_unlock(&__out_mutex);
+
+	nmem_free(path);
+	return of;
+}
+
+/**
+ * \brief Length of the lines at buf which go to the same file.
+ *
+ * buf is whole lines, the file is returned by *file.
+ */
+int daxia_out_next(const char *addr, const char *buf, int len, outf_s **file)
+{
+	const char *prog, *pp, *p, *eol, *end = buf + len;
+	int plen = 0, n = 0;
+
+	if (!(__split & DAXIA_SPLIT_PROG)) {
+		*file = daxia_out_file(addr, NULL, 0);
+		return len;
+	}
+
+	eol = memchr(buf, '\n', len);
+	if (!eol)
+		eol = end - 1;
+	prog = daxia_line_prog(buf, eol - buf, &plen);
+
+	/* Run of lines of the same program */
+	for (p = eol + 1; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end - 1;
+
+		pp = daxia_line_prog(p, eol - p, &n);
+		if (!pp != !prog || (pp && (n != plen || memcmp(pp, prog, n))))
+			break;
+	}
+
+	*file = daxia_out_file(addr, prog, plen);
+	return p - buf;
+}
+
+/* "|P:xxx|" of the line by dalog */
+const char *daxia_line_prog(const char *line, int len, int *plen)
+{
+	const char *p, *e, *end = line + len;
+
+	p = memmem(line, len, "|P:", 3);
+	if (!p)
+		return NULL;
+	p += 3;
+	e = memchr(p, '|', end - p);
+	if (!e)
+		return NULL;
+
+	*plen = e - p;
+	return p;
+}
+
+/**
+ * \brief Queue whole lines for the writer, wait when it is full.
+ *
+ * A buffer is never split, lines of different sources never mix.
+ */
+void daxia_out_put(outf_s *of, const char *buf, int len)
+{
+	int size, wake;
+
+	if (len <= 0)
+		return;
+	daxia_sub_feed(buf, len);
+
+	pthread_mutex_lock(&__out_mutex);
+	while (__ptotal && __ptotal + len > OUT_SIZE)
+		pthread_cond_wait(&__out_room, &__out_mutex);
+
+	wake = !__dirty;
+	if (!of->plen) {
+		of->dnext = __dirty;
+		__dirty = of;
+	}
+
+	if (of->plen + len > of->psize) {
+		for (size = of->psize ? of->psize : 64 * 1024; size < of->plen + len; size *= 2)
+			;
+		of->pend = (char*)nmem_realloc(of->pend, size);
+		of->psize = size;
+	}
+
+	memcpy(of->pend + of->plen, buf, len);
+	of->plen += len;
+	__ptotal += len;
+	if (wake || __ptotal >= OUT_HIGH)
+		pthread_cond_signal(&__out_cond);
+	pthread_mutex_unlock(&__out_mutex);
+}
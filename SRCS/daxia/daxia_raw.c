@@ -0,0 +1,270 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/*
+ * Raw archive of a tcp connection, DAXIA_SPLICE.
+ *
+ * The stream is moved by splice(), socket to pipe to the file, the bytes
+ * never come up to the user space. Each connection has a file of its
+ * own, FILE.<addr>.<port>, because the stream is not cut at the lines.
+ *
+ * With DAXIA_INDEX, the pipe is tee()'d to another one, which is read to
+ * keep FILE.<addr>.<port>.idx, only the whole lines are indexed.
+ *
+ * Used by the worker of the connection only, no lock.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <helper.h>
+
+#include "daxia.h"
+
+#define RAW_PIPE        (1024 * 1024)
+#define RAW_BUF         (64 * 1024)
+
+struct _raw_s {
+	char *path;
+	int fd;
+	int pipe[2];
+	int chunk;              /* Room of the pipes */
+	int copy;               /* The fs can not splice */
+	long long size;         /* Of the file */
+
+	/* DAXIA_INDEX only */
+	idx_s *idx;
+	int tee[2];
+	long long ofs;          /* Indexed to */
+	char *buf;              /* Not ended by '\n' yet */
+	int len;
+};
+
+/*-----------------------------------------------------------------------
+ * Index
+ */
+static void raw_index(raw_s *raw, int all)
+{
+	char *eol;
+	int n;
+
+	eol = memrchr(raw->buf, '\n', raw->len);
+	if (eol)
+		n = eol - raw->buf + 1;
+	else if (all || raw->len == RAW_BUF)
+		n = raw->len;
+	else
+		return;
+
+	daxia_idx_add(raw->idx, raw->ofs, raw->buf, n);
+	raw->ofs += n;
+	raw->len -= n;
+	memmove(raw->buf, raw->buf + n, raw->len);
+}
+
+/* The copy of len bytes in raw->tee[0] */
+static void raw_tee_read(raw_s *raw, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = read(raw->tee[0], raw->buf + raw->len, RAW_BUF - raw->len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		raw->len += n;
+		len -= n;
+		raw_index(raw, 0);
+	}
+}
+
+/*-----------------------------------------------------------------------
+ * File
+ */
+
+/* The fs can not splice, copy what is in the pipe */
+static int raw_copy(raw_s *raw, int len)
+{
+	char buf[RAW_BUF];
+	int n, ofs, m;
+
+	while (len > 0) {
+		n = read(raw->pipe[0], buf, len < RAW_BUF ? len : RAW_BUF);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+
+		for (ofs = 0; ofs < n; ofs += m) {
+			m = write(raw->fd, buf + ofs, n - ofs);
+			if (m < 0 && errno == EINTR)
+				m = 0;
+			else if (m < 0)
+				return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/* All the len bytes in the pipe to the file */
+static int raw_flush(raw_s *raw, int len)
+{
+	int n;
+
+	while (len > 0) {
+		if (raw->copy)
+			return raw_copy(raw, len);
+
+		n = splice(raw->pipe[0], NULL, raw->fd, NULL, len, SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL) {
+			raw->copy = 1;
+			continue;
+		}
+		if (n <= 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/*-----------------------------------------------------------------------
+ * API
+ */
+
+/* NULL if the file can not be written */
+raw_s *daxia_raw_open(const char *file, const char *addr, int port)
+{
+	struct stat st;
+	raw_s *raw;
+	int len;
+
+	raw = nmem_alloz(1, raw_s);
+	raw->pipe[0] = raw->pipe[1] = raw->tee[0] = raw->tee[1] = -1;
+
+	len = strlen(file) + strlen(addr) + 16;
+	raw->path = nmem_alloc(len, char);
+	snprintf(raw->path, len, "%s.%s.%d", file, addr, port);
+
+	/* splice() refuse O_APPEND, only this one write it anyway */
+	raw->fd = open(raw->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (raw->fd < 0 || lseek(raw->fd, 0, SEEK_END) < 0) {
+		printlog("Open '%s' NG: %s\n", raw->path, strerror(errno));
+		goto fail;
+	}
+
+	if (pipe2(raw->pipe, O_CLOEXEC)) {
+		printlog("c:%s, e:%s\n", "pipe2", strerror(errno));
+		goto fail;
+	}
+
+	/* Fewer rounds, not a must */
+	fcntl(raw->pipe[1], F_SETPIPE_SZ, RAW_PIPE);
+	raw->chunk = fcntl(raw->pipe[1], F_GETPIPE_SZ);
+	if (!fstat(raw->fd, &st))
+		raw->size = st.st_size;
+
+	if (getenv("DAXIA_INDEX")) {
+		if (pipe2(raw->tee, O_CLOEXEC | O_NONBLOCK)) {
+			printlog("c:%s, e:%s\n", "pipe2", strerror(errno));
+			goto fail;
+		}
+		fcntl(raw->tee[1], F_SETPIPE_SZ, RAW_PIPE);
+		len = fcntl(raw->tee[1], F_GETPIPE_SZ);
+		if (len < raw->chunk)
+			raw->chunk = len;
+
+		raw->ofs = raw->size;
+		raw->idx = daxia_idx_open(raw->path, raw->ofs);
+		raw->buf = nmem_alloc(RAW_BUF, char);
+	}
+	return raw;
+
+fail:
+	daxia_raw_close(raw);
+	return NULL;
+}
+
+/**
+ * \brief Move what the socket has to the file, until EAGAIN.
+ *
+ * Return -1 if the connection is closed or broken.
+ */
+int daxia_raw_read(raw_s *raw, int s)
+{
+	int n, m, ret = 0;
+
+	for (;;) {
+		n = splice(s, NULL, raw->pipe[1], NULL, raw->chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0) {
+			if (n < 0)
+				printlog("c:%s, e:%s\n", "splice", strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		/* Both pipes are empty here, the tee take all of it */
+		if (raw->idx) {
+			m = tee(raw->pipe[0], raw->tee[1], n, 0);
+			if (m > 0)
+				raw_tee_read(raw, m);
+
+			/* Or left unindexed, as a gap */
+			if (m != n) {
+				raw->len = 0;
+				raw->ofs = raw->size + n;
+			}
+		}
+
+		raw->size += n;
+		if (raw_flush(raw, n)) {
+			printlog("c:%s %s, e:%s\n", "splice", raw->path, strerror(errno));
+			ret = -1;
+			break;
+		}
+	}
+
+	if (raw->idx)
+		daxia_idx_flush(raw->idx);
+	return ret;
+}
+
+void daxia_raw_close(raw_s *raw)
+{
+	if (raw->idx) {
+		if (raw->len)
+			raw_index(raw, 1);
+		daxia_idx_close(raw->idx, raw->path);
+	}
+
+	if (raw->fd >= 0)
+		close(raw->fd);
+	if (raw->pipe[0] >= 0) {
+		close(raw->pipe[0]);
+		close(raw->pipe[1]);
+	}
+	if (raw->tee[0] >= 0) {
+		close(raw->tee[0]);
+		close(raw->tee[1]);
+	}
+
+	nmem_free_s(raw->buf);
+	nmem_free(raw->path);
+	nmem_free(raw);
+}
@@ -0,0 +1,562 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/*
+ * Collector of DALOG_TO_SHM: drain /dev/shm/dalog.<pid> of every process
+ * on the box, render the binary records, and append them to the file.
+ *
+ * A ring is removed when its process is gone and nothing left in it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <helper.h>
+#include <dalog.h>
+#include <dalog_fmt.h>
+#include <dalog_setup.h>
+
+#include "daxia.h"
+
+#define SHM_DIR         "/dev/shm"
+#define SCAN_MS         1000
+
+/* Max sleep when idle, 1 << N ms */
+#define MAX_IDLE_SHIFT  4
+
+typedef struct _strent_s strent_s;
+struct _strent_s {
+	unsigned long long id;
+	char *str;
+};
+
+typedef struct _shmsrc_s shmsrc_s;
+struct _shmsrc_s {
+	shmsrc_s *next;
+
+	char name[32];
+	ino_t ino;
+	int seen;               /* Still in SHM_DIR at last scan */
+
+	dalshm_s *shm;
+	char *data;
+	size_t len;
+	unsigned int drops;
+
+	int pid;
+	int gmtoff;
+
+	/* DALREC_STR, copied, the ring space is reused */
+	unsigned int size, cnt;
+	strent_s *ents;
+};
+
+static shmsrc_s *__srcs = NULL;
+
+/* Scratch for a record wrapped around the end of ring */
+static char *__rec_buf = NULL;
+static unsigned int __rec_size = 0;
+
+static char *__out = NULL;
+static int __olen = 0, __osize = 0;
+
+/*-----------------------------------------------------------------------
+ * String table
+ */
+static unsigned int str_hash(unsigned long long id)
+{
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+	return (unsigned int)id;
+}
+
+static strent_s *str_find(shmsrc_s *src, unsigned long long id)
+{
+	unsigned int i;
+
+	if (!src->size)
+		return NULL;
+
+	for (i = str_hash(id) & (src->size - 1); src->ents[i].id; i = (i + 1) & (src->size - 1))
+		if (src->ents[i].id == id)
+			return &src->ents[i];
+	return NULL;
+}
+
+static void str_put(shmsrc_s *src, unsigned long long id, char *str)
+{
+	strent_s *old = src->ents;
+	unsigned int i, oldsize = src->size;
+
+	if ((src->cnt + 1) * 2 > src->size) {
+		src->size = src->size ? src->size * 2 : 1024;
+		src->ents = nmem_alloz(src->size, strent_s);
+		src->cnt = 0;
+
+		for (i = 0; i < oldsize; i++)
+			if (old[i].id)
+				str_put(src, old[i].id, old[i].str);
+		nmem_free_s(old);
+	}
+
+	for (i = str_hash(id) & (src->size - 1); src->ents[i].id; i = (i + 1) & (src->size - 1))
+		;
+	src->ents[i].id = id;
+	src->ents[i].str = str;
+	src->cnt++;
+}
+
+static void str_add(shmsrc_s *src, unsigned long long id, const char *str, int len)
+{
+	strent_s *ent;
+	char *dup;
+
+	dup = nmem_alloc(len + 1, char);
+	memcpy(dup, str, len);
+	dup[len] = '\0';
+
+	/* Address reused by dlopen, the new one wins */
+	ent = str_find(src, id);
+	if (ent) {
+		nmem_free(ent->str);
+		ent->str = dup;
+		return;
+	}
+	str_put(src, id, dup);
+}
+
+static void str_clear(shmsrc_s *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < src->size; i++)
+		nmem_free_s(src->ents[i].str);
+	nmem_free_sz(src->ents);
+	src->size = src->cnt = 0;
+}
+
+static const char *name_of(shmsrc_s *src, unsigned long long id)
+{
+	strent_s *ent;
+
+	if (!id)
+		return NULL;
+	ent = str_find(src, id);
+	return ent ? ent->str : "?";
+}
+
+/*-----------------------------------------------------------------------
+ * Render
+ */
+static void out_reserve(int len)
+{
+	if (__olen + len <= __osize)
+		return;
+
+	while (__olen + len > __osize)
+		__osize = __osize ? __osize * 2 : 256 * 1024;
+	__out = (char*)nmem_realloc(__out, __osize);
+}
+
+static void out_flush(void)
+{
+	outf_s *of;
+	int ofs, n;
+
+	/* The rings are all of this box */
+	for (ofs = 0; ofs < __olen; ofs += n) {
+		n = daxia_out_next("local", __out + ofs, __olen - ofs, &of);
+		daxia_out_put(of, __out + ofs, n);
+	}
+	__olen = 0;
+}
+
+/* Same as logger_file of dalog_setup.c */
+static void out_eol(void)
+{
+	out_reserve(1);
+	if (!__olen || __out[__olen - 1] != '\n')
+		__out[__olen++] = '\n';
+}
+
+static void render_text(const char *text, int len)
+{
+	len = strnlen(text, len);
+	out_reserve(len + 1);
+	memcpy(__out + __olen, text, len);
+	__olen += len;
+	out_eol();
+}
+
+static void render_bin(shmsrc_s *src, dalbin_s *bin, int len)
+{
+	static time_t tmsec = -1;
+	static char tmbuf[64];
+	const char *fmt, *args;
+	int ofs, ret, room;
+	dalhead_s hd;
+	struct tm tm;
+	time_t t;
+	char *p;
+
+	fmt = name_of(src, bin->fmt);
+	if (!fmt)
+		return;
+	args = (const char*)(bin + 1);
+	len -= sizeof(dalbin_s);
+
+	hd.type = bin->type;
+	hd.mask = bin->mask;
+	hd.pid = src->pid;
+	hd.tid = bin->tid;
+	hd.rtm = (unsigned long)(bin->rtm / 1000000);
+	hd.ntm = bin->rtm;
+	hd.atm = tmbuf;
+	hd.atm_ms = (unsigned int)(bin->atm / 1000000 % 1000);
+	hd.prog = name_of(src, bin->prog);
+	hd.modu = name_of(src, bin->modu);
+	hd.file = name_of(src, bin->file);
+	hd.func = name_of(src, bin->func);
+	hd.line = bin->line;
+
+	if (hd.mask & DALOG_ATM) {
+		t = (time_t)(bin->atm / 1000000000) + src->gmtoff;
+		if (t != tmsec) {
+			gmtime_r(&t, &tm);
+			strftime(tmbuf, sizeof(tmbuf), "%Y/%m/%d %H:%M:%S", &tm);
+			tmsec = t;
+		}
+	}
+
+	room = 256;
+	if (hd.prog)
+		room += strlen(hd.prog);
+	if (hd.modu)
+		room += strlen(hd.modu);
+	if (hd.file)
+		room += strlen(hd.file);
+	if (hd.func)
+		room += strlen(hd.func);
+	out_reserve(room + 1024);
+
+	p = __out + __olen;
+	ofs = dalfmt_head(p, &hd);
+	room = __osize - __olen - ofs;
+
+	ret = dalfmt_render(p + ofs, room, fmt, args, len);
+	if (ret < 0)
+		return;
+	if (ret > room - 1) {
+		out_reserve(ofs + ret + 1);
+		p = __out + __olen;
+		dalfmt_render(p + ofs, ret + 1, fmt, args, len);
+	}
+	__olen += ofs + ret;
+	out_eol();
+}
+
+/*-----------------------------------------------------------------------
+ * Ring
+ */
+
+/* Copy len bytes at pos, return a pointer to them, maybe in the ring */
+static char *ring_peek(shmsrc_s *src, unsigned int pos, unsigned int len)
+{
+	unsigned int size = src->shm->size, ofs, n;
+
+	ofs = pos & (size - 1);
+	if (ofs + len <= size)
+		return src->data + ofs;
+
+	if (__rec_size < len) {
+		__rec_size = len;
+		__rec_buf = (char*)nmem_realloc(__rec_buf, __rec_size);
+	}
+	n = size - ofs;
+	memcpy(__rec_buf, src->data + ofs, n);
+	memcpy(__rec_buf + n, src->data, len - n);
+	return __rec_buf;
+}
+
+static void handle_rec(shmsrc_s *src, dalrec_s *rec)
+{
+	dalbin_head_s *bh;
+	unsigned long long id;
+	char *dat = (char*)(rec + 1);
+	unsigned int len = rec->len;
+	unsigned short kind = rec->kind;
+
+	/* One ring one pid, that of HEAD */
+	if (kind & DALREC_PID) {
+		if (len < 8)
+			return;
+		kind &= ~DALREC_PID;
+		dat += 8;
+		len -= 8;
+	}
+
+	switch (kind) {
+	case DALREC_HEAD:
+		bh = (dalbin_head_s*)dat;
+		if (len >= sizeof(*bh)) {
+			src->pid = bh->pid;
+			src->gmtoff = bh->gmtoff;
+		}
+		break;
+
+	case DALREC_STR:
+		if (len > 8) {
+			memcpy(&id, dat, 8);
+			str_add(src, id, dat + 8, len - 8);
+		}
+		break;
+
+	case DALREC_BIN:
+		if (len >= sizeof(dalbin_s))
+			render_bin(src, (dalbin_s*)dat, len);
+		break;
+
+	case DALREC_TEXT:
+		render_text(dat, len);
+		break;
+	}
+}
+
+/* Return the count of records */
+static int src_drain(shmsrc_s *src)
+{
+	unsigned int head, tail, drops, need, avail;
+	dalrec_s *rec;
+	char *p;
+	int cnt = 0;
+
+	tail = src->shm->tail;
+	head = natm_load(&src->shm->head);
+
+	while (tail != head) {
+		avail = head - tail;
+		if (avail < sizeof(dalrec_s))
+			goto bad;
+
+		/* Stream restart */
+		p = ring_peek(src, tail, 8);
+		if (!memcmp(p, DALBIN_MAGIC, 8)) {
+			str_clear(src);
+			tail += 8;
+			continue;
+		}
+
+		rec = (dalrec_s*)p;
+		need = DALOG_ALIGN8(sizeof(dalrec_s) + rec->len);
+		if (rec->len > src->shm->size || need > avail)
+			goto bad;
+
+		handle_rec(src, (dalrec_s*)ring_peek(src, tail, need));
+		tail += need;
+		cnt++;
+	}
+
+	drops = natm_load(&src->shm->drops);
+	if (drops != src->drops) {
+		out_reserve(128);
+		__olen += sprintf(__out + __olen, "|!| daxia: %u records dropped by pid %d, shm ring full\n",
+				drops - src->drops, src->pid);
+		src->drops = drops;
+	}
+
+	natm_store(&src->shm->tail, tail);
+	return cnt;
+
+bad:
+	/* Not possible unless the ring is trashed, skip all of it */
+	printlog("Bad record in %s, %u bytes skipped\n", src->name, head - tail);
+	natm_store(&src->shm->tail, head);
+	return cnt;
+}
+
+/*-----------------------------------------------------------------------
+ * Source
+ */
+static shmsrc_s *src_open(const char *name, ino_t ino)
+{
+	dalshm_s *shm;
+	shmsrc_s *src;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < DALSHM_DATA) {
+		close(fd);
+		return NULL;
+	}
+
+	shm = (dalshm_s*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	/* Not ready yet, try it next scan */
+	if (natm_load(&shm->magic) != DALSHM_MAGIC ||
+			!shm->size || shm->size > DALSHM_MAX || (shm->size & (shm->size - 1)) ||
+			DALSHM_DATA + (off_t)shm->size > st.st_size) {
+		munmap(shm, st.st_size);
+		return NULL;
+	}
+
+	src = nmem_alloz(1, shmsrc_s);
+	snprintf(src->name, sizeof(src->name), "%s", name);
+	src->ino = ino;
+	src->shm = shm;
+	src->data = (char*)shm + DALSHM_DATA;
+	src->len = st.st_size;
+	src->pid = shm->pid;
+
+	printlog("New shm ring, name:%s, pid:%d, size:%u\n", name, shm->pid, shm->size);
+	return src;
+}
+
+static void src_close(shmsrc_s *src, int unlink)
+{
+	if (unlink)
+		shm_unlink(src->name);
+	munmap(src->shm, src->len);
+	str_clear(src);
+	nmem_free(src);
+}
+
+static int is_shm_name(const char *name)
+{
+	if (strncmp(name, "dalog.", 6) || !name[6])
+		return 0;
+	for (name += 6; *name; name++)
+		if (!isdigit((unsigned char)*name))
+			return 0;
+	return 1;
+}
+
+static void scan(void)
+{
+	struct dirent *de;
+	shmsrc_s *src;
+	char name[32];
+	DIR *dir;
+
+	dir = opendir(SHM_DIR);
+	if (!dir)
+		return;
+
+	for (src = __srcs; src; src = src->next)
+		src->seen = 0;
+
+	while ((de = readdir(dir))) {
+		if (!is_shm_name(de->d_name) || strlen(de->d_name) >= sizeof(name) - 1)
+			continue;
+
+		for (src = __srcs; src; src = src->next)
+			if (src->ino == de->d_ino && !strcmp(src->name + 1, de->d_name))
+				break;
+		if (src) {
+			src->seen = 1;
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "/%s", de->d_name);
+		src = src_open(name, de->d_ino);
+		if (src) {
+			src->seen = 1;
+			src->next = __srcs;
+			__srcs = src;
+		}
+	}
+	closedir(dir);
+}
+
+/* Empty, and the process is gone or the ring removed */
+static void reap(void)
+{
+	shmsrc_s **pp = &__srcs, *src;
+	int gone;
+
+	while ((src = *pp)) {
+		gone = (kill(src->shm->pid, 0) && errno == ESRCH) || !src->seen;
+		if (!gone || natm_load(&src->shm->head) != src->shm->tail) {
+			pp = &src->next;
+			continue;
+		}
+
+		printlog("Shm ring done, name:%s, pid:%d\n", src->name, src->shm->pid);
+		*pp = src->next;
+		src_close(src, src->seen);
+	}
+}
+
+static void *thread_shm(void *user_data)
+{
+	unsigned int idle = 0;
+	struct timespec ts;
+	long long now, scan_at = 0;
+	shmsrc_s *src;
+	int cnt;
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+		if (now >= scan_at) {
+			scan();
+			reap();
+			scan_at = now + SCAN_MS;
+		}
+
+		cnt = 0;
+		for (src = __srcs; src; src = src->next)
+			cnt += src_drain(src);
+
+		/* All the rings in one go */
+		if (__olen)
+			out_flush();
+
+		if (cnt) {
+			idle = 0;
+			continue;
+		}
+
+		usleep(1000 << idle);
+		if (idle < MAX_IDLE_SHIFT)
+			idle++;
+	}
+	return NULL;
+}
+
+/*-----------------------------------------------------------------------
+ * API
+ */
+int daxia_shm_start(void)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, thread_shm, NULL)) {
+		printlog("c:%s, e:%s\n", "pthread_create", strerror(errno));
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
@@ -0,0 +1,654 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/*
+ * Live tail of daxia, for the subscribers of DAXIA_SUB_PORT and
+ * DAXIA_SUB_UNIX.
+ *
+ * A subscriber connect and send its rules, one per line, as dr build
+ * them:
+ *
+ *      prog=xxx,modu=xxx,file=xxx,func=xxx,line=xxx,mask=xxx
+ *
+ * The rules are applied in order as dalog does, from nothing, so only
+ * the levels set by them are sent. "dr --tail=<to> ..." does all this.
+ * The subscriber keeps its side open, once shut, even the write half
+ * only, the tail ends.
+ *
+ * The producers only copy the lines to the queue of this thread, which
+ * filter them for each subscriber. A subscriber too slow lose the lines
+ * instead of holding the others, it is told how many are lost.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <helper.h>
+#include <dalog.h>
+#include <dalog_fmt.h>
+
+#include "daxia.h"
+
+#define SUB_IN_MAX      (8 * 1024 * 1024)
+#define SUB_OUT_MAX     (1024 * 1024)
+#define SUB_RULE_LEN    1024
+#define EPOLL_MAX       64
+
+#define SUB_LISTEN      0
+#define SUB_WAKE        1
+#define SUB_PEER        2
+
+typedef struct _subrule_s subrule_s;
+struct _subrule_s {
+	char *prog;
+	char *modu;
+	char *file;
+	char *func;
+	int line;
+
+	unsigned int set, clr;
+};
+
+typedef struct _sub_s sub_s;
+struct _sub_s {
+	sub_s *next;
+	int kind;
+	int fd;
+	int dead;               /* Freed after the events in hand */
+	char addr[64];
+
+	subrule_s *rules;
+	int cnt, size;
+
+	/* Rule line not ended yet */
+	char in[SUB_RULE_LEN];
+	int ilen;
+
+	/* Not sent yet, and lost since last sent */
+	char *out;
+	int olen, osize;
+	unsigned int drops;
+};
+
+static pthread_mutex_t __sub_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int __sub_wake = -1;
+static int __sub_epoll = -1;
+static int __sub_cnt = 0;
+
+/* Filled by daxia_sub_feed, under __sub_mutex */
+static char *__sub_in = NULL;
+static int __sub_ilen = 0, __sub_isize = 0;
+static unsigned int __sub_lost = 0;
+
+static sub_s *__subs = NULL;
+
+/*-----------------------------------------------------------------------
+ * Rule
+ */
+
+/* Level of the line type of dalfmt_head */
+static unsigned int type_level(unsigned char type)
+{
+	switch (type) {
+	case 'F':
+		return DALOG_FATAL;
+	case 'A':
+		return DALOG_ALERT;
+	case 'C':
+		return DALOG_CRIT;
+	case 'E':
+		return DALOG_ERR;
+	case 'W':
+		return DALOG_WARNING;
+	case 'N':
+		return DALOG_NOTICE;
+	case 'I':
+	case 'L':
+		return DALOG_INFO;
+	case 'D':
+	case 'T':
+		return DALOG_DEBUG;
+	}
+	return 0;
+}
+
+/* Only the levels of the mask letters of dalog mean something here */
+static unsigned int mask_level(char c)
+{
+	static const char *codes = "0f1a2c3e4w5n6i7d";
+	const char *p;
+
+	if (c == 'l')
+		c = 'i';
+	else if (c == 't')
+		c = 'd';
+
+	p = c ? strchr(codes, c) : NULL;
+	return p ? 1u << ((p - codes) / 2) : 0;
+}
+
+/* ",key=" is cut at the next ',' by rule_add */
+static char *rule_field(char *p)
+{
+	if (!p || !p[6])
+		return NULL;
+	return strdup(p + 6);
+}
+
+/* Parsed as dalog_rule_add */
+static void rule_add(sub_s *s, char *rule)
+{
+	char buf[SUB_RULE_LEN + 2], *mask, *line, *prog, *modu, *file, *func;
+	subrule_s *r;
+	int i, blen;
+
+	if (!rule[0] || rule[0] == '#')
+		return;
+
+	buf[0] = ',';
+	strncpy(buf + 1, rule, sizeof(buf) - 2);
+	buf[sizeof(buf) - 1] = '\0';
+
+	mask = strstr(buf, ",mask=");
+	if (!mask || !mask[6])
+		return;
+	mask += 6;
+
+	prog = strstr(buf, ",prog=");
+	modu = strstr(buf, ",modu=");
+	file = strstr(buf, ",file=");
+	func = strstr(buf, ",func=");
+	line = strstr(buf, ",line=");
+
+	blen = strlen(buf);
+	for (i = 0; i < blen; i++)
+		if (buf[i] == ',')
+			buf[i] = '\0';
+
+	if (s->cnt >= s->size) {
+		s->size += 8;
+		s->rules = (subrule_s*)nmem_realloc(s->rules, s->size * sizeof(subrule_s));
+	}
+	r = &s->rules[s->cnt];
+	memset(r, 0, sizeof(*r));
+
+	for (i = 0; mask[i]; i++)
+		if (mask[i] == '-')
+			r->clr |= mask_level(mask[++i]);
+		else
+			r->set |= mask_level(mask[i]);
+	if (!r->set && !r->clr)
+		return;
+
+	r->prog = rule_field(prog);
+	r->modu = rule_field(modu);
+	r->file = rule_field(file);
+	r->func = rule_field(func);
+	r->line = line && line[6] ? atoi(line + 6) : -1;
+	s->cnt++;
+
+	printlog("Subscriber %s, rule:%s\n", s->addr, rule);
+}
+
+static int name_is(const char *name, const char *str, int len)
+{
+	return len == (int)strlen(name) && !memcmp(name, str, len);
+}
+
+/* "file=xxx.c" take the F: with a directory too */
+static int file_is(const char *name, const char *str, int len)
+{
+	const char *base;
+
+	if (name_is(name, str, len))
+		return 1;
+	base = memrchr(str, '/', len);
+	return base && name_is(name, base + 1, str + len - base - 1);
+}
+
+static int rule_match(subrule_s *r, daltext_s *tx)
+{
+	if (r->prog && !(tx->prog && name_is(r->prog, tx->prog, tx->prog_len)))
+		return 0;
+	if (r->modu && !(tx->modu && name_is(r->modu, tx->modu, tx->modu_len)))
+		return 0;
+	if (r->file && !(tx->file && file_is(r->file, tx->file, tx->file_len)))
+		return 0;
+	if (r->func && !(tx->func && name_is(r->func, tx->func, tx->func_len)))
+		return 0;
+	if (r->line >= 0 && r->line != tx->line)
+		return 0;
+	return 1;
+}
+
+/* The lines not made by dalog pass when any level is taken */
+static int sub_pass(sub_s *s, daltext_s *tx)
+{
+	unsigned int mask = 0, level = type_level(tx->type);
+	int i;
+
+	for (i = 0; i < s->cnt; i++)
+		if (rule_match(&s->rules[i], tx))
+			mask = (mask | s->rules[i].set) & ~s->rules[i].clr;
+
+	return level ? !!(mask & level) : !!mask;
+}
+
+/*-----------------------------------------------------------------------
+ * Subscriber
+ */
+static void sub_put(sub_s *s, const char *buf, int len)
+{
+	int size;
+
+	if (s->olen + len > s->osize) {
+		for (size = s->osize ? s->osize : 64 * 1024; size < s->olen + len; size *= 2)
+			;
+		s->out = (char*)nmem_realloc(s->out, size);
+		s->osize = size;
+	}
+	memcpy(s->out + s->olen, buf, len);
+	s->olen += len;
+}
+
+static void sub_queue(sub_s *s, const char *line, int len)
+{
+	char note[80];
+	int n;
+
+	if (s->olen + len > SUB_OUT_MAX) {
+		s->drops++;
+		return;
+	}
+
+	if (s->drops) {
+		n = sprintf(note, "|!| daxia: %u lines dropped\n", s->drops);
+		sub_put(s, note, n);
+		s->drops = 0;
+	}
+	sub_put(s, line, len);
+}
+
+static void sub_free(sub_s *s)
+{
+	int i;
+
+	close(s->fd);
+	for (i = 0; i < s->cnt; i++) {
+		nmem_free_s(s->rules[i].prog);
+		nmem_free_s(s->rules[i].modu);
+		nmem_free_s(s->rules[i].file);
+		nmem_free_s(s->rules[i].func);
+	}
+	nmem_free_s(s->rules);
+	nmem_free_s(s->out);
+	nmem_free(s);
+}
+
+static void sub_close(sub_s *s)
+{
+	if (s->dead)
+		return;
+	s->dead = 1;
+	natm_add(&__sub_cnt, -1);
+	printlog("Subscriber %s gone\n", s->addr);
+}
+
+static void sub_reap(void)
+{
+	sub_s **pp, *s;
+
+	for (pp = &__subs; (s = *pp); )
+		if (s->dead) {
+			*pp = s->next;
+			sub_free(s);
+		} else
+			pp = &s->next;
+}
+
+/* Return -1 if it is gone */
+static int sub_send(sub_s *s)
+{
+	int ofs = 0, n;
+
+	while (ofs < s->olen) {
+		n = send(s->fd, s->out + ofs, s->olen - ofs, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		ofs += n;
+	}
+
+	memmove(s->out, s->out + ofs, s->olen - ofs);
+	s->olen -= ofs;
+	return 0;
+}
+
+/* Return -1 if it is gone */
+static int sub_read(sub_s *s)
+{
+	char buf[4096];
+	int i, n;
+
+	for (;;) {
+		n = recv(s->fd, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		/*
+		 * Closed, or the write half only: dr never does, and a peer
+		 * gone without a word is never known if nothing is sent to it
+		 */
+		if (!n)
+			return -1;
+
+		for (i = 0; i < n; i++) {
+			if (buf[i] == '\n' || buf[i] == '\r') {
+				s->in[s->ilen] = '\0';
+				rule_add(s, s->in);
+				s->ilen = 0;
+			} else if (s->ilen < SUB_RULE_LEN - 1)
+				s->in[s->ilen++] = buf[i];
+		}
+	}
+}
+
+static void sub_accept(sub_s *ls)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in*)&ss;
+	struct epoll_event ev;
+	socklen_t slen = sizeof(ss);
+	sub_s *s;
+	int fd;
+
+	for (;;) {
+		fd = accept4(ls->fd, (struct sockaddr*)&ss, &slen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				printlog("c:%s, e:%s\n", "accept", strerror(errno));
+			return;
+		}
+
+		s = nmem_alloz(1, sub_s);
+		s->kind = SUB_PEER;
+		s->fd = fd;
+		if (ss.ss_family == AF_INET)
+			sprintf(s->addr, "%s:%d", inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+		else
+			sprintf(s->addr, "unix:%d", fd);
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = s;
+		if (epoll_ctl(__sub_epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			printlog("c:%s, e:%s\n", "epoll_ctl", strerror(errno));
+			close(fd);
+			nmem_free(s);
+			continue;
+		}
+
+		s->next = __subs;
+		__subs = s;
+		natm_add(&__sub_cnt, 1);
+		printlog("New subscriber, addr:%s, fd:%d\n", s->addr, fd);
+		slen = sizeof(ss);
+	}
+}
+
+/*-----------------------------------------------------------------------
+ * Thread
+ */
+
+/* Filter the lines queued by the producers */
+static void sub_lines(char *buf, int len)
+{
+	const char *p, *eol, *end = buf + len;
+	unsigned int lost;
+	daltext_s tx;
+	sub_s *s;
+
+	pthread_mutex_lock(&__sub_mutex);
+	lost = __sub_lost;
+	__sub_lost = 0;
+	pthread_mutex_unlock(&__sub_mutex);
+
+	for (s = __subs; s; s = s->next)
+		s->drops += lost;
+
+	for (p = buf; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end - 1;
+
+		dalfmt_parse(p, eol + 1 - p, &tx);
+		for (s = __subs; s; s = s->next)
+			if (s->cnt && !s->dead && sub_pass(s, &tx))
+				sub_queue(s, p, eol + 1 - p);
+	}
+
+	for (s = __subs; s; s = s->next)
+		if (!s->dead && s->olen && sub_send(s))
+			sub_close(s);
+}
+
+static void *thread_sub(void *user_data)
+{
+	struct epoll_event events[EPOLL_MAX];
+	char *buf = NULL, *tmp;
+	int i, n, len, size = 0, tsize;
+	unsigned long long cnt;
+	sub_s *s;
+
+	for (;;) {
+		n = epoll_wait(__sub_epoll, events, EPOLL_MAX, -1);
+		if (n < 0) {
+			if (errno != EINTR)
+				printlog("c:%s, e:%s\n", "epoll_wait", strerror(errno));
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			s = (sub_s*)events[i].data.ptr;
+
+			if (s->kind == SUB_LISTEN) {
+				sub_accept(s);
+				continue;
+			}
+
+			if (s->kind == SUB_WAKE) {
+				if (read(__sub_wake, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+					printlog("c:%s, e:%s\n", "read", strerror(errno));
+
+				/* Take all, the producers go on with the empty one */
+				pthread_mutex_lock(&__sub_mutex);
+				len = __sub_ilen;
+				tmp = __sub_in;
+				__sub_in = buf;
+				buf = tmp;
+				tsize = __sub_isize;
+				__sub_isize = size;
+				size = tsize;
+				__sub_ilen = 0;
+				pthread_mutex_unlock(&__sub_mutex);
+
+				if (len)
+					sub_lines(buf, len);
+				continue;
+			}
+
+			if (s->dead)
+				continue;
+			if ((events[i].events & (EPOLLHUP | EPOLLERR)) ||
+					((events[i].events & (EPOLLIN | EPOLLRDHUP)) && sub_read(s))) {
+				sub_close(s);
+				continue;
+			}
+			if ((events[i].events & EPOLLOUT) && s->olen && sub_send(s))
+				sub_close(s);
+		}
+		sub_reap();
+	}
+	return NULL;
+}
+
+static int add_fd(int fd, int kind)
+{
+	struct epoll_event ev;
+	sub_s *s;
+
+	if (fd < 0)
+		return -1;
+
+	s = nmem_alloz(1, sub_s);
+	s->kind = kind;
+	s->fd = fd;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	if (epoll_ctl(__sub_epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		printlog("c:%s, e:%s\n", "epoll_ctl", strerror(errno));
+		nmem_free(s);
+		return -1;
+	}
+	return 0;
+}
+
+static int open_tcp(unsigned short port)
+{
+	struct sockaddr_in my_addr;
+	int s, yes = 1;
+
+	if ((s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		printlog("c:%s, e:%s\n", "socket", strerror(errno));
+		return -1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+	memset(&my_addr, 0, sizeof(my_addr));
+	my_addr.sin_family = AF_INET;
+	my_addr.sin_port = htons(port);
+	my_addr.sin_addr.s_addr = INADDR_ANY;
+	if (bind(s, (struct sockaddr *) &my_addr, sizeof(my_addr)) == -1 || listen(s, 16) == -1) {
+		printlog("c:%s, e:%s\n", "bind sub", strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/* "@name" is in the abstract namespace */
+static int open_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	socklen_t slen;
+	int s;
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		printlog("c:%s, e:%s\n", "socket", strerror(errno));
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	slen = offsetof(struct sockaddr_un, sun_path) + strlen(sun.sun_path);
+	if (sun.sun_path[0] == '@')
+		sun.sun_path[0] = '\0';
+	else
+		unlink(path);
+
+	if (bind(s, (struct sockaddr *) &sun, slen) == -1 || listen(s, 16) == -1) {
+		printlog("c:%s, e:%s\n", "bind sub unix", strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*-----------------------------------------------------------------------
+ * API
+ */
+
+/* Listen on port if not 0, and on upath if not NULL */
+int daxia_sub_start(unsigned short port, const char *upath)
+{
+	pthread_t thread;
+	int got = 0;
+
+	__sub_epoll = epoll_create1(EPOLL_CLOEXEC);
+	__sub_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (__sub_epoll < 0 || __sub_wake < 0 || add_fd(__sub_wake, SUB_WAKE)) {
+		printlog("c:%s, e:%s\n", "eventfd", strerror(errno));
+		return -1;
+	}
+
+	if (port && !add_fd(open_tcp(port), SUB_LISTEN))
+		got++;
+	if (upath && !add_fd(open_unix(upath), SUB_LISTEN))
+		got++;
+	if (!got)
+		return -1;
+
+	if (pthread_create(&thread, NULL, thread_sub, NULL)) {
+		printlog("c:%s, e:%s\n", "pthread_create", strerror(errno));
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/* Whole lines, also go to the file. Cheap if no one subscribe */
+void daxia_sub_feed(const char *buf, int len)
+{
+	unsigned long long one = 1;
+	int i, size, wake;
+
+	if (!natm_load(&__sub_cnt) || len <= 0)
+		return;
+
+	pthread_mutex_lock(&__sub_mutex);
+	if (__sub_ilen + len > SUB_IN_MAX) {
+		for (i = 0; i < len; i++)
+			if (buf[i] == '\n')
+				__sub_lost++;
+		pthread_mutex_unlock(&__sub_mutex);
+		return;
+	}
+
+	if (__sub_ilen + len > __sub_isize) {
+		for (size = __sub_isize ? __sub_isize : 64 * 1024; size < __sub_ilen + len; size *= 2)
+			;
+		__sub_in = (char*)nmem_realloc(__sub_in, size);
+		__sub_isize = size;
+	}
+
+	wake = !__sub_ilen;
+	memcpy(__sub_in + __sub_ilen, buf, len);
+	__sub_ilen += len;
+	pthread_mutex_unlock(&__sub_mutex);
+
+	if (wake && write(__sub_wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		printlog("c:%s, e:%s\n", "write", strerror(errno));
+}
@@ -0,0 +1,1171 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/* DA yi: translate the binary capture of dalog back to text, and query the text log */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <helper.h>
+#include <dalog.h>
+#include <dalog_fmt.h>
+
+#define CHUNK_ITEMS     16384
+#define MAX_THREADS     64
+
+/*-----------------------------------------------------------------------
+ * Filter
+ */
+#define MATCH_PROG      0x01
+#define MATCH_MODU      0x02
+#define MATCH_FILE      0x04
+
+static char *__f_prog = NULL;
+static char *__f_modu = NULL;
+static char *__f_file = NULL;
+static char *__f_level = NULL;
+
+/* Seconds since epoch in the time zone of the box */
+static long long __f_start = -1;
+static long long __f_end = -1;
+
+/*-----------------------------------------------------------------------
+ * Stream: one for each process in the capture
+ */
+typedef struct _strent_s strent_s;
+struct _strent_s {
+	unsigned long long id;
+	const char *str;
+	int match;              /* MATCH_XXX */
+};
+
+typedef struct _stream_s stream_s;
+struct _stream_s {
+	stream_s *next;
+
+	int pid;
+	int gmtoff;
+
+	unsigned int size, cnt;
+	strent_s *ents;
+};
+
+static stream_s *__streams = NULL;
+static stream_s *__sids[65536];         /* Last HEAD of the low 16 bits of pid */
+static int __swap = 0;
+
+/*-----------------------------------------------------------------------
+ * Job: records picked by the scanner, rendered by the workers
+ */
+typedef struct _item_s item_s;
+struct _item_s {
+	dalbin_s bin;           /* host order, unused for DALREC_TEXT */
+	char *dat;              /* packed arguments or the text */
+	int len;
+	stream_s *st;
+
+	const char *fmt, *prog, *modu, *file, *func;
+};
+
+typedef struct _chunk_s chunk_s;
+struct _chunk_s {
+	chunk_s *next;
+	int state;              /* 0: queued, 1: rendering, 2: done */
+
+	int cnt;
+	item_s items[CHUNK_ITEMS];
+
+	char *out;
+	int olen, osize;
+};
+
+static pthread_mutex_t __mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __cond_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t __cond_done = PTHREAD_COND_INITIALIZER;
+
+static chunk_s *__q_head = NULL, *__q_tail = NULL;
+static int __q_cnt = 0, __q_quit = 0;
+static int __threads = 0;
+
+static FILE *__out;
+
+static void help()
+{
+	printf("usage: dayi [options] capture ...\n");
+	printf("       capture is DALOG_TO_BINARY or dalog.flight.<pid>\n");
+	printf("       or a text log, FILE.idx of DAXIA_INDEX is used if there\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("    -p prog[,prog...]   Only the given programs\n");
+	printf("    -m modu[,modu...]   Only the given modules\n");
+	printf("    -f file[,file...]   Only the given files\n");
+	printf("    -l levels           Only the given levels, e.g. -l few\n");
+	printf("    -s time             Start time, \"YYYY/mm/dd HH:MM:SS\"\n");
+	printf("    -e time             End time, \"YYYY/mm/dd HH:MM:SS\"\n");
+	printf("    -j threads          Render threads, default the cores\n");
+	printf("    -o file             Output to file instead of stdout\n");
+	printf("\n");
+	printf("Levels:\n");
+	printf("    f=fatal a=alert c=critial e=error\n");
+	printf("    w=warning i=info n=notice d=debug\n");
+	printf("\n");
+	printf("Note:\n");
+	printf("    Time is in the time zone of the box, records\n");
+	printf("    without S: are dropped when -s or -e given.\n");
+	printf("    Set DAYI_VERBOSE to see the blocks of FILE.idx read.\n");
+	printf("\n");
+	printf("Example:\n");
+	printf("    dayi -l e -p network -s \"2026/10/17 02:00:00\" -e \"2026/10/17 02:05:00\" all.log\n");
+}
+
+/*-----------------------------------------------------------------------
+ * Helper
+ */
+static unsigned int swap32(unsigned int v)
+{
+	return __builtin_bswap32(v);
+}
+
+static unsigned long long swap64(unsigned long long v)
+{
+	return __builtin_bswap64(v);
+}
+
+static unsigned short swap16(unsigned short v)
+{
+	return __builtin_bswap16(v);
+}
+
+/* Is str in the comma separated list */
+static int in_list(const char *list, const char *str)
+{
+	const char *p = list, *e;
+	int len = strlen(str);
+
+	while (*p) {
+		e = strchr(p, ',');
+		if (!e)
+			e = p + strlen(p);
+		if (e - p == len && !strncmp(p, str, len))
+			return 1;
+		p = *e ? e + 1 : e;
+	}
+	return 0;
+}
+
+static int str_match(const char *str)
+{
+	const char *base;
+	int match = 0;
+
+	if (__f_prog && in_list(__f_prog, str))
+		match |= MATCH_PROG;
+	if (__f_modu && in_list(__f_modu, str))
+		match |= MATCH_MODU;
+	if (__f_file) {
+		base = strrchr(str, '/');
+		if (in_list(__f_file, str) || (base && in_list(__f_file, base + 1)))
+			match |= MATCH_FILE;
+	}
+	return match;
+}
+
+static int level_match(unsigned char type)
+{
+	static const char *map = "FfAaCcEeWwNnIiLiDdTd";
+	const char *p;
+	char lv = tolower(type);
+
+	if (!__f_level)
+		return 1;
+
+	for (p = map; *p; p += 2)
+		if (p[0] == type) {
+			lv = p[1];
+			break;
+		}
+	return strchr(__f_level, lv) != NULL;
+}
+
+static long long parse_time(const char *str)
+{
+	struct tm tm;
+	char *end;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(str, "%Y/%m/%d %H:%M:%S", &tm);
+	if (!end) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(str, "%Y/%m/%d", &tm);
+	}
+	if (!end || *end) {
+		fprintf(stderr, "dayi: bad time '%s'\n", str);
+		exit(1);
+	}
+	return (long long)timegm(&tm);
+}
+
+/*-----------------------------------------------------------------------
+ * String table
+ */
+static unsigned int str_hash(unsigned long long id)
+{
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+	return (unsigned int)id;
+}
+
+static strent_s *str_find(stream_s *st, unsigned long long id)
+{
+	unsigned int i;
+
+	if (!st->size)
+		return NULL;
+
+	for (i = str_hash(id) & (st->size - 1); st->ents[i].id; i = (i + 1) & (st->size - 1))
+		if (st->ents[i].id == id)
+			return &st->ents[i];
+	return NULL;
+}
+
+static void str_add(stream_s *st, unsigned long long id, const char *str)
+{
+	strent_s *ent, *old = st->ents;
+	unsigned int i, oldsize = st->size;
+
+	ent = str_find(st, id);
+	if (ent) {
+		/* Address reused by dlopen, the new one wins */
+		ent->str = str;
+		ent->match = str_match(str);
+		return;
+	}
+
+	if ((st->cnt + 1) * 2 > st->size) {
+		st->size = st->size ? st->size * 2 : 1024;
+		st->ents = nmem_alloz(st->size, strent_s);
+		st->cnt = 0;
+
+		for (i = 0; i < oldsize; i++)
+			if (old[i].id)
+				str_add(st, old[i].id, old[i].str);
+		nmem_free_s(old);
+	}
+
+	for (i = str_hash(id) & (st->size - 1); st->ents[i].id; i = (i + 1) & (st->size - 1))
+		;
+	st->ents[i].id = id;
+	st->ents[i].str = str;
+	st->ents[i].match = str_match(str);
+	st->cnt++;
+}
+
+static void stream_reset(void)
+{
+	stream_s *st;
+
+	while ((st = __streams)) {
+		__streams = st->next;
+		nmem_free_s(st->ents);
+		nmem_free(st);
+	}
+	memset(__sids, 0, sizeof(__sids));
+}
+
+/*-----------------------------------------------------------------------
+ * Render
+ */
+static void out_reserve(chunk_s *ck, int len)
+{
+	if (ck->olen + len <= ck->osize)
+		return;
+
+	while (ck->olen + len > ck->osize)
+		ck->osize = ck->osize ? ck->osize * 2 : 256 * 1024;
+	ck->out = (char*)nmem_realloc(ck->out, ck->osize);
+}
+
+static void render_item(chunk_s *ck, item_s *it, long long *tmsec, char *tmbuf)
+{
+	int ofs, ret, room, alen;
+	dalhead_s hd;
+	struct tm tm;
+	time_t t;
+	char *p;
+
+	if (!it->fmt) {
+		alen = strnlen(it->dat, it->len);
+		out_reserve(ck, alen + 1);
+		memcpy(ck->out + ck->olen, it->dat, alen);
+		ck->olen += alen;
+		goto done;
+	}
+
+	if (__swap && dalfmt_swap(it->fmt, it->dat, it->len))
+		return;
+
+	hd.type = it->bin.type;
+	hd.mask = it->bin.mask;
+	hd.pid = it->st->pid;
+	hd.tid = it->bin.tid;
+	hd.rtm = (unsigned long)(it->bin.rtm / 1000000);
+	hd.ntm = it->bin.rtm;
+	hd.atm = tmbuf;
+	hd.atm_ms = (unsigned int)(it->bin.atm / 1000000 % 1000);
+	hd.prog = it->prog;
+	hd.modu = it->modu;
+	hd.file = it->file;
+	hd.func = it->func;
+	hd.line = it->bin.line;
+
+	if (hd.mask & DALOG_ATM) {
+		t = (time_t)(it->bin.atm / 1000000000) + it->st->gmtoff;
+		if (t != *tmsec) {
+			gmtime_r(&t, &tm);
+			strftime(tmbuf, 64, "%Y/%m/%d %H:%M:%S", &tm);
+			*tmsec = t;
+		}
+	}
+
+	room = 256;
+	if (hd.prog)
+		room += strlen(hd.prog);
+	if (hd.modu)
+		room += strlen(hd.modu);
+	if (hd.file)
+		room += strlen(hd.file);
+	if (hd.func)
+		room += strlen(hd.func);
+	out_reserve(ck, room + 1024);
+
+	p = ck->out + ck->olen;
+	ofs = dalfmt_head(p, &hd);
+	room = ck->osize - ck->olen - ofs;
+
+	ret = dalfmt_render(p + ofs, room, it->fmt, it->dat, it->len);
+	if (ret < 0)
+		return;
+	if (ret > room - 1) {
+		out_reserve(ck, ofs + ret + 1);
+		p = ck->out + ck->olen;
+		dalfmt_render(p + ofs, ret + 1, it->fmt, it->dat, it->len);
+	}
+	ck->olen += ofs + ret;
+
+done:
+	/* Same as logger_file of dalog_setup.c */
+	out_reserve(ck, 1);
+	if (!ck->olen || ck->out[ck->olen - 1] != '\n')
+		ck->out[ck->olen++] = '\n';
+}
+
+static void *thread_render(void *user_data)
+{
+	long long tmsec = -1;
+	char tmbuf[64];
+	chunk_s *ck;
+	int i;
+
+	pthread_mutex_lock(&__mutex);
+	for (;;) {
+		for (ck = __q_head; ck && ck->state; ck = ck->next)
+			;
+		if (!ck) {
+			if (__q_quit)
+				break;
+			pthread_cond_wait(&__cond_work, &__mutex);
+			continue;
+		}
+
+		ck->state = 1;
+		pthread_mutex_unlock(&__mutex);
+
+		for (i = 0; i < ck->cnt; i++)
+			render_item(ck, &ck->items[i], &tmsec, tmbuf);
+
+		pthread_mutex_lock(&__mutex);
+		ck->state = 2;
+		pthread_cond_broadcast(&__cond_done);
+	}
+	pthread_mutex_unlock(&__mutex);
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------------
+ * Queue: the scanner queue chunks and write them out in order
+ */
+static void queue_write_head(void)
+{
+	chunk_s *ck;
+
+	pthread_mutex_lock(&__mutex);
+	while (__q_head->state != 2)
+		pthread_cond_wait(&__cond_done, &__mutex);
+	ck = __q_head;
+	__q_head = ck->next;
+	if (!__q_head)
+		__q_tail = NULL;
+	__q_cnt--;
+	pthread_mutex_unlock(&__mutex);
+
+	if (ck->olen && fwrite(ck->out, 1, ck->olen, __out) != (size_t)ck->olen)
+		fprintf(stderr, "dayi: write error: %s\n", strerror(errno));
+
+	nmem_free_s(ck->out);
+	nmem_free(ck);
+}
+
+static void queue_push(chunk_s *ck)
+{
+	while (__q_cnt >= __threads * 2)
+		queue_write_head();
+
+	pthread_mutex_lock(&__mutex);
+	if (__q_tail)
+		__q_tail->next = ck;
+	else
+		__q_head = ck;
+	__q_tail = ck;
+	__q_cnt++;
+	pthread_cond_signal(&__cond_work);
+	pthread_mutex_unlock(&__mutex);
+}
+
+static void queue_flush(void)
+{
+	while (__q_cnt)
+		queue_write_head();
+}
+
+/*-----------------------------------------------------------------------
+ * Scan: walk the headers, keep the string tables and filter
+ */
+static const char *name_of(stream_s *st, unsigned long long id, int want)
+{
+	strent_s *ent;
+
+	if (!id)
+		return NULL;
+
+	ent = str_find(st, id);
+	if (!ent)
+		return want ? NULL : "?";
+	if (want && !(ent->match & want))
+		return NULL;
+	return ent->str;
+}
+
+/* Filter by the text header, "|T|...|P:xxx|M:xxx|F:xxx|..." */
+static int text_field_match(const char *text, int len, const char *tag, const char *list, int file)
+{
+	char name[512];
+	const char *p, *e, *base;
+	int n;
+
+	p = memmem(text, len, tag, 3);
+	if (!p)
+		return 0;
+	p += 3;
+	e = memchr(p, '|', text + len - p);
+	if (!e || e - p >= (int)sizeof(name))
+		return 0;
+
+	n = e - p;
+	memcpy(name, p, n);
+	name[n] = '\0';
+
+	if (in_list(list, name))
+		return 1;
+	base = strrchr(name, '/');
+	return file && base && in_list(list, base + 1);
+}
+
+static int text_match(const char *text, int len)
+{
+	if (len < 3 || text[0] != '|')
+		return !__f_level && !__f_prog && !__f_modu && !__f_file;
+
+	if (!level_match(text[1]))
+		return 0;
+	if (__f_prog && !text_field_match(text, len, "|P:", __f_prog, 0))
+		return 0;
+	if (__f_modu && !text_field_match(text, len, "|M:", __f_modu, 0))
+		return 0;
+	if (__f_file && !text_field_match(text, len, "|F:", __f_file, 1))
+		return 0;
+
+	return 1;
+}
+
+static void bin_to_host(dalbin_s *bin)
+{
+	bin->rtm = swap64(bin->rtm);
+	bin->atm = swap64(bin->atm);
+	bin->fmt = swap64(bin->fmt);
+	bin->prog = swap64(bin->prog);
+	bin->modu = swap64(bin->modu);
+	bin->file = swap64(bin->file);
+	bin->func = swap64(bin->func);
+	bin->mask = swap32(bin->mask);
+	bin->line = (int)swap32((unsigned int)bin->line);
+	bin->tid = swap32(bin->tid);
+}
+
+/* Return 0 if picked */
+static int scan_bin(item_s *it, stream_s *st, char *dat, int len)
+{
+	dalbin_s *bin = &it->bin;
+	strent_s *ent;
+	long long sec;
+
+	if (len < (int)sizeof(dalbin_s))
+		return -1;
+
+	memcpy(bin, dat, sizeof(dalbin_s));
+	if (__swap)
+		bin_to_host(bin);
+
+	if (!level_match(bin->type))
+		return -1;
+
+	if (__f_start >= 0 || __f_end >= 0) {
+		if (!(bin->mask & DALOG_ATM))
+			return -1;
+		sec = (long long)(bin->atm / 1000000000) + st->gmtoff;
+		if (__f_start >= 0 && sec < __f_start)
+			return -1;
+		if (__f_end >= 0 && sec > __f_end)
+			return -1;
+	}
+
+	it->prog = name_of(st, bin->prog, __f_prog ? MATCH_PROG : 0);
+	if (__f_prog && !it->prog)
+		return -1;
+	it->modu = name_of(st, bin->modu, __f_modu ? MATCH_MODU : 0);
+	if (__f_modu && !it->modu)
+		return -1;
+	it->file = name_of(st, bin->file, __f_file ? MATCH_FILE : 0);
+	if (__f_file && !it->file)
+		return -1;
+	it->func = name_of(st, bin->func, 0);
+
+	/* Can not render without fmt, capture cut off from the middle */
+	ent = str_find(st, bin->fmt);
+	if (!ent)
+		return -1;
+	it->fmt = ent->str;
+
+	it->st = st;
+	it->dat = dat + sizeof(dalbin_s);
+	it->len = len - sizeof(dalbin_s);
+	return 0;
+}
+
+/* pid is 0 if the record has no DALREC_PID */
+static stream_s *stream_new(const char *path, unsigned short sid, int pid, dalbin_head_s *hd)
+{
+	stream_s *st = nmem_alloz(1, stream_s);
+
+	st->pid = __swap ? (int)swap32(hd->pid) : hd->pid;
+	st->gmtoff = __swap ? (int)swap32(hd->gmtoff) : hd->gmtoff;
+
+	/* The one before may be still writing, its records go to this one */
+	if (!pid && __sids[sid] && __sids[sid]->pid != st->pid)
+		fprintf(stderr, "dayi: %s: pid %d and %d share sid %u, records may be mixed\n",
+				path, __sids[sid]->pid, st->pid, sid);
+
+	st->next = __streams;
+	__streams = st;
+	__sids[sid] = st;
+	return st;
+}
+
+/* The newest HEAD of the pid, or of the sid if pid is not known */
+static stream_s *stream_get(unsigned short sid, int pid)
+{
+	stream_s *st = __sids[sid];
+
+	if (!pid || !st || st->pid == pid)
+		return st;
+
+	for (st = __streams; st; st = st->next)
+		if (st->pid == pid)
+			break;
+	return st;
+}
+
+static int scan(const char *path, char *base, size_t size)
+{
+	unsigned long long id;
+	unsigned int len;
+	unsigned short kind, sid;
+	int pid;
+	dalrec_s *rec;
+	chunk_s *ck = NULL;
+	stream_s *st;
+	size_t ofs = 0;
+	char *dat;
+
+	if (size < 8 || memcmp(base, DALBIN_MAGIC, 8)) {
+		fprintf(stderr, "dayi: %s: not a dalog binary capture\n", path);
+		return -1;
+	}
+
+	while (ofs + sizeof(dalrec_s) <= size) {
+		if (!memcmp(base + ofs, DALBIN_MAGIC, 8)) {
+			ofs += 8;
+
+			/* Byte order of the writer, HEAD must follow */
+			rec = (dalrec_s*)(base + ofs);
+			if (ofs + sizeof(dalrec_s) <= size &&
+					(swap16(rec->kind) & ~DALREC_PID) == DALREC_HEAD)
+				__swap = 1;
+			else
+				__swap = 0;
+			continue;
+		}
+
+		rec = (dalrec_s*)(base + ofs);
+		len = __swap ? swap32(rec->len) : rec->len;
+		kind = __swap ? swap16(rec->kind) : rec->kind;
+		sid = __swap ? swap16(rec->sid) : rec->sid;
+
+		dat = (char*)(rec + 1);
+		if (len > size - ofs - sizeof(dalrec_s)) {
+			fprintf(stderr, "dayi: %s: truncated at %lu\n", path, (unsigned long)ofs);
+			break;
+		}
+		ofs += sizeof(dalrec_s) + DALOG_ALIGN8(len);
+
+		pid = 0;
+		if (kind & DALREC_PID) {
+			if (len < 8)
+				continue;
+			memcpy(&pid, dat, 4);
+			if (__swap)
+				pid = (int)swap32(pid);
+			kind &= ~DALREC_PID;
+			dat += 8;
+			len -= 8;
+		}
+
+		if (kind == DALREC_HEAD) {
+			if (len >= sizeof(dalbin_head_s))
+				stream_new(path, sid, pid, (dalbin_head_s*)dat);
+			continue;
+		}
+
+		st = stream_get(sid, pid);
+		if (!st)
+			continue;
+
+		if (kind == DALREC_STR) {
+			if (len <= 8 || dat[len - 1])
+				continue;
+			memcpy(&id, dat, 8);
+			str_add(st, __swap ? swap64(id) : id, dat + 8);
+			continue;
+		}
+
+		if (kind != DALREC_BIN && kind != DALREC_TEXT)
+			continue;
+
+		if (!ck)
+			ck = nmem_alloz(1, chunk_s);
+
+		if (kind == DALREC_BIN) {
+			if (scan_bin(&ck->items[ck->cnt], st, dat, len))
+				continue;
+		} else {
+			if (__f_start >= 0 || __f_end >= 0 || !text_match(dat, len))
+				continue;
+			ck->items[ck->cnt].fmt = NULL;
+			ck->items[ck->cnt].dat = dat;
+			ck->items[ck->cnt].len = len;
+		}
+
+		if (++ck->cnt == CHUNK_ITEMS) {
+			queue_push(ck);
+			ck = NULL;
+		}
+	}
+
+	if (ck)
+		queue_push(ck);
+	queue_flush();
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------
+ * Flight recorder file, see dalog_fmt.h: rebuilt as a binary stream
+ */
+typedef struct _fltrec_s fltrec_s;
+struct _fltrec_s {
+	unsigned long long rtm;
+	dalrec_s *rec;
+	unsigned int len;
+};
+
+static int fltrec_cmp(const void *a, const void *b)
+{
+	const fltrec_s *x = (const fltrec_s*)a, *y = (const fltrec_s*)b;
+
+	return x->rtm < y->rtm ? -1 : x->rtm > y->rtm;
+}
+
+#define FLT_U32(v) (swap ? swap32(v) : (v))
+#define FLT_U64(v) (swap ? swap64(v) : (v))
+
+static char *flight_to_stream(const char *path, char *base, size_t size, size_t *olen)
+{
+	unsigned long long atm;
+	unsigned int head, i, cells, s, n = 0, cnt, len, str_ofs, str_used, slot_ofs, slot_size;
+	dalflt_head_s *hd = (dalflt_head_s*)base;
+	dalbin_head_s bh;
+	fltrec_s *recs;
+	dalrec_s *rec;
+	dalbin_s *bin;
+	char *out, *p, *slot;
+	int swap;
+
+	if (size < sizeof(*hd))
+		return NULL;
+
+	swap = hd->order != DALBIN_ORDER;
+	str_ofs = FLT_U32(hd->str_ofs);
+	str_used = FLT_U32(hd->str_used);
+	slot_ofs = FLT_U32(hd->slot_ofs);
+	slot_size = FLT_U32(hd->slot_size);
+	cnt = FLT_U32(hd->slot_cnt);
+	if (cnt > FLT_U32(hd->slot_max))
+		cnt = FLT_U32(hd->slot_max);
+
+	if (slot_size <= DALFLT_SLOT_HEAD || (size_t)str_ofs + str_used > size ||
+			(size_t)slot_ofs + (size_t)cnt * slot_size > size) {
+		fprintf(stderr, "dayi: %s: bad flight recorder file\n", path);
+		return NULL;
+	}
+	cells = (slot_size - DALFLT_SLOT_HEAD) / DALFLT_CELL;
+
+	/* Complete cells of all the slots, by time */
+	recs = nmem_alloc((size_t)cnt * cells + 1, fltrec_s);
+	for (s = 0; s < cnt; s++) {
+		slot = base + slot_ofs + (size_t)s * slot_size;
+		head = FLT_U32(((dalflt_slot_s*)slot)->head);
+
+		/* The head wraps, cells not written yet are dropped by len */
+		for (i = head - cells; i != head; i++) {
+			rec = (dalrec_s*)(slot + DALFLT_SLOT_HEAD + (i % cells) * DALFLT_CELL);
+			len = FLT_U32(rec->len);
+			if (len < sizeof(dalbin_s) || len > DALFLT_CELL - sizeof(dalrec_s))
+				continue;
+
+			recs[n].rtm = FLT_U64(((dalbin_s*)(rec + 1))->rtm);
+			recs[n].rec = rec;
+			recs[n].len = sizeof(dalrec_s) + DALOG_ALIGN8(len);
+			n++;
+		}
+	}
+	qsort(recs, n, sizeof(fltrec_s), fltrec_cmp);
+
+	out = nmem_alloc(8 + sizeof(dalrec_s) + sizeof(bh) + str_used + (size_t)n * DALFLT_CELL, char);
+	p = out;
+
+	/* MAGIC, HEAD, then the strings as is, all in the writer's order */
+	memcpy(p, DALBIN_MAGIC, 8);
+	p += 8;
+
+	rec = (dalrec_s*)p;
+	rec->len = FLT_U32((unsigned int)sizeof(bh));
+	rec->kind = swap ? swap16(DALREC_HEAD) : DALREC_HEAD;
+	rec->sid = swap ? swap16((unsigned short)FLT_U32(hd->pid)) : (unsigned short)hd->pid;
+	bh.order = hd->order;
+	bh.version = hd->version;
+	bh.pid = hd->pid;
+	bh.gmtoff = hd->gmtoff;
+	memcpy(rec + 1, &bh, sizeof(bh));
+	p += sizeof(dalrec_s) + DALOG_ALIGN8(sizeof(bh));
+
+	memcpy(p, base + str_ofs, str_used);
+	p += str_used;
+
+	for (i = 0; i < n; i++) {
+		memcpy(p, recs[i].rec, recs[i].len);
+
+		bin = (dalbin_s*)((dalrec_s*)p + 1);
+		atm = FLT_U64(hd->abs0) + (recs[i].rtm - FLT_U64(hd->rel0));
+		bin->atm = FLT_U64(atm);
+		p += recs[i].len;
+	}
+
+	nmem_free(recs);
+	*olen = p - out;
+	return out;
+}
+
+/*-----------------------------------------------------------------------
+ * Text log, as written by daxia, FILE.idx is used if it is there
+ */
+typedef struct _textidx_s textidx_s;
+struct _textidx_s {
+	char *buf;
+	size_t size;
+
+	/* MATCH_XXX of the name ids */
+	unsigned char *match;
+	unsigned int idmax;
+
+	unsigned long long types;       /* Wanted */
+	int need;                       /* MATCH_XXX all the lines must have */
+
+	unsigned long blk_all, blk_read;
+	size_t unindexed;
+};
+
+static void text_push(chunk_s **ck, char *line, int len)
+{
+	daltext_s tx;
+
+	if (!text_match(line, len))
+		return;
+
+	if (__f_start >= 0 || __f_end >= 0) {
+		dalfmt_parse(line, len, &tx);
+		if (tx.atm < 0)
+			return;
+		if (__f_start >= 0 && tx.atm < __f_start)
+			return;
+		if (__f_end >= 0 && tx.atm > __f_end)
+			return;
+	}
+
+	if (!*ck)
+		*ck = nmem_alloz(1, chunk_s);
+
+	(*ck)->items[(*ck)->cnt].fmt = NULL;
+	(*ck)->items[(*ck)->cnt].dat = line;
+	(*ck)->items[(*ck)->cnt].len = len;
+	if (++(*ck)->cnt == CHUNK_ITEMS) {
+		queue_push(*ck);
+		*ck = NULL;
+	}
+}
+
+static void text_range(chunk_s **ck, char *base, size_t from, size_t to)
+{
+	char *p = base + from, *eol, *end = base + to;
+
+	for (; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end - 1;
+		text_push(ck, p, eol + 1 - p);
+	}
+}
+
+static int textidx_load(textidx_s *ti, const char *path)
+{
+	char name[4096];
+	dalidx_name_s *dn;
+	dalrec_s *rec;
+	struct stat st;
+	size_t ofs;
+	int fd, c;
+
+	snprintf(name, sizeof(name), "%s.idx", path);
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || st.st_size < 8) {
+		close(fd);
+		return -1;
+	}
+
+	ti->size = st.st_size;
+	ti->buf = nmem_alloc(ti->size, char);
+	if (read(fd, ti->buf, ti->size) != (ssize_t)ti->size || memcmp(ti->buf, DALIDX_MAGIC, 8)) {
+		close(fd);
+		nmem_free_z(ti->buf);
+		return -1;
+	}
+	close(fd);
+
+	/* Names first, the ids are small and dense */
+	for (ofs = 8; ofs + sizeof(dalrec_s) <= ti->size; ofs += sizeof(dalrec_s) + DALOG_ALIGN8(rec->len)) {
+		rec = (dalrec_s*)(ti->buf + ofs);
+		if (DALOG_ALIGN8(rec->len) > ti->size - ofs - sizeof(dalrec_s))
+			break;
+		if (rec->kind != DALREC_IDXNAME || rec->len <= sizeof(*dn))
+			continue;
+
+		dn = (dalidx_name_s*)(rec + 1);
+		if (dn->id >= ti->idmax) {
+			c = ti->idmax;
+			ti->idmax = dn->id * 2 + 64;
+			ti->match = (unsigned char*)nmem_realloc(ti->match, ti->idmax);
+			memset(ti->match + c, 0, ti->idmax - c);
+		}
+		((char*)(rec + 1))[rec->len - 1] = '\0';
+		if (dn->tag == 'P' && __f_prog && in_list(__f_prog, (char*)(dn + 1)))
+			ti->match[dn->id] |= MATCH_PROG;
+		if (dn->tag == 'M' && __f_modu && in_list(__f_modu, (char*)(dn + 1)))
+			ti->match[dn->id] |= MATCH_MODU;
+	}
+	ti->size = ofs;
+
+	if (__f_prog)
+		ti->need |= MATCH_PROG;
+	if (__f_modu)
+		ti->need |= MATCH_MODU;
+
+	/* Type of no header is 0, kept only if no level given */
+	ti->types = __f_level ? 0 : 1;
+	for (c = 1; c < 128; c++)
+		if (level_match(c))
+			ti->types |= 1ULL << (c & 63);
+	return 0;
+}
+
+/* The block may have some lines wanted */
+static int textidx_match(textidx_s *ti, dalidx_blk_s *blk)
+{
+	unsigned int *ids = (unsigned int*)(blk + 1);
+	unsigned int i;
+	int got = 0;
+
+	if (blk->types == ~0ULL)
+		return 1;
+	if (!(blk->types & ti->types))
+		return 0;
+
+	if (__f_start >= 0 || __f_end >= 0) {
+		if (blk->tmin < 0)
+			return 0;
+		if (__f_start >= 0 && blk->tmax < __f_start)
+			return 0;
+		if (__f_end >= 0 && blk->tmin > __f_end)
+			return 0;
+	}
+
+	if (!ti->need)
+		return 1;
+	for (i = 0; i < blk->nid; i++)
+		if (ids[i] < ti->idmax)
+			got |= ti->match[ids[i]];
+	return (got & ti->need) == ti->need;
+}
+
+static int text_scan(const char *path, char *base, size_t size)
+{
+	textidx_s ti;
+	dalidx_blk_s *blk;
+	dalrec_s *rec;
+	chunk_s *ck = NULL;
+	size_t ofs, done = 0, from, to;
+
+	memset(&ti, 0, sizeof(ti));
+	if (textidx_load(&ti, path)) {
+		text_range(&ck, base, 0, size);
+		goto out;
+	}
+
+	for (ofs = 8; ofs + sizeof(dalrec_s) <= ti.size; ofs += sizeof(dalrec_s) + DALOG_ALIGN8(rec->len)) {
+		rec = (dalrec_s*)(ti.buf + ofs);
+		if (rec->kind != DALREC_IDXBLK || rec->len < sizeof(*blk))
+			continue;
+
+		blk = (dalidx_blk_s*)(rec + 1);
+		if (rec->len < sizeof(*blk) + blk->nid * sizeof(unsigned int))
+			continue;
+
+		/* Rotated or rewritten under the index */
+		from = blk->ofs > done ? blk->ofs : done;
+		to = blk->ofs + blk->len < size ? blk->ofs + blk->len : size;
+		if (from >= to)
+			continue;
+
+		/* Not indexed in between */
+		if (from > done) {
+			text_range(&ck, base, done, from);
+			ti.unindexed += from - done;
+		}
+
+		ti.blk_all++;
+		if (textidx_match(&ti, blk)) {
+			ti.blk_read++;
+			text_range(&ck, base, from, to);
+		}
+		done = to;
+	}
+
+	/* Not indexed yet */
+	if (done < size) {
+		text_range(&ck, base, done, size);
+		ti.unindexed += size - done;
+	}
+
+	if (getenv("DAYI_VERBOSE"))
+		fprintf(stderr, "dayi: %s: %lu of %lu blocks read, %lu bytes not indexed\n",
+				path, ti.blk_read, ti.blk_all, (unsigned long)ti.unindexed);
+
+	nmem_free_s(ti.buf);
+	nmem_free_s(ti.match);
+
+out:
+	if (ck)
+		queue_push(ck);
+	queue_flush();
+	return 0;
+}
+
+static int decode(const char *path)
+{
+	struct stat st;
+	char *base, *flt;
+	size_t flen;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "dayi: open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return -1;
+	}
+
+	/* Private and writable: swap the arguments in place */
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "dayi: mmap %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+	if (st.st_size >= 8 && !memcmp(base, DALFLT_MAGIC, 8)) {
+		flt = flight_to_stream(path, base, st.st_size, &flen);
+		ret = flt ? scan(path, flt, flen) : -1;
+		nmem_free_s(flt);
+	} else if (st.st_size >= 8 && !memcmp(base, DALBIN_MAGIC, 8))
+		ret = scan(path, base, st.st_size);
+	else
+		ret = text_scan(path, base, st.st_size);
+
+	munmap(base, st.st_size);
+	stream_reset();
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t thds[MAX_THREADS];
+	int i, ret = 0, files = 0;
+	char *arg, *val;
+
+	__out = stdout;
+
+	for (i = 1; i < argc; i++) {
+		arg = argv[i];
+
+		if (!strcmp("--help", arg) || !strcmp("-h", arg)) {
+			help();
+			exit(0);
+		}
+
+		if (arg[0] != '-' || !arg[1] || arg[2]) {
+			argv[files++] = arg;
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			help();
+			exit(1);
+		}
+		val = argv[++i];
+
+		switch (arg[1]) {
+		case 'p':
+			__f_prog = val;
+			break;
+		case 'm':
+			__f_modu = val;
+			break;
+		case 'f':
+			__f_file = val;
+			break;
+		case 'l':
+			__f_level = val;
+			break;
+		case 's':
+			__f_start = parse_time(val);
+			break;
+		case 'e':
+			__f_end = parse_time(val);
+			break;
+		case 'j':
+			__threads = atoi(val);
+			break;
+		case 'o':
+			__out = fopen(val, "w");
+			if (!__out) {
+				fprintf(stderr, "dayi: open %s: %s\n", val, strerror(errno));
+				exit(1);
+			}
+			break;
+		default:
+			help();
+			exit(1);
+		}
+	}
+
+	if (!files) {
+		help();
+		exit(1);
+	}
+
+	if (__threads <= 0)
+		__threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (__threads <= 0)
+		__threads = 1;
+	if (__threads > MAX_THREADS)
+		__threads = MAX_THREADS;
+
+	for (i = 0; i < __threads; i++)
+		pthread_create(&thds[i], NULL, thread_render, NULL);
+
+	for (i = 0; i < files; i++)
+		if (decode(argv[i]))
+			ret = 1;
+
+	pthread_mutex_lock(&__mutex);
+	__q_quit = 1;
+	pthread_cond_broadcast(&__cond_work);
+	pthread_mutex_unlock(&__mutex);
+
+	for (i = 0; i < __threads; i++)
+		pthread_join(thds[i], NULL);
+
+	fflush(__out);
+	if (__out != stdout)
+		fclose(__out);
+
+	return ret;
+}
@@ -4,6 +4,16 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <netdb.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <dalog_setup.h>
 
 #define SZ 2048
 
@@ -18,6 +28,9 @@ static void help()
 	printf("    Func: func=??? H:??? h:???\n");
 	printf("    Line: line=??? L:??? l:??? <digital>\n");
 	printf("    Mask: mask=??? ALL -ALL or [^PMFHL]\n");
+	printf("    Rate: rate=<n>[/s|/m|/h], the most messages of each site, 0 no limit\n");
+	printf("          the same message again is collapsed to \"last message repeated N times\"\n");
+	printf("          not for dalog_assert and the dbus message dump of dagou\n");
 	printf("\n");
 	printf("Masks:\n");
 	printf("    f=fatal a=alert c=critial e=error\n");
@@ -25,10 +38,260 @@ static void help()
 	printf("\n");
 	printf("Marks:\n");
 	printf("    P=prog M=modu F=file H=func N=line\n");
-	printf("    s=RTM S=ATM j=PID x=TID\n");
+	printf("    s=RTM S=ATM u=NTM(ns) j=PID x=TID\n");
+	printf("\n");
+	printf("Control:\n");
+	printf("    The rule is pushed to the control socket of each process.\n");
+	printf("    --pid=<pid>   Only this process\n");
+	printf("    --list        Show the rules of the processes\n");
+	printf("    --sites       Show all the dalog_xxx of the processes, list-sites also\n");
+	printf("    --stats       Show the counters of dalog in the processes\n");
+	printf("    --del=<idx>   Remove the rule idx, as shown by --list\n");
+	printf("    --clr         Remove all the rules\n");
+	printf("    --set         Replace all the rules by this one, at once\n");
+	printf("    --set=<file>  Replace all the rules by the lines of file\n");
+	printf("\n");
+	printf("Tail:\n");
+	printf("    --tail=<host:port|path|@name>\n");
+	printf("    Watch the lines taken by daxia DAXIA_SUB_PORT or DAXIA_SUB_UNIX,\n");
+	printf("    filtered by the switches, instead of change the rtcfg.\n");
 	printf("\n");
 	printf("Note:\n");
-	printf("    If env DR_RTCFG not set, use /tmp/klog.rtcfg instead.\n");
+	printf("    If env DR_RTCFG set, the rule is also appended to it, for the\n");
+	printf("    processes started with the same DALOG_RTCFG.\n");
+}
+
+/*-----------------------------------------------------------------------
+ * Control socket of dalog, DALOG_CTL_NAME
+ */
+static int ctl_socket(void)
+{
+	struct sockaddr_un me;
+	struct timeval tv;
+	int s;
+
+	s = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (s < 0)
+		return -1;
+
+	/* Autobind, for the reply of list */
+	memset(&me, 0, sizeof(me));
+	me.sun_family = AF_UNIX;
+	bind(s, (struct sockaddr *)&me, sizeof(sa_family_t));
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 500 * 1000;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return s;
+}
+
+static int ctl_send(int s, int pid, const char *msg)
+{
+	struct sockaddr_un sun;
+	socklen_t slen;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path + 1, sizeof(sun.sun_path) - 1, DALOG_CTL_NAME, pid);
+	slen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(sun.sun_path + 1);
+
+	return sendto(s, msg, strlen(msg), 0, (struct sockaddr *)&sun, slen) < 0 ? -1 : 0;
+}
+
+/* The commands replied, shown by ctl_list */
+static int ctl_is_list(const char *msg)
+{
+	return !strcmp(msg, "list") || !strcmp(msg, "sites") || !strcmp(msg, "stats");
+}
+
+/* "list", "sites" or "stats" */
+static void ctl_list(int s, int pid, const char *what)
+{
+	char buf[DALOG_CTL_MAX + 1], comm[64] = "?", *line, *eol;
+	int n, idx = 0;
+	FILE *fp;
+
+	if (ctl_send(s, pid, what))
+		return;
+
+	snprintf(buf, sizeof(buf), "/proc/%d/comm", pid);
+	fp = fopen(buf, "r");
+	if (fp) {
+		if (fgets(comm, sizeof(comm), fp))
+			comm[strcspn(comm, "\n")] = '\0';
+		fclose(fp);
+	}
+	printf("PID %d (%s)\n", pid, comm);
+
+	while ((n = recv(s, buf, DALOG_CTL_MAX, 0)) > 0) {
+		buf[n] = '\0';
+		if (!strcmp(what, "list")) {
+			if (buf[0] != '#')
+				printf("    [%d] %s\n", idx++, buf);
+			continue;
+		}
+
+		for (line = buf; *line; line = eol) {
+			eol = strchr(line, '\n');
+			if (eol)
+				*eol++ = '\0';
+			else
+				eol = line + strlen(line);
+			if (line[0] != '#')
+				printf("    %s\n", line);
+		}
+	}
+}
+
+/* As dalog takes it, <n>[/s|/m|/h] */
+static int rate_check(const char *s)
+{
+	char *unit;
+
+	strtol(s, &unit, 10);
+	if (unit == s)
+		return -1;
+	return (*unit && strcmp(unit, "/s") && strcmp(unit, "/m") && strcmp(unit, "/h")) ? -1 : 0;
+}
+
+/* "set" and the rules of file, for ctl_push */
+static int set_load(const char *path, char *buf, int size)
+{
+	int len, n;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		printf("Open %s failed, errno: %d\n", path, errno);
+		return -1;
+	}
+
+	len = sprintf(buf, "set\n");
+	n = fread(buf + len, 1, size - len, fp);
+	fclose(fp);
+
+	if (len + n >= size) {
+		printf("%s is too big, %d bytes at most\n", path, size - len - 1);
+		return -1;
+	}
+	buf[len + n] = '\0';
+	return 0;
+}
+
+/* To pid, or all the processes have the socket if pid is 0 */
+static int ctl_push(int pid, const char *msg)
+{
+	char line[512], *p;
+	int s, cnt = 0, id;
+	FILE *fp;
+
+	s = ctl_socket();
+	if (s < 0)
+		return 0;
+
+	if (pid) {
+		if (ctl_is_list(msg))
+			ctl_list(s, pid, msg);
+		else if (!ctl_send(s, pid, msg))
+			cnt++;
+		close(s);
+		return cnt;
+	}
+
+	fp = fopen("/proc/net/unix", "r");
+	if (!fp) {
+		close(s);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		p = strchr(line, '@');
+		if (!p || sscanf(p + 1, DALOG_CTL_NAME, &id) != 1)
+			continue;
+
+		if (ctl_is_list(msg))
+			ctl_list(s, id, msg);
+		else if (!ctl_send(s, id, msg))
+			cnt++;
+	}
+
+	fclose(fp);
+	close(s);
+	return cnt;
+}
+
+/* "host:port" or the path of unix socket, "@name" is abstract */
+static int tail_connect(const char *to)
+{
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un sun;
+	char host[SZ], *port;
+	socklen_t slen;
+	int s = -1;
+
+	port = strrchr(to, ':');
+	if (!port || strchr(to, '/') || to[0] == '@') {
+		if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			return -1;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, to, sizeof(sun.sun_path) - 1);
+		slen = offsetof(struct sockaddr_un, sun_path) + strlen(sun.sun_path);
+		if (sun.sun_path[0] == '@')
+			sun.sun_path[0] = '\0';
+
+		if (connect(s, (struct sockaddr *)&sun, slen) == -1) {
+			close(s);
+			return -1;
+		}
+		return s;
+	}
+
+	snprintf(host, sizeof(host), "%.*s", (int)(port - to), to);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host[0] ? host : NULL, port + 1, &hints, &res))
+		return -1;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s == -1)
+			continue;
+		if (!connect(s, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+	return s;
+}
+
+static int tail(const char *to, const char *cfgline)
+{
+	char buf[64 * 1024];
+	int s, n;
+
+	s = tail_connect(to);
+	if (s < 0) {
+		printf("Connect %s failed, errno: %d\n", to, errno);
+		return -1;
+	}
+
+	n = snprintf(buf, sizeof(buf), "%s\n", cfgline);
+	if (write(s, buf, n) != n) {
+		printf("Send to %s failed, errno: %d\n", to, errno);
+		close(s);
+		return -1;
+	}
+
+	while ((n = read(s, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+		if (n > 0 && fwrite(buf, 1, n, stdout) == (size_t)n)
+			fflush(stdout);
+
+	close(s);
+	return 0;
 }
 
 int main(int argc, char *argv[])
@@ -38,15 +301,17 @@ int main(int argc, char *argv[])
 	int argl;
 	char *args;
 	char *rtcfg;
+	char *tail_to = NULL;
+	char *ctl = NULL;
+	int pid = 0, cnt, set = 0;
 
-	static char prog[SZ], modu[SZ], file[SZ], func[SZ], line[SZ], mask[SZ];
-	static char cfgline[SZ];
+	static char prog[SZ], modu[SZ], file[SZ], func[SZ], line[SZ], mask[SZ], rate[SZ];
+	static char cfgline[SZ], cmd[SZ + 8];
+	static char setmsg[DALOG_CTL_MAX];
 
 	FILE *fp;
 
 	rtcfg = getenv("DR_RTCFG");
-	if (!rtcfg)
-		rtcfg = (char*)"/tmp/klog.rtcfg";
 
 	for (i = 1; i < argc; i++) {
 		args = argv[i];
@@ -55,6 +320,27 @@ int main(int argc, char *argv[])
 		if (!strcmp("--help", args)) {
 			help();
 			exit(0);
+		} else if (!strncmp("--tail=", args, 7)) {
+			tail_to = &args[7];
+		} else if (!strncmp("--pid=", args, 6)) {
+			pid = atoi(&args[6]);
+		} else if (!strcmp("--list", args)) {
+			ctl = "list";
+		} else if (!strcmp("--sites", args) || !strcmp("list-sites", args)) {
+			ctl = "sites";
+		} else if (!strcmp("--stats", args)) {
+			ctl = "stats";
+		} else if (!strcmp("--clr", args)) {
+			ctl = "clr";
+		} else if (!strncmp("--del=", args, 6)) {
+			snprintf(cfgline, sizeof(cfgline), "del %d", atoi(&args[6]));
+			ctl = cfgline;
+		} else if (!strcmp("--set", args)) {
+			set = 1;
+		} else if (!strncmp("--set=", args, 6)) {
+			if (set_load(&args[6], setmsg, sizeof(setmsg)))
+				return -1;
+			ctl = setmsg;
 
 
 		} else if (!strncmp("prog=", args, 5)) {
@@ -99,6 +385,12 @@ int main(int argc, char *argv[])
 
 		} else if (!strncmp("mask=", args, 5)) {
 			strcat(mask, &args[5]);
+		} else if (!strncmp("rate=", args, 5)) {
+			if (rate_check(&args[5])) {
+				printf("Bad rate '%s', <n>[/s|/m|/h]\n", &args[5]);
+				return -1;
+			}
+			strcpy(rate, &args[5]);
 
 
 		} else if ((argl > 2) && !strncmp(".c", &args[argl - 2], 2)) {
@@ -125,7 +417,14 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (!mask[0]) {
+	if (ctl) {
+		cnt = ctl_push(pid, ctl);
+		if (!ctl_is_list(ctl))
+			printf("%.*s : %d process(es)\n", (int)strcspn(ctl, "\n"), ctl, cnt);
+		return 0;
+	}
+
+	if (!mask[0] && !rate[0]) {
 		help();
 		exit(0);
 	}
@@ -160,12 +459,34 @@ int main(int argc, char *argv[])
 		strcat(cfgline, ",");
 	}
 
-	strcat(cfgline, "mask=");
-	strcat(cfgline, mask);
+	if (rate[0]) {
+		strcat(cfgline, "rate=");
+		strcat(cfgline, rate);
+		strcat(cfgline, ",");
+	}
+
+	if (mask[0]) {
+		strcat(cfgline, "mask=");
+		strcat(cfgline, mask);
+	} else
+		cfgline[strlen(cfgline) - 1] = '\0';
+
+	if (tail_to) {
+		fprintf(stderr, "   TAIL : %s\n", tail_to);
+		fprintf(stderr, "CFGLINE : %s\n", cfgline);
+		return tail(tail_to, cfgline);
+	}
 
-	printf("  RTCFG : %s\n", rtcfg);
 	printf("CFGLINE : %s\n", cfgline);
 
+	snprintf(cmd, sizeof(cmd), set ? "set\n%s" : "add %s", cfgline);
+	printf("   SENT : %d process(es)\n", ctl_push(pid, cmd));
+
+	/* The file only grow, can not say set */
+	if (!rtcfg || set)
+		return 0;
+
+	printf("  RTCFG : %s\n", rtcfg);
 	fp = fopen(rtcfg, "a");
 	if (!fp) {
 		printf("Open %s failed, errno: %d\n", rtcfg, errno);
@@ -173,6 +494,7 @@ int main(int argc, char *argv[])
 	}
 
 	fprintf(fp, "%s\n", cfgline);
+	fclose(fp);
 
 	return 0;
 }